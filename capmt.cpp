@@ -1,148 +1,407 @@
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <include/uapi/linux/dvb/ca.h>
+#include <linux/dvb/dmx.h>
+#include <algorithm>
+
 #include "capmt.h"
+#include "capmt_msg.h"
+
+ssize_t (*capmt_writev)(int fd, const struct iovec *iov, int iovcnt) = writev;
+capmt_ca_rank_t capmt_ca_rank = NULL;
 
-void send_client_info(int socket)
+#define CAPMT_IOV_MAX		128		// pieces of a reordered CA PMT, a pmt needing more is sent as it is
+#define CAPMT_ES_MAX		32		// streams of a reordered CA PMT
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// cws and ecm sections are a few bytes each, nagle must not hold them back
+void set_tcp_options(int socket)
 {
-	#define INFO_VERSION "dvbcam_tizen"
-	#define DVBAPI_PROTOCOL_VERSION         2
-	
-	int len = sizeof(INFO_VERSION) - 1;                     //ignoring null termination
-	unsigned char buff[7 + len];
-
-	uint32_t req = htonl(DVBAPI_CLIENT_INFO);               //type of request
-	memcpy(&buff[0], &req, 4);
-	int16_t proto_version = htons(DVBAPI_PROTOCOL_VERSION); //supported protocol version
-	memcpy(&buff[4], &proto_version, 2);
-	buff[6] = len;
-	memcpy(&buff[7], &INFO_VERSION, len);                   //copy info string
-	write(socket, buff, sizeof(buff));
+	int on = 1, sndbuf = TCP_SNDBUF_SIZE, rcvbuf = TCP_RCVBUF_SIZE;
+
+	if (setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0 ||
+		setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0 ||
+		setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+		g_message("Unable to set tcp socket options: %s", strerror(errno));
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// a message is no use unless all of it goes out, what is left of a short write would break the stream
+static bool write_msg(dvbapi_link_t* link, const struct iovec* iov, int iovcnt)
+{
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	
+	return capmt_writev(link->fd, iov, iovcnt) == (ssize_t)len;
+}
 
-int recv_server_info(int socket)
+// the first piece of every message, empty below protocol 3
+static struct iovec make_frame(dvbapi_link_t* link, frame_msg_t* frame)
 {
-	uint32_t *request;
-	unsigned char buff[262];	
-  	int cRead = recv(socket, &buff[0], 6, 0);
-	if (cRead == 6)
-	{
-		request = (uint32_t *) &buff;
-		if (ntohl(*(uint32_t *) &buff) == DVBAPI_SERVER_INFO)
-		{
-		  unsigned char len;
+	if (link->protocol < 3)
+		return msg_borrow(frame->data, 0);
+	
+	frame->set<FRAME_START>(DVBAPI_FRAME_START);
+	frame->set<FRAME_MSGID>(++link->msgid);
+	return frame->iov();
+}
 
-		  uint16_t *proto_ver_ptr = (uint16_t *) &buff[4];
-		  uint16_t protocol_version = ntohs(*proto_ver_ptr);
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-		  recv(socket, &len, 1, 0);               	//string length
-		  recv(socket, buff+6, len, 0);
-		  buff[6+len] = 0;                              //terminate the string
-		  g_message("Got SERVER_INFO: %s, protocol_version = %d", &buff[6], protocol_version);
-		  return 1;
-		}
-	}
+// goes out before a protocol is agreed, so never framed
+bool send_client_info(dvbapi_link_t* link)
+{
+	#define INFO_VERSION "dvbcam_tizen"
 	
-	return 0;
+	client_info_msg_t msg;
+	msg.set<CLIENT_INFO_OPCODE>(DVBAPI_CLIENT_INFO);
+	msg.set<CLIENT_INFO_PROTOCOL>(DVBAPI_PROTOCOL_VERSION);
+	msg.set<CLIENT_INFO_LENGTH>(sizeof(INFO_VERSION) - 1);	//ignoring null termination
+	
+	struct iovec iov[] = { msg.iov(), msg_borrow(INFO_VERSION, sizeof(INFO_VERSION) - 1) };
+	return write_msg(link, iov, 2);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void send_stop_dmx(int socket, char dmx)
+bool send_stop_dmx(dvbapi_link_t* link, char dmx)
 {
-	unsigned char cmd[8] = {0x9F, 0x80, 0x3f, 0x04, 0x83, 0x02, 0x00}; 
-	cmd[7] = dmx;
-		
-	write(socket, cmd, 8);
+	frame_msg_t frame;
+	stop_dmx_msg_t msg;
+	msg.set<STOP_DMX_TAG>(0x9F803F04);
+	msg.set<STOP_DMX_CMD>(0x83);
+	msg.set<STOP_DMX_LENGTH>(0x02);
+	msg.set<STOP_DMX_RESERVED>(0x00);
+	msg.set<STOP_DMX_DEMUX>(dmx);
+	
+	struct iovec iov[] = { make_frame(link, &frame), msg.iov() };
+	if (!write_msg(link, iov, 2))
+		return false;
+	
 	g_message("Stop descrambling sent for dmx %d", dmx);
+	return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void send_filter_data(int socket, char idx, char flt, unsigned char *data, int len)
+// the section goes out from where tvs-api delivered it
+bool send_filter_data(dvbapi_link_t* link, char idx, char flt, unsigned char *data, int len)
 {
-  unsigned char buff[6 + len];
-
-  uint32_t req = htonl(DVBAPI_FILTER_DATA);             //type of request
-  memcpy(&buff[0], &req, 4);
-  buff[4] = idx;                                   		//demux
-  buff[5] = flt;                                   		//filter
-  memcpy(buff + 6, data, len);                          //copy filter data
-  write(socket, buff, sizeof(buff));
+	frame_msg_t frame;
+	filter_data_msg_t msg;
+	msg.set<FILTER_DATA_OPCODE>(DVBAPI_FILTER_DATA);
+	msg.set<FILTER_DATA_DEMUX>(idx);
+	msg.set<FILTER_DATA_FILTER>(flt);
+	
+	struct iovec iov[] = { make_frame(link, &frame), msg.iov(), msg_borrow(data, len) };
+	return write_msg(link, iov, 3);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void send_empty_capmt(int socket, char lm, uint16_t service_id, int idx)
+// ca_pmt_tag, list management, program and the demux descriptor; length_field counts from list management on
+static void make_capmt(capmt_header_msg_t* header, capmt_descriptor_msg_t* desc, char lm, uint16_t program_number, int length_field, int program_info_length, int idx)
+{
+	header->set<CAPMT_HDR_TAG>(0x9F803282);					//ca_pmt_tag, 2 following bytes for size
+	header->set<CAPMT_HDR_LENGTH>(length_field);
+	header->set<CAPMT_HDR_LIST_MANAGEMENT>(lm);
+	header->set<CAPMT_HDR_PROGRAM_NUMBER>(program_number);
+	header->set<CAPMT_HDR_VERSION>(0);						//version_number, current_next_indicator
+	header->set<CAPMT_HDR_PROGRAM_INFO_LENGTH>(program_info_length);
+	
+	desc->set<CAPMT_DESC_CMD_ID>(0x01);						//ca_pmt_cmd_id = CAPMT_CMD_OK_DESCRAMBLING
+	desc->set<CAPMT_DESC_TAG>(0x82);						//CAPMT_DESC_DEMUX
+	desc->set<CAPMT_DESC_LENGTH>(0x02);
+	desc->set<CAPMT_DESC_DEMUX>((uint8_t)idx);				//demux id
+	desc->set<CAPMT_DESC_ADAPTER>((uint8_t)idx);			//adapter id
+}
+
+bool send_empty_capmt(dvbapi_link_t* link, char lm, uint16_t service_id, int idx)
 {	
-	uint8_t caPMT[17];
+	frame_msg_t frame;
+	capmt_header_msg_t header;
+	capmt_descriptor_msg_t desc;
+	make_capmt(&header, &desc, lm, service_id, capmt_header_msg_t::size + capmt_descriptor_msg_t::size - 6, 0, idx);
 	
-	//ca_pmt_tag
-	caPMT[0] = 0x9F;
-	caPMT[1] = 0x80;
-	caPMT[2] = 0x32;
-	caPMT[3] = 0x82;              //2 following bytes for size
+	struct iovec iov[] = { make_frame(link, &frame), header.iov(), desc.iov() };
+	return write_msg(link, iov, 3);
+}
 
-	caPMT[4] = 0;				//packet length
-	caPMT[5] = 11;
+typedef struct ca_piece {
+	int rank;
+	const uint8_t* data;
+	int len;
+} ca_piece_t;
+
+// appends a descriptor loop to iov with the CA descriptors reordered by rank among their own positions,
+// everything else stays where it was; returns the length of the loop as sent, -1 if it is broken or does not fit
+static int rank_descriptors(const uint8_t* p, int len, uint16_t program_number, struct iovec* iov, int* n)
+{
+	ca_piece_t ca[CAPMT_IOV_MAX];
+	int slot[CAPMT_IOV_MAX];
+	int cas = 0, first = *n, sent = 0;
 	
-	caPMT[6] = lm; 				//list management
-	caPMT[7] = service_id >> 8 ; 	        //program_number
-	caPMT[8] = service_id & 0xFF;   	   	//program_number
-	caPMT[9] = 0;               //version_number, current_next_indicator
+	for (int i = 0; i < len; )
+	{
+		int dlen = i + 2 <= len ? 2 + p[i + 1] : len;
+		if (i + dlen > len || *n >= CAPMT_IOV_MAX)
+			return -1;
+		
+		if (p[i] == 0x09 && dlen >= 4)
+		{
+			ca_piece_t piece = { capmt_ca_rank(program_number, (p[i + 2] << 8) + p[i + 3]), p + i, dlen };
+			ca[cas] = piece;
+			slot[cas++] = *n;
+		}
+		iov[(*n)++] = msg_borrow(p + i, dlen);
+		i += dlen;
+	}
 	
-	caPMT[10] = 0;            //reserved+program_info_length
-	caPMT[11] = 0;          //reserved+program_info_length (+1 for ca_pmt_cmd_id, +4 for above CAPMT_DESC_DEMUX)
+	// the ones left out sort last, so the CA descriptors kept take the first CA positions
+	std::stable_sort(ca, ca + cas, [](const ca_piece_t& a, const ca_piece_t& b) {
+		return (a.rank < 0) != (b.rank < 0) ? b.rank < 0 : a.rank < b.rank;
+	});
+	for (int c = 0; c < cas; c++)
+		iov[slot[c]] = ca[c].rank < 0 ? msg_borrow(ca[c].data, 0) : msg_borrow(ca[c].data, ca[c].len);
 	
-	caPMT[12] = 0x01;             //ca_pmt_cmd_id = CAPMT_CMD_OK_DESCRAMBLING
-	//adding own descriptor with demux and adapter_id
-	caPMT[13] = 0x82;           //CAPMT_DESC_DEMUX
-	caPMT[14] = 0x02;           //length
-	caPMT[15] = (char)idx;      //demux id
-	caPMT[16] = (char)idx;   	//adapter id
+	int kept = first;
+	for (int k = first; k < *n; k++)
+	{
+		if (!iov[k].iov_len)
+			continue;
+		
+		iov[kept++] = iov[k];
+		sent += iov[k].iov_len;
+	}
+	*n = kept;
+	
+	return sent;
+}
 
-	write(socket, caPMT, 17);	
+// still no copy of the pmt: its descriptors are sent as iovecs of their own, only the stream headers are made again
+// since their ES_info_length changes when a CA descriptor is left out
+static bool send_ranked_pmt(dvbapi_link_t* link, char lm, unsigned char* buf, int len, int idx, bool* sent)
+{
+	struct iovec iov[CAPMT_IOV_MAX];
+	uint8_t streams[CAPMT_ES_MAX][5];
+	uint16_t program_number = (buf[3] << 8) + buf[4];
+	int end = len - 4;				// CRC
+	int info = ((buf[10] & 0x0F) << 8) + buf[11];
+	if (12 + info > end)
+		return false;
+	
+	int n = 3;						// frame, header and demux descriptor
+	int program_info = rank_descriptors(buf + 12, info, program_number, iov, &n);
+	if (program_info < 0)
+		return false;
+	
+	int body = program_info, es = 0;
+	for (int p = 12 + info; p < end; es++)
+	{
+		if (p + 5 > end || es == CAPMT_ES_MAX || n == CAPMT_IOV_MAX)
+			return false;
+		
+		int es_info = ((buf[p + 3] & 0x0F) << 8) + buf[p + 4];
+		if (p + 5 + es_info > end)
+			return false;
+		
+		int header = n++;
+		int sent = rank_descriptors(buf + p + 5, es_info, program_number, iov, &n);
+		if (sent < 0)
+			return false;
+		
+		uint8_t* h = streams[es];
+		memcpy(h, buf + p, 3);
+		h[3] = (buf[p + 3] & 0xF0) | (sent >> 8);
+		h[4] = sent & 0xFF;
+		iov[header] = msg_borrow(h, 5);
+		
+		body += 5 + sent;
+		p += 5 + es_info;
+	}
+	
+	frame_msg_t frame;
+	capmt_header_msg_t hdr;
+	capmt_descriptor_msg_t desc;
+	make_capmt(&hdr, &desc, lm, program_number, capmt_header_msg_t::size + capmt_descriptor_msg_t::size - 6 + body, program_info + capmt_descriptor_msg_t::size, idx);
+	
+	iov[0] = make_frame(link, &frame);
+	iov[1] = hdr.iov();
+	iov[2] = desc.iov();
+	*sent = write_msg(link, iov, n);
+	return true;
 }
 
-void send_pmt(int socket, char lm, unsigned char* buf, int idx)
+// the pmt is not copied, its program info and streams follow the generated header as they are (or ranked, see capmt_ca_rank);
+// a broken pmt is not sent, which is no fault of the socket
+bool send_pmt(dvbapi_link_t* link, char lm, unsigned char* buf, int idx)
 {	
 	int len = 3 + ((buf[1] & 0x0F) << 8) + buf[2];
-	if( len > 4096 )
+	if( len > 4096 || len < 16 )
 	{
 		g_message("Unable to send pmt, wrong length: %d", len);
-		return;
+		return true;
 	}
 	
-	unsigned char caPMT[4112]; 
-	int program_info_length = ((buf[10] & 0x0F) << 8) + buf[11] + 4 + 1;	//program_info_length (+1 for ca_pmt_cmd_id, +4 for CAPMT_DESC_DEMUX)
-	int length_field = len - 5;	// 17 - 6 + len - 4 - 12
+	bool sent;
+	if (capmt_ca_rank && send_ranked_pmt(link, lm, buf, len, idx, &sent))
+	{
+		if (sent)
+			g_message("PMT sent for demux: %d (CA descriptors ranked)", idx);
+		return sent;
+	}
+	
+	int program_info_length = ((buf[10] & 0x0F) << 8) + buf[11] + capmt_descriptor_msg_t::size;	//+1 for ca_pmt_cmd_id, +4 for CAPMT_DESC_DEMUX
+	int slice = len - 12 - 4;		// from program_info on, dont send the last 4 bytes (CRC)
+	int length_field = capmt_header_msg_t::size + capmt_descriptor_msg_t::size - 6 + slice;
+	
+	frame_msg_t frame;
+	capmt_header_msg_t header;
+	capmt_descriptor_msg_t desc;
+	make_capmt(&header, &desc, lm, (buf[3] << 8) + buf[4], length_field, program_info_length, idx);
+	
+	struct iovec iov[] = { make_frame(link, &frame), header.iov(), desc.iov(), msg_borrow(buf + 12, slice) };
+	if (!write_msg(link, iov, 4))
+		return false;
+	
+	g_message("PMT sent for demux: %d", idx);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the request without its frame
+static int parse_message(unsigned char *buf, int len, dvbapi_request_t *req)
+{
+	if (len < 4)
+		return 0;
+
+	req->opcode = ntohl(*(uint32_t *) buf);
+
+	if (req->opcode == DVBAPI_SERVER_INFO)
+	{
+		// protocol version + length prefixed info string
+		if (len < 7 || len < 7 + buf[6])
+			return 0;
+
+		req->adapter = 0;
+		req->data = buf + 4;
+		req->len = 3 + buf[6];
+		return 4 + req->len;
+	}
+
+	if (len < 5)
+		return 0;
+
+	req->adapter = buf[4];
+	req->data = buf + 5;
+
+	if (req->opcode == CA_SET_PID)
+		req->len = sizeof(ca_pid_t);
+	else if (req->opcode == CA_SET_DESCR)
+		req->len = sizeof(ca_descr_t);
+	else if (req->opcode == DMX_SET_FILTER)
+		req->len = sizeof(dmx_sct_filter_params);
+	else if (req->opcode == DMX_STOP)
+		req->len = 2 + 2;
+	else if (req->opcode == DVBAPI_CA_SET_DESCR_MODE)
+		req->len = 3 * 4;
+	else if (req->opcode == DVBAPI_CA_SET_DESCR_DATA)
+	{
+		// 4 fields, the last one is the length of the data following them
+		if (len < 5 + 16)
+			return 0;
+
+		uint32_t length = ntohl(*(uint32_t *) &req->data[12]);
+		if (length > CA_DATA_MAX)
+			return -1;
+
+		req->len = 16 + length;
+	}
+	else if (req->opcode == DVBAPI_ECM_INFO)
+	{
+		// 14 fixed bytes, 4 length prefixed strings, hops
+		int p = 14;
+		for (int i = 0; i < 4; i++)
+		{
+			if (len < 5 + p + 1)
+				return 0;
+			p += 1 + req->data[p];
+		}
+		req->len = p + 1;
+	}
+	else
+		return -1;
 
-	//ca_pmt_tag
-	caPMT[0] = 0x9F;
-	caPMT[1] = 0x80;
-	caPMT[2] = 0x32;
-	caPMT[3] = 0x82;              //2 following bytes for size
+	return len < 5 + req->len ? 0 : 5 + req->len;
+}
 
-	caPMT[4] = length_field >> 8;
-	caPMT[5] = length_field & 0xff;
+// returns the size of the request at the start of buf, 0 if it is not complete yet, -1 if it is unknown
+int parse_request(unsigned char *buf, int len, dvbapi_request_t *req)
+{
+	if (len < 1 || buf[0] != DVBAPI_FRAME_START)
+	{
+		req->msgid = 0;
+		return parse_message(buf, len, req);
+	}
 	
-	caPMT[6] = lm; 				//list management
-	caPMT[7] = buf[3];          //program_number
-	caPMT[8] = buf[4];        	//program_number
-	caPMT[9] = 0;               //version_number, current_next_indicator
+	if (len < 5)
+		return 0;
 	
-	caPMT[10] = program_info_length >> 8;            //reserved+program_info_length
-	caPMT[11] = program_info_length & 0xFF;          //reserved+program_info_length (+1 for ca_pmt_cmd_id, +4 for above CAPMT_DESC_DEMUX)
+	int n = parse_message(buf + 5, len - 5, req);
+	req->msgid = ntohl(*(uint32_t *) &buf[1]);
+	return n > 0 ? 5 + n : n;
+}
+
+// parse_request made sure the strings and the hops are there, the strings only have to be cut to fit
+bool parse_ecm_info(dvbapi_request_t *req, ecm_info_t *info)
+{
+	if (req->opcode != DVBAPI_ECM_INFO || req->len < 14 + 4 + 1)
+		return false;
 	
-	caPMT[12] = 0x01;             //ca_pmt_cmd_id = CAPMT_CMD_OK_DESCRAMBLING
-	//adding own descriptor with demux and adapter_id
-	caPMT[13] = 0x82;           //CAPMT_DESC_DEMUX
-	caPMT[14] = 0x02;           //length
-	caPMT[15] = (char)idx;      //demux id
-	caPMT[16] = (char)idx;  	//adapter id
+	uint8_t* d = req->data;
+	char* strings[] = { info->cardsystem, info->reader, info->from, info->protocol };
+	for (int i = 0, p = 14; i < 4; i++)
+	{
+		int len = std::min((int)d[p], ECM_INFO_STRING - 1);
+		memcpy(strings[i], d + p + 1, len);
+		strings[i][len] = 0;
+		p += 1 + d[p];
+	}
+	
+	info->service_id = (d[0] << 8) | d[1];
+	info->caid = (d[2] << 8) | d[3];
+	info->pid = (d[4] << 8) | d[5];
+	info->provider = (d[6] << 24) | (d[7] << 16) | (d[8] << 8) | d[9];
+	info->ecm_time = (d[10] << 24) | (d[11] << 16) | (d[12] << 8) | d[13];
+	info->hops = d[req->len - 1];
+	return true;
+}
 
-	memcpy(caPMT + 17, buf + 12, len - 16);  //copy pmt data starting at program_info block
+// dmx_ca_type and key length (per parity) for a protocol 3 descrambling mode, false if the hardware has no such mode
+bool get_descr_mode(uint32_t algo, uint32_t cipher_mode, dmx_ca_type_t *ca_type, int *key_len)
+{
+	if (algo == CA_ALGO_DVBCSA)
+	{
+		*ca_type = DMX_CA_DVB_CSA;
+		*key_len = 8;
+	}
+	else if (algo == CA_ALGO_DES && cipher_mode == CA_MODE_ECB)
+	{
+		*ca_type = DMX_CA_DES_ECB;
+		*key_len = 8;
+	}
+	else if (algo == CA_ALGO_AES128)
+	{
+		*ca_type = cipher_mode == CA_MODE_CBC ? DMX_CA_AES_CBC : DMX_CA_AES_ECB;
+		*key_len = 16;
+	}
+	else
+		return false;
 
-	write(socket, caPMT, length_field + 6);	// dont send the last 4 bytes (CRC)
-	
-	g_message("PMT sent for demux: %d", idx);
+	return true;
 }
\ No newline at end of file
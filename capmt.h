@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/unistd.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <linux/types.h>
 
@@ -41,6 +42,27 @@ typedef struct ca_config {
 #define DVBAPI_SERVER_INFO     0xFFFF0002
 #define DVBAPI_ECM_INFO        0xFFFF0003
 
+#define DVBAPI_PROTOCOL_VERSION    3
+
+// protocol 3: a start byte and a message id ahead of every message after CLIENT_INFO
+#define DVBAPI_FRAME_START         0xA5
+
+// protocol 3: descrambling algorithm per cw index, keys longer than 8 bytes
+#define DVBAPI_CA_SET_DESCR_MODE   0x400C6F88		// index, algo, cipher_mode
+#define DVBAPI_CA_SET_DESCR_DATA   0x40186F89		// index, parity, data_type, length, data[length]
+
+#define CA_ALGO_DVBCSA             0
+#define CA_ALGO_DES                1
+#define CA_ALGO_AES128             2
+
+#define CA_MODE_ECB                0
+#define CA_MODE_CBC                1
+
+#define CA_DATA_IV                 0
+#define CA_DATA_KEY                1
+
+#define CA_DATA_MAX                32				// longest key or iv accepted
+
 #define CAPMT_LIST_MORE            0x00
 #define CAPMT_LIST_FIRST           0x01
 #define CAPMT_LIST_LAST            0x02
@@ -48,10 +70,58 @@ typedef struct ca_config {
 #define CAPMT_LIST_ADD             0x04
 #define CAPMT_LIST_UPDATE          0x05
 
-void send_client_info(int socket);
-int recv_server_info(int socket);
-void send_stop_dmx(int socket, char dmx);
-void send_filter_data(int socket, char idx, char flt, unsigned char *data, int len);
-void send_pmt(int socket, char lm, unsigned char* buf, int idx);
+#define TCP_SNDBUF_SIZE		(64 * 1024)		// a burst of CA PMTs and emm sections
+#define TCP_RCVBUF_SIZE		(16 * 1024)		// requests are small
+
+#define ECM_INFO_STRING			32				// longer card system, reader, source and protocol names are cut
+
+typedef struct ecm_info {
+	uint16_t service_id;		// program number
+	uint16_t caid;
+	uint16_t pid;
+	uint32_t provider;
+	uint32_t ecm_time;			// ms
+	char cardsystem[ECM_INFO_STRING];
+	char reader[ECM_INFO_STRING];
+	char from[ECM_INFO_STRING];	// source: the card, a cache or the peer the cw came from
+	char protocol[ECM_INFO_STRING];
+	uint8_t hops;				// 0 for a local card
+} ecm_info_t;
+
+// one end of a dvbapi connection, written to by the send_* functions
+typedef struct dvbapi_link {
+	int fd;						// -1 if not connected
+	uint16_t protocol;			// agreed with SERVER_INFO, 0 until then; messages are framed from 3 on
+	uint32_t msgid;				// id of the last framed message sent
+} dvbapi_link_t;
+
+typedef struct dvbapi_request {
+	uint32_t opcode;			// host byte order
+	uint32_t msgid;				// 0 if the request came without a frame
+	uint8_t adapter;			// adapter index (not sent with DVBAPI_SERVER_INFO)
+	unsigned char *data;		// payload following the opcode and adapter index
+	int len;					// payload length
+} dvbapi_request_t;
+
+// all messages are written through this, so they can be redirected (e.g. to a byte sink in capmt_bench)
+extern ssize_t (*capmt_writev)(int fd, const struct iovec *iov, int iovcnt);
+
+// CA descriptors of a CA PMT are sent by rank, lowest first, equal ranks in broadcast order and a negative rank leaves the descriptor out;
+// they only swap places among themselves, the other descriptors stay where they were
+typedef int (*capmt_ca_rank_t)(uint16_t program_number, uint16_t caid);
+extern capmt_ca_rank_t capmt_ca_rank;		// NULL sends the pmt as it is
+
+void set_tcp_options(int socket);
+
+// false if the socket did not take the whole message (on a non-blocking socket also if it would have blocked)
+bool send_client_info(dvbapi_link_t *link);
+bool send_stop_dmx(dvbapi_link_t *link, char dmx);
+bool send_filter_data(dvbapi_link_t *link, char idx, char flt, unsigned char *data, int len);
+bool send_empty_capmt(dvbapi_link_t *link, char lm, uint16_t service_id, int idx);
+bool send_pmt(dvbapi_link_t *link, char lm, unsigned char* buf, int idx);
+// a framed request is taken whatever the protocol, the start byte is never the first byte of an opcode
+int parse_request(unsigned char *buf, int len, dvbapi_request_t *req);
+bool parse_ecm_info(dvbapi_request_t *req, ecm_info_t *info);
+bool get_descr_mode(uint32_t algo, uint32_t cipher_mode, dmx_ca_type_t *ca_type, int *key_len);
 
 #endif
\ No newline at end of file
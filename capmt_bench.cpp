@@ -0,0 +1,567 @@
+/*
+	capmt_bench - microbenchmark of the dvbapi message builders, the request decoder and the cw round trip over unix and tcp sockets
+
+	usage: capmt_bench [-b baseline] [-w baseline]
+		-b	compare against a baseline file, exit code 1 on regressions
+		-w	write the results as new baseline file
+
+	the builders are first checked byte for byte against what they sent before capmt_msg.h, and framed as protocol 3 has it,
+	the decoder against framed requests; exit code 1 if one differs
+*/
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <map>
+#include <string>
+
+#include <include/uapi/linux/dvb/ca.h>
+#include <linux/dvb/dmx.h>
+
+#include "capmt.h"
+
+#define ITERATIONS			200000
+#define CW_ITERATIONS		20000		// socket round trips are ~1000x slower than the builders
+#define MAX_REGRESSION		25			// allowed slow down in percent before a result counts as regression
+
+typedef struct result {
+	double ns;							// ns/op
+	double bytes;						// bytes/op
+} result_t;
+
+static std::map<std::string, result_t> g_results;
+static uint64_t g_bytes = 0;
+static std::string* g_capture = NULL;		// the bytes sent, while the builders are checked
+static dvbapi_link_t g_link = { 0, 0, 0 };	// protocol 2, unframed
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static ssize_t byte_sink( int fd, const struct iovec *iov, int iovcnt )
+{
+	size_t count = 0;
+	for(int i = 0; i < iovcnt; i++)
+	{
+		if(g_capture)
+			g_capture->append((const char *)iov[i].iov_base, iov[i].iov_len);
+		count += iov[i].iov_len;
+	}
+
+	g_bytes += count;
+	return count;
+}
+
+static void null_log_handler( const gchar *log_domain, GLogLevelFlags log_level, const gchar *message, gpointer user_data )
+{
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define BENCH(name, op)																\
+	do {																			\
+		g_bytes = 0;																\
+		uint64_t start = now_ns();													\
+		for(int i = 0; i < ITERATIONS; i++)											\
+			op;																		\
+		result_t res = { (double)(now_ns() - start) / ITERATIONS, (double)g_bytes / ITERATIONS };	\
+		g_results[name] = res;														\
+		printf("%-32s %10.1f ns/op %8.1f bytes/op\n", std::string(name).c_str(), res.ns, res.bytes);	\
+	} while(0)
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// builds a pmt section of the given total size (including crc), filled with CA descriptors
+static void build_pmt( unsigned char *pmt, int size )
+{
+	int section_length = size - 3;
+	int program_info_length = size - 16;
+
+	memset(pmt, 0, size);
+	pmt[0] = 0x02;
+	pmt[1] = 0xB0 | (section_length >> 8);
+	pmt[2] = section_length & 0xFF;
+	pmt[3] = 0x13;						// program_number
+	pmt[4] = 0x88;
+	pmt[5] = 0xC1;
+	pmt[8] = 0xE1;						// PCR pid
+	pmt[9] = 0x00;
+	pmt[10] = 0xF0 | (program_info_length >> 8);
+	pmt[11] = program_info_length & 0xFF;
+
+	int p = 12, rem = program_info_length;
+	while(rem > 0)
+	{
+		int d = rem > 257 ? 257 : rem;
+		if(rem - d == 1)
+			d -= 2;
+
+		pmt[p] = 0x09;					// CA_descriptor
+		pmt[p + 1] = d - 2;
+		pmt[p + 2] = 0x18;				// CA_system_id
+		pmt[p + 3] = 0x30;
+		p += d;
+		rem -= d;
+	}
+}
+
+static int build_request( unsigned char *buf, uint32_t opcode )
+{
+	uint32_t op = htonl(opcode);
+	memcpy(buf, &op, 4);
+
+	if(opcode == DVBAPI_SERVER_INFO)
+	{
+		buf[4] = 0;
+		buf[5] = 2;
+		buf[6] = 9;
+		memcpy(&buf[7], "OSCam 1.2", 9);
+		return 7 + 9;
+	}
+
+	buf[4] = 0;							// adapter
+
+	if(opcode == CA_SET_PID)
+		return 5 + sizeof(ca_pid_t);
+	else if(opcode == CA_SET_DESCR)
+		return 5 + sizeof(ca_descr_t);
+	else if(opcode == DMX_SET_FILTER)
+		return 5 + sizeof(dmx_sct_filter_params);
+	else if(opcode == DMX_STOP)
+		return 5 + 4;
+	else if(opcode == DVBAPI_CA_SET_DESCR_MODE)
+		return 5 + 3 * 4;
+	else if(opcode == DVBAPI_CA_SET_DESCR_DATA)
+	{
+		// an AES key
+		memset(&buf[5], 0, 16);
+		buf[5 + 15] = 16;
+		return 5 + 16 + 16;
+	}
+
+	// DVBAPI_ECM_INFO
+	const char *str[4] = { "nagra", "local_card", "local", "internal" };
+	int p = 5 + 14;
+	for(int i = 0; i < 4; i++)
+	{
+		buf[p] = strlen(str[i]);
+		memcpy(&buf[p + 1], str[i], buf[p]);
+		p += 1 + buf[p];
+	}
+	buf[p] = 0;							// hops
+
+	return p + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static const uint8_t golden_client_info[] = {
+	0xFF, 0xFF, 0x00, 0x01, 0x00, 0x03, 0x0C, 0x64, 0x76, 0x62, 0x63, 0x61, 0x6D, 0x5F, 0x74, 0x69,
+	0x7A, 0x65, 0x6E,
+};
+
+static const uint8_t golden_stop_dmx[] = {
+	0x9F, 0x80, 0x3F, 0x04, 0x83, 0x02, 0x00, 0x01,
+};
+
+static const uint8_t golden_empty_capmt[] = {
+	0x9F, 0x80, 0x32, 0x82, 0x00, 0x0B, 0x03, 0x13, 0x88, 0x00, 0x00, 0x00, 0x01, 0x82, 0x02, 0x02,
+	0x02,
+};
+
+static const uint8_t golden_filter_data[] = {
+	0xFF, 0xFF, 0x00, 0x00, 0x01, 0x03, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+};
+
+static const uint8_t golden_pmt_20[] = {
+	0x9F, 0x80, 0x32, 0x82, 0x00, 0x0F, 0x03, 0x13, 0x88, 0x00, 0x00, 0x09, 0x01, 0x82, 0x02, 0x01,
+	0x01, 0x09, 0x02, 0x18, 0x30,
+};
+
+static const uint8_t golden_pmt_64[] = {
+	0x9F, 0x80, 0x32, 0x82, 0x00, 0x3B, 0x05, 0x13, 0x88, 0x00, 0x00, 0x35, 0x01, 0x82, 0x02, 0x00,
+	0x00, 0x09, 0x2E, 0x18, 0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x28, 0x29, 0x2A,
+	0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A,
+	0x3B,
+};
+
+// program info: a private descriptor and CAIDs 1830 and 0100, one stream with CAID 0500 and a language descriptor
+static const uint8_t ranked_pmt[] = {
+	0x02, 0xB0, 0x2E, 0x13, 0x88, 0xC1, 0x00, 0x00, 0xE1, 0x00, 0xF0, 0x10,
+	0x09, 0x04, 0x18, 0x30, 0xE1, 0x00, 0x09, 0x04, 0x01, 0x00, 0xE2, 0x00, 0x0E, 0x02, 0xAA, 0xBB,
+	0x02, 0xE1, 0x01, 0xF0, 0x0C, 0x09, 0x04, 0x05, 0x00, 0xE3, 0x00, 0x0A, 0x04, 0x65, 0x6E, 0x67, 0x00,
+	0xAA, 0xBB, 0xCC, 0xDD,
+};
+
+// 0100 ahead of 1830 in the CA positions, the private descriptor kept last, 0500 left out and the stream's
+// ES_info_length shortened
+static const uint8_t golden_pmt_ranked[] = {
+	0x9F, 0x80, 0x32, 0x82, 0x00, 0x26, 0x03, 0x13, 0x88, 0x00, 0x00, 0x15, 0x01, 0x82, 0x02, 0x01,
+	0x01, 0x09, 0x04, 0x01, 0x00, 0xE2, 0x00, 0x09, 0x04, 0x18, 0x30, 0xE1, 0x00, 0x0E, 0x02, 0xAA,
+	0xBB, 0x02, 0xE1, 0x01, 0xF0, 0x06, 0x0A, 0x04, 0x65, 0x6E, 0x67, 0x00,
+};
+
+static int rank_by_caid( uint16_t program_number, uint16_t caid )
+{
+	return caid == 0x0500 ? -1 : caid;
+}
+
+static int rank_equal( uint16_t program_number, uint16_t caid )
+{
+	return 0;
+}
+
+static int check_golden( const char *name, std::string *sent, const uint8_t *expected, size_t size )
+{
+	bool ok = sent->size() == size && !memcmp(sent->data(), expected, size);
+	printf("%-32s %s\n", (std::string("golden.") + name).c_str(), ok ? "ok" : "MISMATCH");
+
+	sent->clear();
+	return ok ? 0 : 1;
+}
+
+// protocol 3: the same message behind the start byte and the message id
+static int check_framed( const char *name, std::string *sent, uint32_t msgid, const uint8_t *expected, size_t size )
+{
+	uint8_t framed[5 + 4096] = { DVBAPI_FRAME_START, (uint8_t)(msgid >> 24), (uint8_t)(msgid >> 16), (uint8_t)(msgid >> 8), (uint8_t)msgid };
+	memcpy(framed + 5, expected, size);
+
+	return check_golden((std::string(name) + ".framed").c_str(), sent, framed, 5 + size);
+}
+
+// what the builders sent before the layouts, including the crc left out and the reserved bits not set in program_info_length
+static int check_builders()
+{
+	std::string sent;
+	unsigned char pmt[4096], section[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	int failures = 0;
+
+	g_capture = &sent;
+
+	send_client_info(&g_link);
+	failures += check_golden("send_client_info", &sent, golden_client_info, sizeof(golden_client_info));
+	send_stop_dmx(&g_link, 1);
+	failures += check_golden("send_stop_dmx", &sent, golden_stop_dmx, sizeof(golden_stop_dmx));
+	send_empty_capmt(&g_link, CAPMT_LIST_ONLY, 0x1388, 2);
+	failures += check_golden("send_empty_capmt", &sent, golden_empty_capmt, sizeof(golden_empty_capmt));
+	send_filter_data(&g_link, 1, 3, section, sizeof(section));
+	failures += check_golden("send_filter_data", &sent, golden_filter_data, sizeof(golden_filter_data));
+
+	build_pmt(pmt, 20);
+	pmt[16] = 0xAA;						// crc
+	pmt[19] = 0xCC;
+	send_pmt(&g_link, CAPMT_LIST_ONLY, pmt, 1);
+	failures += check_golden("send_pmt.20", &sent, golden_pmt_20, sizeof(golden_pmt_20));
+
+	build_pmt(pmt, 64);
+	for(int i = 40; i < 64; i++)
+		pmt[i] = i;
+	send_pmt(&g_link, CAPMT_LIST_UPDATE, pmt, 0);
+	failures += check_golden("send_pmt.64", &sent, golden_pmt_64, sizeof(golden_pmt_64));
+
+	// ranking without a change in order is the pmt as it is
+	capmt_ca_rank = rank_equal;
+	send_pmt(&g_link, CAPMT_LIST_UPDATE, pmt, 0);
+	failures += check_golden("send_pmt.64.ranked", &sent, golden_pmt_64, sizeof(golden_pmt_64));
+
+	capmt_ca_rank = rank_by_caid;
+	send_pmt(&g_link, CAPMT_LIST_ONLY, (unsigned char*)ranked_pmt, 1);
+	failures += check_golden("send_pmt.ranked", &sent, golden_pmt_ranked, sizeof(golden_pmt_ranked));
+	capmt_ca_rank = NULL;
+
+	// every message after CLIENT_INFO once protocol 3 is agreed, the message id counts up
+	dvbapi_link_t link = { 0, 3, 0x11223343 };
+	send_stop_dmx(&link, 1);
+	failures += check_framed("send_stop_dmx", &sent, 0x11223344, golden_stop_dmx, sizeof(golden_stop_dmx));
+	send_empty_capmt(&link, CAPMT_LIST_ONLY, 0x1388, 2);
+	failures += check_framed("send_empty_capmt", &sent, 0x11223345, golden_empty_capmt, sizeof(golden_empty_capmt));
+	send_filter_data(&link, 1, 3, section, sizeof(section));
+	failures += check_framed("send_filter_data", &sent, 0x11223346, golden_filter_data, sizeof(golden_filter_data));
+	send_pmt(&link, CAPMT_LIST_UPDATE, pmt, 0);
+	failures += check_framed("send_pmt.64", &sent, 0x11223347, golden_pmt_64, sizeof(golden_pmt_64));
+
+	capmt_ca_rank = rank_by_caid;
+	send_pmt(&link, CAPMT_LIST_ONLY, (unsigned char*)ranked_pmt, 1);
+	failures += check_framed("send_pmt.ranked", &sent, 0x11223348, golden_pmt_ranked, sizeof(golden_pmt_ranked));
+	capmt_ca_rank = NULL;
+
+	g_capture = NULL;
+	return failures;
+}
+
+// the SERVER_INFO of an oscam agreeing on protocol 3 comes framed already, so does everything after it
+static int check_decoder()
+{
+	unsigned char buf[64] = { DVBAPI_FRAME_START, 0x00, 0x00, 0x00, 0x07 };
+	dvbapi_request_t request;
+	int failures = 0;
+
+	const uint32_t opcodes[] = { DVBAPI_SERVER_INFO, CA_SET_DESCR, DVBAPI_CA_SET_DESCR_MODE };
+	for(uint32_t opcode : opcodes)
+	{
+		int len = 5 + build_request(buf + 5, opcode);
+		bool ok = parse_request(buf, len, &request) == len && request.opcode == opcode && request.msgid == 7 &&
+			parse_request(buf, len - 1, &request) == 0 && parse_request(buf, 3, &request) == 0;
+
+		printf("%-32s %08x %s\n", "golden.parse_request.framed", opcode, ok ? "ok" : "MISMATCH");
+		failures += !ok;
+	}
+
+	return failures;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// dvbcam side: decodes the requests with the same parser and acknowledges every cw with one byte
+static gpointer cw_server( gpointer data )
+{
+	int fd = (int)(intptr_t)data;
+	unsigned char buf[1024];
+	int buffered = 0, nread, n;
+	dvbapi_request_t request;
+
+	while((nread = recv(fd, buf + buffered, sizeof(buf) - buffered, 0)) > 0)
+	{
+		buffered += nread;
+
+		int p = 0;
+		while((n = parse_request(buf + p, buffered - p, &request)) > 0)
+		{
+			if(request.opcode == CA_SET_DESCR)
+				write(fd, "", 1);
+			p += n;
+		}
+
+		buffered -= p;
+		memmove(buf, buf + p, buffered);
+	}
+
+	close(fd);
+	return NULL;
+}
+
+// oscam side: CA_SET_DESCR to the acknowledgement, bytes/op is the request size
+static void bench_cw_round_trip( const char *name, int client, int server )
+{
+	GThread *thread = g_thread_new("cw_server", cw_server, (gpointer)(intptr_t)server);
+
+	unsigned char frame[64] = {0};
+	int len = build_request(frame, CA_SET_DESCR);
+	char ack;
+
+	uint64_t start = now_ns();
+	for(int i = 0; i < CW_ITERATIONS; i++)
+	{
+		write(client, frame, len);
+		recv(client, &ack, 1, MSG_WAITALL);
+	}
+
+	result_t res = { (double)(now_ns() - start) / CW_ITERATIONS, (double)len };
+	g_results[name] = res;
+	printf("%-32s %10.1f ns/op %8.1f bytes/op\n", name, res.ns, res.bytes);
+
+	close(client);
+	g_thread_join(thread);
+}
+
+static int bench_cw_unix()
+{
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return 1;
+
+	bench_cw_round_trip("cw_round_trip.unix", sv[0], sv[1]);
+	return 0;
+}
+
+// loopback connection set up like dvbcam's tcp listener
+static int bench_cw_tcp()
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	set_tcp_options(listener);
+	if(listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+		getsockname(listener, (struct sockaddr *)&addr, &addrlen) < 0)
+		return 1;
+
+	int client = socket(AF_INET, SOCK_STREAM, 0);
+	set_tcp_options(client);
+	if(connect(client, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		return 1;
+
+	int server = accept(listener, NULL, NULL);
+	close(listener);
+	if(server < 0)
+		return 1;
+
+	set_tcp_options(server);
+	bench_cw_round_trip("cw_round_trip.tcp", client, server);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int write_baseline( const char *name )
+{
+	FILE *f = fopen(name, "w");
+	if(!f)
+	{
+		printf("Unable to write %s\n", name);
+		return 1;
+	}
+
+	fprintf(f, "# name ns/op bytes/op\n");
+	for(auto && r : g_results)
+		fprintf(f, "%s %.1f %.1f\n", r.first.c_str(), r.second.ns, r.second.bytes);
+
+	fclose(f);
+	return 0;
+}
+
+static int compare_baseline( const char *name )
+{
+	FILE *f = fopen(name, "r");
+	if(!f)
+	{
+		printf("Unable to read %s\n", name);
+		return 1;
+	}
+
+	char line[256], bench[128];
+	result_t base;
+	int regressions = 0;
+
+	printf("\ncompared to %s:\n", name);
+	while(fgets(line, sizeof(line), f))
+	{
+		if(line[0] == '#' || sscanf(line, "%127s %lf %lf", bench, &base.ns, &base.bytes) != 3)
+			continue;
+
+		if(!g_results.count(bench))
+		{
+			printf("%-32s missing\n", bench);
+			regressions++;
+			continue;
+		}
+
+		result_t r = g_results[bench];
+		double delta = (r.ns - base.ns) * 100 / base.ns;
+		bool failed = delta > MAX_REGRESSION || r.bytes != base.bytes;
+
+		printf("%-32s %+7.1f%% %s\n", bench, delta, failed ? (r.bytes != base.bytes ? "OUTPUT CHANGED" : "REGRESSION") : "");
+		regressions += failed;
+	}
+
+	fclose(f);
+	return regressions ? 1 : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int main( int argc, char *argv[] )
+{
+	const char *baseline = NULL, *new_baseline = NULL;
+	int opt;
+
+	while((opt = getopt(argc, argv, "b:w:")) != -1)
+	{
+		if(opt == 'b')
+			baseline = optarg;
+		else if(opt == 'w')
+			new_baseline = optarg;
+		else
+		{
+			printf("usage: %s [-b baseline] [-w baseline]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	g_log_set_handler(G_LOG_DOMAIN, G_LOG_LEVEL_MASK, null_log_handler, NULL);
+	capmt_writev = byte_sink;
+	
+	if(check_builders() || check_decoder())
+		return 1;
+	printf("\n");
+
+	// builders
+	BENCH("send_client_info", send_client_info(&g_link));
+	BENCH("send_stop_dmx", send_stop_dmx(&g_link, 1));
+	BENCH("send_empty_capmt", send_empty_capmt(&g_link, CAPMT_LIST_ONLY, 0x1388, 0));
+
+	unsigned char data[4096];
+	memset(data, 0x5A, sizeof(data));
+	BENCH("send_filter_data.ecm", send_filter_data(&g_link, 0, 1, data, 184));
+	BENCH("send_filter_data.emm", send_filter_data(&g_link, 0, 2, data, 1024));
+
+	const int pmt_sizes[] = { 20, 64, 256, 1024, 4096 };
+	unsigned char pmt[4096];
+	for(int size : pmt_sizes)
+	{
+		build_pmt(pmt, size);
+		BENCH("send_pmt." + std::to_string(size), send_pmt(&g_link, CAPMT_LIST_ONLY, pmt, 0));
+	}
+
+	capmt_ca_rank = rank_by_caid;
+	BENCH("send_pmt.ranked", send_pmt(&g_link, CAPMT_LIST_ONLY, (unsigned char*)ranked_pmt, 0));
+	capmt_ca_rank = NULL;
+
+	dvbapi_link_t framed = { 0, 3, 0 };
+	BENCH("send_pmt.framed", send_pmt(&framed, CAPMT_LIST_ONLY, pmt, 0));
+
+	// request decoder
+	const struct { const char *name; uint32_t opcode; } requests[] = {
+		{ "parse_request.server_info", DVBAPI_SERVER_INFO },
+		{ "parse_request.ecm_info", DVBAPI_ECM_INFO },
+		{ "parse_request.ca_set_pid", CA_SET_PID },
+		{ "parse_request.ca_set_descr", CA_SET_DESCR },
+		{ "parse_request.dmx_set_filter", DMX_SET_FILTER },
+		{ "parse_request.dmx_stop", DMX_STOP },
+		{ "parse_request.ca_set_descr_mode", DVBAPI_CA_SET_DESCR_MODE },
+		{ "parse_request.ca_set_descr_data", DVBAPI_CA_SET_DESCR_DATA },
+	};
+
+	unsigned char buf[1024] = {0};
+	dvbapi_request_t request;
+	for(auto && r : requests)
+	{
+		int len = build_request(buf, r.opcode);
+		if(parse_request(buf, len, &request) != len)
+		{
+			printf("%s: wrong request size\n", r.name);
+			return 1;
+		}
+
+		// bytes/op is the decoded request size
+		BENCH(r.name, g_bytes += parse_request(buf, len, &request));
+	}
+
+	// transport
+	if(bench_cw_unix() || bench_cw_tcp())
+	{
+		printf("cw_round_trip: socket setup failed\n");
+		return 1;
+	}
+
+	if(new_baseline && write_baseline(new_baseline))
+		return 1;
+
+	return baseline ? compare_baseline(baseline) : 0;
+}
@@ -0,0 +1,104 @@
+#ifndef _CAPMT_MSG_H_
+#define _CAPMT_MSG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// dvbapi messages as fixed layouts: sizes and field offsets are worked out by the compiler, fields are stored big endian;
+// the variable part of a message (a pmt, a section, a string) is not copied but sent as an iovec of its own
+
+template<int Size> struct msg_field
+{
+	static constexpr int size = Size;
+};
+
+typedef msg_field<1> msg_u8;
+typedef msg_field<2> msg_u16;
+typedef msg_field<4> msg_u32;
+
+template<typename... F> struct msg_layout;
+
+template<> struct msg_layout<>
+{
+	static constexpr int size = 0;
+};
+
+template<typename F, typename... R> struct msg_layout<F, R...>
+{
+	static constexpr int size = F::size + msg_layout<R...>::size;
+};
+
+// offset and size of field I
+template<int I, typename... F> struct msg_field_at;
+
+template<typename F, typename... R> struct msg_field_at<0, F, R...>
+{
+	static constexpr int offset = 0;
+	static constexpr int size = F::size;
+};
+
+template<int I, typename F, typename... R> struct msg_field_at<I, F, R...>
+{
+	static constexpr int offset = F::size + msg_field_at<I - 1, R...>::offset;
+	static constexpr int size = msg_field_at<I - 1, R...>::size;
+};
+
+template<typename... F> struct msg_t
+{
+	static constexpr int size = msg_layout<F...>::size;
+	uint8_t data[size];
+
+	template<int I> void set( uint32_t value )
+	{
+		typedef msg_field_at<I, F...> field;
+		static_assert(field::size <= 4, "field too wide for a number");
+
+		for(int i = 0; i < field::size; i++)
+			data[field::offset + i] = value >> (8 * (field::size - 1 - i));
+	}
+
+	struct iovec iov()
+	{
+		struct iovec v = { data, (size_t)size };
+		return v;
+	}
+};
+
+static inline struct iovec msg_borrow( const void* data, size_t len )
+{
+	struct iovec v = { (void*)data, len };
+	return v;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// protocol 3 on: ahead of every message but CLIENT_INFO, in both directions
+enum { FRAME_START, FRAME_MSGID };
+typedef msg_t<msg_u8, msg_u32> frame_msg_t;
+
+// followed by the info string
+enum { CLIENT_INFO_OPCODE, CLIENT_INFO_PROTOCOL, CLIENT_INFO_LENGTH };
+typedef msg_t<msg_u32, msg_u16, msg_u8> client_info_msg_t;
+
+// followed by the section
+enum { FILTER_DATA_OPCODE, FILTER_DATA_DEMUX, FILTER_DATA_FILTER };
+typedef msg_t<msg_u32, msg_u8, msg_u8> filter_data_msg_t;
+
+// ca_pmt_tag with the stop descrambling command, a ca_pmt of its own
+enum { STOP_DMX_TAG, STOP_DMX_CMD, STOP_DMX_LENGTH, STOP_DMX_RESERVED, STOP_DMX_DEMUX };
+typedef msg_t<msg_u32, msg_u8, msg_u8, msg_u8, msg_u8> stop_dmx_msg_t;
+
+// a CA PMT: this header, the descriptor, then the pmt from its program info on without the crc
+enum { CAPMT_HDR_TAG, CAPMT_HDR_LENGTH, CAPMT_HDR_LIST_MANAGEMENT, CAPMT_HDR_PROGRAM_NUMBER, CAPMT_HDR_VERSION, CAPMT_HDR_PROGRAM_INFO_LENGTH };
+typedef msg_t<msg_u32, msg_u16, msg_u8, msg_u16, msg_u8, msg_u16> capmt_header_msg_t;
+
+// ca_pmt_cmd_id and the demux descriptor (0x82) telling oscam the demux and adapter
+enum { CAPMT_DESC_CMD_ID, CAPMT_DESC_TAG, CAPMT_DESC_LENGTH, CAPMT_DESC_DEMUX, CAPMT_DESC_ADAPTER };
+typedef msg_t<msg_u8, msg_u8, msg_u8, msg_u8, msg_u8> capmt_descriptor_msg_t;
+
+static_assert(frame_msg_t::size == 5 && client_info_msg_t::size == 7 && filter_data_msg_t::size == 6 && stop_dmx_msg_t::size == 8, "dvbapi message size");
+static_assert(capmt_header_msg_t::size == 12 && capmt_descriptor_msg_t::size == 5, "CA PMT header size");
+static_assert(msg_field_at<CAPMT_HDR_PROGRAM_INFO_LENGTH, msg_u32, msg_u16, msg_u8, msg_u16, msg_u8, msg_u16>::offset == 10, "CA PMT layout");
+
+#endif
@@ -0,0 +1,186 @@
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <sys/unistd.h>
+
+#include "cwlog.h"
+
+static size_t cwlog_size( uint32_t entries )
+{
+	return sizeof(cwlog_header_t) + (size_t)entries * sizeof(cwlog_entry_t);
+}
+
+static bool cwlog_resize( cwlog_t* log, uint32_t capacity )
+{
+	if(log->header)
+		munmap(log->header, cwlog_size(log->capacity));
+	log->header = NULL;
+
+	if(ftruncate(log->fd, cwlog_size(capacity)) < 0)
+		return false;
+
+	void* p = mmap(NULL, cwlog_size(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+	if(p == MAP_FAILED)
+		return false;
+
+	log->header = (cwlog_header_t*)p;
+	log->capacity = capacity;
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// wall clock, a recording is matched against the journal long after the fact
+uint64_t cwlog_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool cwlog_dir_usable( const char* dir )
+{
+	struct statfs fs;
+	if(statfs(dir, &fs) < 0)
+	{
+		g_message("%s: %s: %s", __func__, dir, strerror(errno));
+		return false;
+	}
+
+	if(fs.f_type == TMPFS_MAGIC || fs.f_type == RAMFS_MAGIC)
+	{
+		g_message("%s: %s is in ram, the journals belong on the recordings' storage", __func__, dir);
+		return false;
+	}
+
+	return true;
+}
+
+cwlog_t* cwlog_open( const char* dir, uint64_t service_id )
+{
+	uint64_t now = cwlog_now();
+
+	char name[256];
+	snprintf(name, sizeof(name), "%s/dvbcam.%016llx.%llu.cwj", dir, (unsigned long long)service_id, (unsigned long long)(now / 1000000));
+
+	cwlog_t* log = new cwlog_t;
+	log->header = NULL;
+	log->capacity = 0;
+	log->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if(log->fd < 0 || !cwlog_resize(log, CWLOG_CHUNK))
+	{
+		g_message("%s: unable to create %s: %s", __func__, name, strerror(errno));
+		if(log->fd > -1)
+			close(log->fd);
+		delete log;
+		return NULL;
+	}
+
+	log->header->magic = CWLOG_MAGIC;
+	log->header->version = CWLOG_VERSION;
+	log->header->service_id = service_id;
+	log->header->start = now;
+	log->header->count = 0;
+
+	g_message("%s: journaling cws of service_id=%llx to %s", __func__, (unsigned long long)service_id, name);
+
+	return log;
+}
+
+// the entry is complete before count covers it, a crash never leaves a torn entry behind
+void cwlog_append( cwlog_t* log, int parity, uint8_t* cw, int key_len )
+{
+	if(!log || key_len > (int)sizeof(((cwlog_entry_t*)0)->cw))
+		return;
+
+	if(log->header->count == log->capacity && !cwlog_resize(log, log->capacity + CWLOG_CHUNK))
+	{
+		g_message("%s: unable to grow the journal: %s", __func__, strerror(errno));
+		return;
+	}
+
+	cwlog_entry_t* e = &cwlog_entries(log->header)[log->header->count];
+	memset(e, 0, sizeof(cwlog_entry_t));
+	e->time = cwlog_now();
+	e->parity = parity;
+	e->key_len = key_len;
+	memcpy(e->cw, cw, key_len);
+
+	__sync_synchronize();
+	log->header->count++;
+}
+
+void cwlog_set_start( cwlog_t* log, uint64_t start )
+{
+	if(log)
+		log->header->start = start;
+}
+
+void cwlog_close( cwlog_t* log )
+{
+	if(!log)
+		return;
+
+	// drop the unused tail of the last chunk
+	uint32_t count = log->header->count;
+	munmap(log->header, cwlog_size(log->capacity));
+	if(ftruncate(log->fd, cwlog_size(count)) < 0)
+		g_message("%s: unable to truncate the journal: %s", __func__, strerror(errno));
+
+	close(log->fd);
+	delete log;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+cwlog_header_t* cwlog_map( const char* name )
+{
+	int fd = open(name, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	struct stat st;
+	void* p = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(cwlog_header_t))
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(p == MAP_FAILED)
+		return NULL;
+
+	cwlog_header_t* header = (cwlog_header_t*)p;
+	if(header->magic != CWLOG_MAGIC || header->version != CWLOG_VERSION || (off_t)cwlog_size(header->count) > st.st_size)
+	{
+		munmap(p, st.st_size);
+		return NULL;
+	}
+
+	return header;
+}
+
+uint32_t cwlog_find( cwlog_header_t* header, uint64_t time )
+{
+	cwlog_entry_t* e = cwlog_entries(header);
+	uint32_t lo = 0, hi = header->count;
+
+	while(lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if(e[mid].time < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
@@ -0,0 +1,57 @@
+#ifndef _CWLOG_H_
+#define _CWLOG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CWLOG_MAGIC			0x4A574344				// "DCWJ"
+#define CWLOG_VERSION		1
+#define CWLOG_CHUNK			1024					// entries the file grows by, 32 kB
+
+typedef struct cwlog_entry {
+	uint64_t time;								// unix time the cw was applied (us)
+	uint8_t parity;
+	uint8_t key_len;
+	uint8_t reserved[6];
+	uint8_t cw[16];								// key_len bytes used
+} cwlog_entry_t;
+
+// entries follow the header in time order, only count of them are complete
+typedef struct cwlog_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t service_id;
+	uint64_t start;								// unix time the recording started (us)
+	volatile uint32_t count;
+	uint32_t reserved;
+} cwlog_header_t;
+
+typedef struct cwlog {
+	int fd;
+	cwlog_header_t* header;
+	uint32_t capacity;							// entries the mapping holds
+} cwlog_t;
+
+uint64_t cwlog_now();
+
+// writer: one journal per recorded service
+// a journal directory must outlive the recordings, /tmp and anything else in ram does not (and fills it)
+bool cwlog_dir_usable( const char* dir );
+
+cwlog_t* cwlog_open( const char* dir, uint64_t service_id );
+void cwlog_append( cwlog_t* log, int parity, uint8_t* cw, int key_len );
+void cwlog_set_start( cwlog_t* log, uint64_t start );
+void cwlog_close( cwlog_t* log );
+
+// reader: maps a journal read only, NULL if it is not one
+cwlog_header_t* cwlog_map( const char* name );
+
+static inline cwlog_entry_t* cwlog_entries( cwlog_header_t* header )
+{
+	return (cwlog_entry_t*)(header + 1);
+}
+
+// first entry at or after time
+uint32_t cwlog_find( cwlog_header_t* header, uint64_t time );
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef _DESCRAMBLER_H_
+#define _DESCRAMBLER_H_
+
+#include <stdint.h>
+
+#include "capmt.h"
+
+#define DESCRAMBLER_KEY_MAX		16			// per parity, aes-128
+
+// key programming backend, exactly one implementation is linked in (make BACKEND=sdp|ca)
+//	descrambler_sdp.cpp	samsung sdp ca control + pvr_drm_client key ladder (or a persistent tee session with TEE=1)
+//	descrambler_ca.cpp	linux dvb ca device (CA_SET_DESCR / CA_SET_PID)
+
+const char* descrambler_name();
+
+// descrambling of the ts on a bank on/off
+void descrambler_enable( uint8_t bank, bool enabled );
+
+// algorithm of key slot index, or of the whole bank if the backend has no key slots; kept until the bank is disabled, csa by default
+bool descrambler_set_mode( uint8_t bank, int index, dmx_ca_type_t ca_type );
+
+// cw is [key_len * parity0 + key_len * parity1], parity -1 programs both, returns false if the key was not taken
+bool descrambler_set_cw( uint8_t bank, int index, int parity, uint8_t* cw, int key_len );
+
+// key slots of a bank that can be matched by pid, 0 if the backend only matches whole banks
+int descrambler_key_slots( uint8_t bank );
+
+// routes pid to key slot index (-1 stops descrambling the pid), ignored by backends matching on the bank
+void descrambler_set_pid( uint8_t bank, uint16_t pid, int index );
+
+// drops the keys of a bank before it is disabled
+void descrambler_stop( uint8_t bank );
+
+#endif
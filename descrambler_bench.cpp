@@ -0,0 +1,79 @@
+/*
+	descrambler_bench - cw programming latency of the linked key programming backend (make BACKEND=sdp|ca descrambler_bench)
+
+	usage: descrambler_bench_<backend> [-b bank] [-n iterations]
+		-b	bank to program, default 0 (the stream on it is not descrambled correctly while the bench runs)
+		-n	number of cws, default 1000
+
+	the labels are the same for every backend, which comes first as descrambler.backend; to compare two of them
+	build both (make BACKEND=sdp descrambler_bench, make BACKEND=ca descrambler_bench), run them one after the other
+	on the same tv, bank, channel and -n with dvbcam stopped, and put the outputs side by side, the lines come in the same order:
+		paste -d' ' descrambler_sdp.txt descrambler_ca.txt
+*/
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "descrambler.h"
+
+static void null_log_handler( const gchar *log_domain, GLogLevelFlags log_level, const gchar *message, gpointer user_data )
+{
+}
+
+int main( int argc, char *argv[] )
+{
+	int bank = 0, iterations = 1000, opt;
+
+	while((opt = getopt(argc, argv, "b:n:")) != -1)
+	{
+		if(opt == 'b')
+			bank = atoi(optarg);
+		else if(opt == 'n')
+			iterations = atoi(optarg);
+		else
+		{
+			printf("usage: %s [-b bank] [-n iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	g_log_set_handler(G_LOG_DOMAIN, G_LOG_LEVEL_MASK, null_log_handler, NULL);
+
+	descrambler_enable(bank, true);
+
+	// alternate the parities like a running service does
+	uint8_t cw[2 * DESCRAMBLER_KEY_MAX];
+	latency_t set_cw, both;
+	int failures = 0;
+	memset(&set_cw, 0, sizeof(set_cw));
+	memset(&both, 0, sizeof(both));
+
+	for(int i = 0; i < iterations; i++)
+	{
+		memset(cw, i & 0xFF, sizeof(cw));
+
+		uint64_t start = stats_now();
+		failures += !descrambler_set_cw(bank, 0, i & 1, cw, 8);
+		stats_latency_add(&set_cw, (uint32_t)(stats_now() - start));
+
+		start = stats_now();
+		failures += !descrambler_set_cw(bank, 0, -1, cw, 8);
+		stats_latency_add(&both, (uint32_t)(stats_now() - start));
+	}
+
+	descrambler_stop(bank);
+	descrambler_enable(bank, false);
+
+	printf("descrambler.backend %s\n", descrambler_name());
+	printf("descrambler.bank %d\n", bank);
+	stats_latency_dump(stdout, "descrambler.set_cw_us", &set_cw);
+	stats_latency_dump(stdout, "descrambler.set_cw_both_us", &both);
+	printf("descrambler.failures %d\n", failures);
+
+	return failures ? 1 : 0;
+}
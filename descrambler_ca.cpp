@@ -0,0 +1,148 @@
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/unistd.h>
+#include <sys/ioctl.h>
+
+#include <include/uapi/linux/dvb/ca.h>
+
+#include "trace.h"
+#include "descrambler.h"
+
+#ifndef CA_DEVICE
+#define CA_DEVICE			"/dev/dvb/adapter0/ca%d"		// one per bank, can be pointed at a fake device
+#endif
+
+#define CA_MAX_BANKS		8
+
+// oscam's extensions of the ca device api, not in linux/dvb/ca.h
+typedef struct ca_descr_mode {
+	uint32_t index;
+	uint32_t algo;
+	uint32_t cipher_mode;
+} ca_descr_mode_t;
+
+typedef struct ca_descr_data {
+	uint32_t index;
+	uint32_t parity;
+	uint32_t data_type;
+	uint32_t length;
+	uint8_t* data;
+} ca_descr_data_t;
+
+#define CA_SET_DESCR_MODE	_IOW('o', 136, ca_descr_mode_t)
+#define CA_SET_DESCR_DATA	_IOW('o', 137, ca_descr_data_t)
+
+// kept open while the bank is enabled, so a cw costs one ioctl
+static int g_ca_fd[CA_MAX_BANKS] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+static int g_ca_slots[CA_MAX_BANKS];		// descramblers of the device
+
+const char* descrambler_name()
+{
+	return "ca";
+}
+
+void descrambler_enable( uint8_t bank, bool enabled )
+{
+	if(bank >= CA_MAX_BANKS)
+		return;
+	
+	if(!enabled)
+	{
+		if(g_ca_fd[bank] > -1)
+			close(g_ca_fd[bank]);
+		g_ca_fd[bank] = -1;
+		return;
+	}
+	
+	if(g_ca_fd[bank] > -1)
+		return;
+	
+	char device_name[128];
+	sprintf(device_name, CA_DEVICE, bank);
+	
+	if( (g_ca_fd[bank] = open(device_name, O_RDWR)) < 0 )
+	{
+		g_message("Unable to open device %s (%d): %s", device_name, errno, strerror(errno));
+		return;
+	}
+	
+	ca_descr_info_t info;
+	g_ca_slots[bank] = ioctl(g_ca_fd[bank], CA_GET_DESCR_INFO, &info) < 0 ? 0 : info.num;
+}
+
+int descrambler_key_slots( uint8_t bank )
+{
+	return bank < CA_MAX_BANKS && g_ca_fd[bank] > -1 ? g_ca_slots[bank] : 0;
+}
+
+bool descrambler_set_mode( uint8_t bank, int index, dmx_ca_type_t ca_type )
+{
+	if(bank >= CA_MAX_BANKS || g_ca_fd[bank] < 0)
+		return false;
+	
+	ca_descr_mode_t mode = { (uint32_t)index, CA_ALGO_DVBCSA, CA_MODE_ECB };
+	if(ca_type == DMX_CA_DES_ECB)
+		mode.algo = CA_ALGO_DES;
+	else if(ca_type == DMX_CA_AES_ECB || ca_type == DMX_CA_AES_CBC)
+	{
+		mode.algo = CA_ALGO_AES128;
+		mode.cipher_mode = ca_type == DMX_CA_AES_CBC ? CA_MODE_CBC : CA_MODE_ECB;
+	}
+	else if(ca_type != DMX_CA_DVB_CSA)
+		return false;
+	
+	if( ioctl(g_ca_fd[bank], CA_SET_DESCR_MODE, &mode) < 0 )
+	{
+		g_message("%s: CA_SET_DESCR_MODE failed, bank=%d, index=%d, algo=%d: %s", __func__, bank, index, mode.algo, strerror(errno));
+		return false;
+	}
+	
+	return true;
+}
+
+// 8 byte keys through the standard CA_SET_DESCR, longer ones through CA_SET_DESCR_DATA
+bool descrambler_set_cw( uint8_t bank, int index, int parity, uint8_t* cw, int key_len )
+{
+	if(bank >= CA_MAX_BANKS || g_ca_fd[bank] < 0)
+		return false;
+	
+	for(int p = parity < 0 ? 0 : parity; p <= (parity < 0 ? 1 : parity); p++)
+	{
+		ca_descr_t ca_descr;
+		ca_descr_data_t ca_data = { (uint32_t)index, (uint32_t)p, CA_DATA_KEY, (uint32_t)key_len, &cw[key_len * p] };
+		
+		ca_descr.index = index;
+		ca_descr.parity = p;
+		if(key_len == 8)
+			memcpy(ca_descr.cw, &cw[8 * p], 8);
+		
+		if( IPC(TRACE_CA_SET_DESCR, key_len == 8 ? ioctl(g_ca_fd[bank], CA_SET_DESCR, &ca_descr) : ioctl(g_ca_fd[bank], CA_SET_DESCR_DATA, &ca_data)) < 0 )
+		{
+			g_message("%s: CA_SET_DESCR failed, bank=%d, index=%d, parity=%d: %s", __func__, bank, index, p, strerror(errno));
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+void descrambler_set_pid( uint8_t bank, uint16_t pid, int index )
+{
+	if(bank >= CA_MAX_BANKS || g_ca_fd[bank] < 0)
+		return;
+	
+	ca_pid_t ca_pid;
+	ca_pid.pid = pid;
+	ca_pid.index = index;
+	
+	if( IPC(TRACE_CA_SET_PID, ioctl(g_ca_fd[bank], CA_SET_PID, &ca_pid)) < 0 )
+		g_message("%s: CA_SET_PID failed, bank=%d, pid=0x%04X, index=%d: %s", __func__, bank, pid, index, strerror(errno));
+}
+
+// the keys go with the device in descrambler_enable
+void descrambler_stop( uint8_t bank )
+{
+}
@@ -0,0 +1,231 @@
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/unistd.h>
+#include <sys/ioctl.h>
+
+#include "capmt.h"
+#include "gst-ext-lib.h"
+#include "trace.h"
+#ifdef SDP_TEE
+#include "tee.h"
+#include "keyslot.h"
+#endif
+#include "descrambler.h"
+
+const char* descrambler_name()
+{
+#ifdef SDP_TEE
+	return "sdp_tee";
+#else
+	return "sdp";
+#endif
+}
+
+#define SDP_MAX_BANKS		8
+
+// algorithm per bank, DMX_CA_BYPASS until a mode was set
+static dmx_ca_type_t g_ca_type[SDP_MAX_BANKS];
+
+// pvr_drm_client context per bank, created with its first cw and kept until the bank is stopped instead of
+// two more ipcs around every cw; dvbcam calls in here under its state lock
+static void* g_context[SDP_MAX_BANKS];
+
+static dmx_ca_type_t get_ca_type( uint8_t bank )
+{
+	return bank < SDP_MAX_BANKS && g_ca_type[bank] != DMX_CA_BYPASS ? g_ca_type[bank] : DMX_CA_DVB_CSA;
+}
+
+#ifdef SDP_TEE
+#define SDP_PIDS			64				// pids routed to key slots per bank
+
+typedef struct sdp_pid {
+	uint16_t pid;
+	uint8_t keyidx;
+} sdp_pid_t;
+
+// with pid matching the algorithm is set per key slot and goes to the sdp with every pid routed to it
+static dmx_ca_type_t g_slot_ca_type[SDP_MAX_BANKS][KEYSLOT_MAX];
+static sdp_pid_t g_pids[SDP_MAX_BANKS][SDP_PIDS];
+static int g_pid_count[SDP_MAX_BANKS];
+
+static dmx_ca_type_t get_slot_ca_type( uint8_t bank, int keyidx )
+{
+	return g_slot_ca_type[bank][keyidx] != DMX_CA_BYPASS ? g_slot_ca_type[bank][keyidx] : DMX_CA_DVB_CSA;
+}
+#endif
+
+static void set_ca_ctrl( uint8_t bank, ca_config_t* cfg )
+{
+	int32_t device_fd;
+	char device_name[128] = {0};
+	sprintf(device_name, "/dev/dvb/adapter0/demux%d", bank);
+	
+	if( (device_fd = open(device_name, O_RDONLY)) < 0 )
+		g_message("Unable to open device %s (%d): %s", device_name, errno, strerror(errno));
+
+	if( ioctl(device_fd, SDP_SET_CA_CTRL, cfg) )
+		g_message("ioctl failed: (device_fd=%d)=%d, bank=%d, ca_type=%d, pid=0x%04X, keyidx=%d", device_fd, -1, bank, cfg->ca_type, cfg->pid, cfg->keyidx);
+		
+	close(device_fd);
+}
+
+void descrambler_enable( uint8_t bank, bool enabled )
+{
+	ca_config_t cfg = { .mode = enabled ? 1 : 0, .matching_type = 0, .ca_type = enabled ? get_ca_type(bank) : DMX_CA_BYPASS, .pid = 0, .keyidx = 0, .use_hcas = 0 };
+	set_ca_ctrl(bank, &cfg);
+	
+	if(!enabled && bank < SDP_MAX_BANKS)
+	{
+		g_ca_type[bank] = DMX_CA_BYPASS;
+#ifdef SDP_TEE
+		memset(g_slot_ca_type[bank], 0, sizeof(g_slot_ca_type[bank]));
+		g_pid_count[bank] = 0;
+#endif
+	}
+}
+
+// the bank gets the new algorithm, or with pid matching the key slot and the pids already routed to it
+bool descrambler_set_mode( uint8_t bank, int index, dmx_ca_type_t ca_type )
+{
+	if(bank >= SDP_MAX_BANKS)
+		return false;
+	
+#ifdef SDP_TEE
+	if(index < 0 || index >= KEYSLOT_MAX)
+		return false;
+	
+	if(get_slot_ca_type(bank, index) == ca_type)
+		return true;
+	
+	g_slot_ca_type[bank][index] = ca_type;
+	
+	for(int i = 0; i < g_pid_count[bank]; i++)
+		if(g_pids[bank][i].keyidx == index)
+		{
+			ca_config_t cfg = { .mode = 1, .matching_type = 1, .ca_type = ca_type, .pid = g_pids[bank][i].pid, .keyidx = (__u8)index, .use_hcas = 0 };
+			set_ca_ctrl(bank, &cfg);
+		}
+	
+	return true;
+#endif
+	
+	if(get_ca_type(bank) == ca_type)
+		return true;
+	
+	g_ca_type[bank] = ca_type;
+	
+	ca_config_t cfg = { .mode = 1, .matching_type = 0, .ca_type = ca_type, .pid = 0, .keyidx = 0, .use_hcas = 0 };
+	set_ca_ctrl(bank, &cfg);
+	
+	return true;
+}
+
+static void* get_context( uint8_t bank )
+{
+	if(!g_context[bank])
+		g_context[bank] = IPC(TRACE_DRM_CONTEXT_CREATE, pvr_drm_client_context_create());
+	
+	return g_context[bank];
+}
+
+static void drop_context( uint8_t bank )
+{
+	if(g_context[bank])
+		IPC_VOID(TRACE_DRM_CONTEXT_DESTROY, pvr_drm_client_context_destroy(g_context[bank]));
+	
+	g_context[bank] = NULL;
+}
+
+// the key ladder always takes both parities, the parity is not needed
+bool descrambler_set_cw( uint8_t bank, int index, int parity, uint8_t* cw, int key_len )
+{
+#ifdef SDP_TEE
+	// straight to the ta, without pvr_drm_client
+	return tee_set_cw(bank, index, cw, 2 * key_len);
+#else
+	uint8_t key[256];
+	uint32_t outlen;
+	
+	void* ctx = bank < SDP_MAX_BANKS ? get_context(bank) : NULL;
+	if(!ctx)
+		return false;
+	
+	if( IPC(TRACE_DRM_CONVERT_KEY, pvr_drm_client_jackpack_convert_key(ctx, cw, 2 * key_len, 20110906, key, &outlen)) )
+		g_message("%s: pvr_drm_client_jackpack_convert_key failed!", __func__);
+	
+	if( IPC(TRACE_DRM_START_DECRYPT, pvr_drm_client_player_start_decrypt(ctx, 0, bank, key, 2 * key_len, 0)) )
+	{
+		g_message("%s: pvr_drm_client_player_start_decrypt failed!", __func__);
+		
+		// the next cw starts over with a new context
+		drop_context(bank);
+		return false;
+	}
+	
+	return true;
+#endif
+}
+
+// pid matching needs the keyidx with the cw, which only the tee command carries: through pvr_drm_client banks are
+// matched as a whole
+int descrambler_key_slots( uint8_t bank )
+{
+#ifdef SDP_TEE
+	return bank < SDP_MAX_BANKS ? KEYSLOT_MAX : 0;
+#else
+	return 0;
+#endif
+}
+
+// the pid is matched to keyidx index (matching_type 1), the ta programs the key with that keyidx
+void descrambler_set_pid( uint8_t bank, uint16_t pid, int index )
+{
+#ifdef SDP_TEE
+	if(bank >= SDP_MAX_BANKS || index >= KEYSLOT_MAX)
+		return;
+	
+	ca_config_t cfg = { .mode = index < 0 ? 0 : 1, .matching_type = 1, .ca_type = index < 0 ? DMX_CA_BYPASS : get_slot_ca_type(bank, index), .pid = pid, .keyidx = (__u8)(index < 0 ? 0 : index), .use_hcas = 0 };
+	set_ca_ctrl(bank, &cfg);
+	
+	// remembered for a later mode change of the slot
+	sdp_pid_t* pids = g_pids[bank];
+	int i = 0;
+	while(i < g_pid_count[bank] && pids[i].pid != pid)
+		i++;
+	
+	if(index < 0)
+	{
+		if(i < g_pid_count[bank])
+			pids[i] = pids[--g_pid_count[bank]];
+	}
+	else if(i < g_pid_count[bank])
+		pids[i].keyidx = index;
+	else if(i < SDP_PIDS)
+	{
+		pids[i].pid = pid;
+		pids[i].keyidx = index;
+		g_pid_count[bank]++;
+	}
+	else
+		g_message("%s: bank %d routes %d pids already, pid 0x%04X misses mode changes of keyidx %d", __func__, bank, SDP_PIDS, pid, index);
+#endif
+}
+
+// the bank's context goes with its keys
+void descrambler_stop( uint8_t bank )
+{
+	if(bank >= SDP_MAX_BANKS)
+		return;
+	
+	void* ctx = get_context(bank);
+	if(ctx)
+	{
+		if( IPC(TRACE_DRM_STOP_DECRYPT, pvr_drm_client_player_stop_decrypt(ctx)) )
+			g_message("%s: pvr_drm_client_player_stop_decrypt failed!", __func__);
+		
+		drop_context(bank);
+	}
+}
@@ -3,6 +3,7 @@
 */
 
 #include <glib.h>
+#include <glib-unix.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -12,47 +13,146 @@
 #include <sys/un.h>
 #include <signal.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <fstream>
 #include <string>
 #include <unordered_set>
+#include <utility>
+#include <algorithm>
 
 #include <include/uapi/linux/dvb/ca.h>
 #include <linux/dvb/dmx.h>
 
 #include "tvs-api/TVServiceAPI.h"
 #include "capmt.h"
-#include "gst-ext-lib.h"
+#include "cwlog.h"
+#include "descrambler.h"
+#include "filters.h"
+#include "keyslot.h"
+#include "stats.h"
+#include "trace.h"
+#include "tsmon.h"
+#include "rt.h"
+#include "secpool.h"
+#include "snapshot.h"
+#include "softcsa.h"
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 typedef struct profile {
 	uint8_t bank;						// dvb bank id
-	std::map<uint8_t, int32_t> filters;	// array of handlers to the created ts section filters	<idx, handle>		
-	uint8_t cw[16];						// copy of currently used cw [8 * parity0 + 8 * parity1]
+	int32_t pmt_filter;					// ticket of the PMT subscription, ecm and emm filters are in g_filters
+	uint8_t cw[2 * DESCRAMBLER_KEY_MAX];	// copy of currently used cw [key_len * parity0 + key_len * parity1]
+	dmx_ca_type_t ca_type;				// algorithm negotiated by CA_SET_DESCR_MODE, csa by default
+	uint8_t key_len;					// per parity
+	uint8_t held;						// parities (bit mask) of cws in cw held back to be programmed together
+	int8_t held_index;
+	uint64_t held_since;				// when the first of them arrived (us)
+	uint64_t held_until;				// when they have to be programmed at the latest (us)
 } profile_t;
 
 #define MAX_PMTSIZE 4096
+
+#define STALL_CHECK_MS			500				// how often the demuxes are checked for missing cws
+#define STALL_FIRST_CW_MS		5000			// CA PMT sent, but no cw
+#define STALL_PERIOD_MS			10000			// assumed crypto period until one was observed
+#define RECOVERY_MAX_LEVEL		5				// attempts after the first one, each waiting twice as long, before a demux is left alone
+#define CW_WINDOW_US			1000			// default time a cw waits for the other parity, -w overrides it
+
+typedef struct cw_watch {
+	uint64_t last_event;				// last CA PMT or cw (us), 0 if nothing is expected
+	uint64_t flip_time;					// last cw with a different parity than the one before
+	uint64_t stall_time;				// first recovery attempt, 0 if not stalled
+	uint32_t crypto_period;				// learned from the parity flips (us), 0 if unknown
+	int8_t parity;						// of the last cw, -1 if none
+	bool got_cw;						// a cw arrived since the last CA PMT
+	uint8_t level;						// recovery attempts since the last cw or CA PMT, past RECOVERY_MAX_LEVEL given up
+} cw_watch_t;
+
+typedef struct cw_race {
+	uint8_t cw[2][2][DESCRAMBLER_KEY_MAX];	// per parity: the current and the previous cw, zero padded
+	uint64_t time[2];					// per parity: when the current cw was applied (us)
+	int8_t winner[2];					// per parity: client that delivered the current cw, -1 if none
+} cw_race_t;
  
 typedef struct demux {
 	int32_t program_number;						// currently played program (-1 if none)
 	TCServiceId service_id;						// corresponding service id
 	std::map<uint32_t, profile_t> profiles;		// tv profiles tuned on this program
-	uint8_t pmt[MAX_PMTSIZE];
+	volatile uint8_t profile_count;				// profiles.size() for the section callback, which does without g_state_lock
+	section_t* pmt;								// current PMT as it came in (pool buffer), NULL if none, see get_pmt
+	zap_t zap;									// pending zap, finished by the first cw
+	cw_watch_t watch;							// cw stall detection
+	cw_race_t race;								// the first client to deliver a cw wins
+	cwlog_t* journal;							// cws applied while the program is recorded, NULL otherwise
 } oscam_demux_t;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #define capmt_socket_name "/tmp/.listen.camd.socket"
-int g_socket = -1;
 
-#define MAX_DEMUX 2						// one per tv tuner
+#define DEFAULT_TCP_ADDRESS "127.0.0.1"
+const char* g_tcp_address = DEFAULT_TCP_ADDRESS;
+int g_tcp_port = 0;						// tcp listener disabled if 0
+
+const char* g_cwlog_dir = NULL;			// cw journals of recordings (-j), NULL to keep none
+int g_filter_grace_ms = FILTER_GRACE_MS;	// released section subscriptions are kept this long for reuse, 0 to drop them at once
+uint32_t g_section_budget = SECPOOL_BUDGET;	// bytes of section buffers allocated up front
+int g_cw_window_us = CW_WINDOW_US;		// a cw waits this long for the other parity to program both at once, 0 to program each at once
+#define CA_ALLOW_MAX		16
+#define CA_RANK_UNKNOWN		0x7FFFFFFF		// rank of a CAID without ecm times, behind all with
+uint16_t g_ca_allow[CA_ALLOW_MAX];		// CAIDs the CA PMTs may offer, any if g_ca_allowed is 0
+int g_ca_allowed = 0;
+rt_config_t g_rt = { 0, 0, false };		// settings of the dedicated cw thread, started as a plain thread if none are given
+int g_wake_fd = -1;						// eventfd in the socket thread's poll set, other threads hand it work through it
+volatile uint32_t g_stalled_banks = 0;	// banks tsmon found scrambled (bit mask), recovered on the socket thread
+
+#define MAX_HW_DEMUX 2					// one per tv tuner
+#define MAX_DEMUX (MAX_HW_DEMUX + SOFTCSA_SLOTS)	// services beyond the tuners' banks are descrambled in software
 oscam_demux_t g_demux[MAX_DEMUX];
 
+#define MAX_CLIENTS			STATS_CLIENTS		// dvbapi clients served at once
+#define CLIENT_BUFFER		2048				// holds the largest request (ECM_INFO)
+#define DEMOTE_LOSSES		8					// cws lost in a row before a client is dropped from a demux
+
+typedef struct client {
+	dvbapi_link_t link;					// fd -1 if the slot is free, changed by the socket thread under lock
+	volatile bool ready;				// SERVER_INFO received
+	volatile bool failed;				// a message did not go out whole, disconnected by the socket thread
+	GMutex lock;						// held while the socket is written to, the callbacks write beside the socket thread
+	uint8_t buff[CLIENT_BUFFER];		// received data, starting with an incomplete request
+	int32_t buffered;
+	uint8_t losses[MAX_DEMUX];			// cws lost in a row per demux
+	uint32_t demoted;					// demuxes (bit mask) this client gets no CA PMTs for
+} client_t;
+
+client_t g_clients[MAX_CLIENTS];
+
+snapshot_t* g_snapshot = NULL;			// g_demux as of the last change, to survive restarts
+static_assert(MAX_DEMUX <= SNAPSHOT_DEMUX && MAX_PMTSIZE <= SNAPSHOT_PMTSIZE, "snapshot too small");
+static_assert(MAX_PMTSIZE <= SECPOOL_SECTION_MAX, "section pool too small");
+
+GMutex g_pmt_lock;						// g_demux[].pmt is replaced by the section callback while other threads send it
+
+// g_demux, the filters' users and owners and the client slots: held by the socket thread for each pass through its loop,
+// by the signal callbacks, the PMT callback and the startup lookups; ecm and emm sections are delivered without it
+pthread_mutex_t g_state_lock;
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 void fatal_error( const char* str );
+
+// software descrambler slot of a demux, -1 for the demuxes of the hardware banks
+static inline int soft_slot( int dmx )
+{
+	return dmx >= MAX_HW_DEMUX ? dmx - MAX_HW_DEMUX : -1;
+}
+void subscribe_signals();
 static int onTTSignalCallback(ESignalType stype, EProfile profile, uint16_t screen_id, TSSignalData sigdata, void* pUserData);
 static void onSection( bool isDone, unsigned short length, unsigned char* pData, int userParam );
 
@@ -110,11 +210,27 @@ void on_pvr_signal(ps_signal_t signal, void* userparam)
 	if( userparam != (void*)0xdeadbeef )
 		fatal_error("on_pvr_signal: signal data not in sync");
 	
+	bool stop = false;
+	TSSignalData sigdata;
+	int8_t screen_id = -1;
+	
+	pthread_mutex_lock(&g_state_lock);
+	
+	// the journal times count from the first recorded packet, not from tuning
+	if(signal.signal_type == PS_SIGNAL_TYPE_RECORD_STATE_CHANGE && signal.record_state == PS_RECORD_STATE_REC)
+	{
+		TCServiceId service_id = signal.service_id[0] + ((TCServiceId)(signal.service_id[1]) << 32);
+		for( int i = 0; i < MAX_DEMUX; i++ )
+			if(g_demux[i].service_id == service_id && g_demux[i].journal)
+				cwlog_set_start(g_demux[i].journal, cwlog_now());
+	}
+	
 	if(signal.signal_type == PS_SIGNAL_TYPE_RECORD_STATE_CHANGE && signal.record_state == PS_RECORD_STATE_STOP)
 	{	
 		TCServiceId service_id = signal.service_id[0] + ((TCServiceId)(signal.service_id[1]) << 32);
-		TSSignalData sigdata = {service_id};
-		int8_t screen_id = signal.screen_id;
+		sigdata = {service_id};
+		screen_id = signal.screen_id;
+		stop = true;
 		
 		g_message("%s: service_id=%llx, profile=%d, screen_id=%d", __func__, service_id, signal.profile, screen_id);
 		
@@ -130,13 +246,23 @@ void on_pvr_signal(ps_signal_t signal, void* userparam)
 							break;
 						}
 		}
-
-		onTTSignalCallback(SIGNAL_TUNE_STOP, (EProfile)signal.profile, screen_id, sigdata, 0);
 	}	
+	
+	pthread_mutex_unlock(&g_state_lock);
+	
+	// the callback does its tvs-api lookups before it takes the lock
+	if(stop)
+		onTTSignalCallback(SIGNAL_TUNE_STOP, (EProfile)signal.profile, screen_id, sigdata, 0);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+void reset_race( int dmx )
+{
+	memset(&g_demux[dmx].race, 0, sizeof(cw_race_t));
+	g_demux[dmx].race.winner[0] = g_demux[dmx].race.winner[1] = -1;
+}
+
 void init_demux()
 {
 	for( int i = 0; i < MAX_DEMUX; i++ )
@@ -144,7 +270,13 @@ void init_demux()
 		g_demux[i].program_number = -1;				
 		g_demux[i].service_id = 0;
 		g_demux[i].profiles.clear();
-		memset(g_demux[i].pmt, 0, sizeof(uint8_t) * MAX_PMTSIZE);
+		g_demux[i].profile_count = 0;
+		g_demux[i].pmt = NULL;
+		memset(&g_demux[i].zap, 0, sizeof(zap_t));
+		memset(&g_demux[i].watch, 0, sizeof(cw_watch_t));
+		g_demux[i].watch.parity = -1;
+		reset_race(i);
+		g_demux[i].journal = NULL;
 	}			
 }
 
@@ -179,6 +311,84 @@ int get_free_demux_index()
 	return -1;
 }
 
+// the valid PMT of a demux with a reference of the caller's own, NULL if there is none
+section_t* get_pmt( int dmx )
+{
+	g_mutex_lock(&g_pmt_lock);
+	section_t* pmt = g_demux[dmx].pmt && g_demux[dmx].pmt->data[0] == 0x02 ? secpool_ref(g_demux[dmx].pmt) : NULL;
+	g_mutex_unlock(&g_pmt_lock);
+	
+	return pmt;
+}
+
+// takes over the reference of pmt
+void set_pmt( int dmx, section_t* pmt )
+{
+	g_mutex_lock(&g_pmt_lock);
+	section_t* old = g_demux[dmx].pmt;
+	g_demux[dmx].pmt = pmt;
+	g_mutex_unlock(&g_pmt_lock);
+	
+	secpool_put(old);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void save_demux( int dmx )
+{
+	if(!g_snapshot)
+		return;
+	
+	snapshot_demux_t* s = &g_snapshot->demux[dmx];
+	snapshot_begin(s);
+	s->program_number = g_demux[dmx].program_number;
+	s->service_id = g_demux[dmx].service_id;
+	
+	int n = 0;
+	memset(s->profiles, 0, sizeof(s->profiles));
+	for (auto && p : g_demux[dmx].profiles)
+		if(n < SNAPSHOT_PROFILES)
+		{
+			s->profiles[n].tag = p.first;
+			s->profiles[n].bank = p.second.bank;
+			memcpy(s->profiles[n].cw, p.second.cw, sizeof(s->profiles[n].cw));
+			s->profiles[n].ca_type = p.second.ca_type;
+			s->profiles[n].key_len = p.second.key_len;
+			n++;
+		}
+	
+	// the pmt only changes with its version, skip rewriting 4k otherwise
+	section_t* pmt = get_pmt(dmx);
+	int len = pmt ? 3 + ((pmt->data[1] & 0x0F) << 8) + pmt->data[2] : 0;
+	if(len > SNAPSHOT_PMTSIZE || (pmt && len > pmt->length))
+		len = 0;
+	
+	if(len != s->pmt_length || (len && memcmp(s->pmt, pmt->data, len)))
+	{
+		if(len)
+			memcpy(s->pmt, pmt->data, len);
+		s->pmt_length = len;
+		s->pmt_version = len ? (pmt->data[5] >> 1) & 0x1F : 0;
+	}
+	
+	snapshot_commit(s);
+	secpool_put(pmt);
+}
+
+// cheap update for the cw path
+void save_cw( int dmx )
+{
+	if(!g_snapshot)
+		return;
+	
+	snapshot_demux_t* s = &g_snapshot->demux[dmx];
+	snapshot_begin(s);
+	for(int n = 0; n < SNAPSHOT_PROFILES; n++)
+		if(s->profiles[n].tag && g_demux[dmx].profiles.count(s->profiles[n].tag))
+			memcpy(s->profiles[n].cw, g_demux[dmx].profiles[s->profiles[n].tag].cw, sizeof(s->profiles[n].cw));
+	snapshot_commit(s);
+}
+
 void print_demuxes()
 {	
 	g_message("---------------------------------------------------");
@@ -193,35 +403,33 @@ void print_demuxes()
 }
 
 void swap_demux( int32_t i, int32_t j )
-{		
-	oscam_demux_t tmp;
-	
-	// copy i to tmp
-	tmp.program_number = g_demux[i].program_number;
-	tmp.service_id = g_demux[i].service_id;	
-	tmp.profiles = g_demux[i].profiles;
-	memcpy(tmp.pmt, g_demux[i].pmt, MAX_PMTSIZE);
+{
+	std::swap(g_demux[i], g_demux[j]);
+	filter_swap_demux(i, j);
+	keyslot_swap_demux(i, j);
 	
-	// copy j to i
-	g_demux[i].program_number = g_demux[j].program_number;
-	g_demux[i].service_id = g_demux[j].service_id;	
-	g_demux[i].profiles = g_demux[j].profiles;
-	memcpy(g_demux[i].pmt, g_demux[j].pmt, MAX_PMTSIZE);
+	// the demotions follow the demux
+	for(int c = 0; c < MAX_CLIENTS; c++)
+	{
+		client_t* cl = &g_clients[c];
+		uint32_t di = (cl->demoted >> i) & 1, dj = (cl->demoted >> j) & 1;
+		
+		cl->demoted = (cl->demoted & ~((1 << i) | (1 << j))) | (di << j) | (dj << i);
+		std::swap(cl->losses[i], cl->losses[j]);
+	}
 	
-	// copy tmp to j
-	g_demux[j].program_number = tmp.program_number;
-	g_demux[j].service_id = tmp.service_id;	
-	g_demux[j].profiles = tmp.profiles;
-	memcpy(g_demux[j].pmt, tmp.pmt, MAX_PMTSIZE);
+	save_demux(i);
+	save_demux(j);
 }
 
 void remove_unused_demuxes()
 {	
 	g_message("removing unused demuxes");
 	
-	for(int i = 0; i < MAX_DEMUX - 1; i++)
+	// software demuxes keep their slot, the sink a pvr reads from must not change under it
+	for(int i = 0; i < MAX_HW_DEMUX - 1; i++)
 		if(g_demux[i].program_number == -1)
-			for(int j = i; j < MAX_DEMUX - 1; j++)
+			for(int j = i; j < MAX_HW_DEMUX - 1; j++)
 				swap_demux(j, j + 1);
 			
 	print_demuxes();
@@ -229,10 +437,87 @@ void remove_unused_demuxes()
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+int ready_clients()
+{
+	int n = 0;
+	for(int c = 0; c < MAX_CLIENTS; c++)
+		n += g_clients[c].ready;
+	
+	return n;
+}
+
+bool client_serves( int c, int dmx )
+{
+	return g_clients[c].ready && !(g_clients[c].demoted & (1 << dmx));
+}
+
+void wake_socket_thread()
+{
+	uint64_t one = 1;
+	if(write(g_wake_fd, &one, sizeof(one)) < 0)
+		g_message("%s: %s", __func__, strerror(errno));
+}
+
+// the client sockets are non-blocking: a client that does not take a whole message at once (a hung oscam) would
+// otherwise stall the cw path and the section callbacks, it is dropped instead
+template<typename F> bool client_send( int c, F send )
+{
+	client_t* cl = &g_clients[c];
+	bool sent = false;
+	
+	g_mutex_lock(&cl->lock);
+	if(cl->link.fd > -1 && !cl->failed)
+	{
+		sent = send(&cl->link);
+		if(!sent)
+		{
+			g_message("%s: client=%d did not take a whole message, disconnecting", __func__, c);
+			cl->failed = true;
+			wake_socket_thread();
+		}
+	}
+	g_mutex_unlock(&cl->lock);
+	
+	return sent;
+}
+
+// demux stopped or restarted: every client starts over on it
+void stop_demux_clients( int dmx )
+{
+	for(int c = 0; c < MAX_CLIENTS; c++)
+	{
+		if(g_clients[c].ready)
+			client_send(c, [&](dvbapi_link_t* link) { return send_stop_dmx(link, dmx); });
+		
+		g_clients[c].demoted &= ~(1 << dmx);
+		g_clients[c].losses[dmx] = 0;
+	}
+}
+
+// returns the clients (bit mask) that were demoted from dmx
+uint32_t promote_clients( int dmx )
+{
+	uint32_t promoted = 0;
+	
+	for(int c = 0; c < MAX_CLIENTS; c++)
+		if(g_clients[c].demoted & (1 << dmx))
+		{
+			g_message("%s: client=%d, dmx=%d", __func__, c, dmx);
+			
+			g_clients[c].demoted &= ~(1 << dmx);
+			g_clients[c].losses[dmx] = 0;
+			promoted |= 1 << c;
+		}
+	
+	return promoted;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 int32_t get_program_number( EProfile profile, uint16_t screen_id )
 {
 	IServiceNavigation* pServiceNavigation;
-	TVServiceAPI::CreateServiceNavigation(profile, screen_id, &pServiceNavigation);
+	IPC(TRACE_CREATE_SERVICE_NAVIGATION, TVServiceAPI::CreateServiceNavigation(profile, screen_id, &pServiceNavigation));
 			
 	TCCriteriaHelper fetchCriteria;			
 	fetchCriteria.Fetch(PROGRAM_NUMBER);
@@ -240,34 +525,45 @@ int32_t get_program_number( EProfile profile, uint16_t screen_id )
 	fetchCriteria.Fetch(SCRAMBLED);
 	TCServiceData service;
 	
-	if( !pServiceNavigation->GetCurrentServiceInfo(fetchCriteria, service) )
+	if( !IPC(TRACE_GET_CURRENT_SERVICE_INFO, pServiceNavigation->GetCurrentServiceInfo(fetchCriteria, service)) )
 		fatal_error("get_program_number: GetCurrentServiceInfo failed");
 	
 	return (int32_t)(service.Get<unsigned short>(PROGRAM_NUMBER) + 0x80000000 * !(service.Get<bool>(SCRAMBLED_IN_PMT) || service.Get<bool>(SCRAMBLED)));
 }
 
-TCServiceId get_service_id( EProfile profile, uint16_t screen_id )
+bool query_service_id( EProfile profile, uint16_t screen_id, TCServiceId* service_id )
 {
 	IServiceNavigation* pServiceNavigation;
-	TVServiceAPI::CreateServiceNavigation(profile, screen_id, &pServiceNavigation);
+	IPC(TRACE_CREATE_SERVICE_NAVIGATION, TVServiceAPI::CreateServiceNavigation(profile, screen_id, &pServiceNavigation));
 			
 	TCCriteriaHelper fetchCriteria;			
 	fetchCriteria.Fetch(SERVICE_ID);
 	TCServiceData service;
 	
-	if( !pServiceNavigation->GetCurrentServiceInfo(fetchCriteria, service) )
+	if( IPC(TRACE_GET_CURRENT_SERVICE_INFO, pServiceNavigation->GetCurrentServiceInfo(fetchCriteria, service)) <= 0 )
+		return false;
+	
+	*service_id = service.Get<TCServiceId>(SERVICE_ID);
+	return true;
+}
+
+TCServiceId get_service_id( EProfile profile, uint16_t screen_id )
+{
+	TCServiceId service_id;
+	
+	if( !query_service_id(profile, screen_id, &service_id) )
 		fatal_error("get_program_number: GetCurrentServiceInfo failed");
 	
-	return service.Get<TCServiceId>(SERVICE_ID);
+	return service_id;
 }
 
 int32_t get_bank( EProfile profile, uint16_t screen_id )
 {
 	IAVControl* pAVControl;
-	TVServiceAPI::CreateAVControl(profile, screen_id, &pAVControl);
+	IPC(TRACE_CREATE_AV_CONTROL, TVServiceAPI::CreateAVControl(profile, screen_id, &pAVControl));
 	
 	uint32_t bank;
-	if( !pAVControl->GetTVStreamProperty( TVSTREAM_PROPERTY_DEMUX_ID, bank ) )
+	if( !IPC(TRACE_GET_TV_STREAM_PROPERTY, pAVControl->GetTVStreamProperty( TVSTREAM_PROPERTY_DEMUX_ID, bank )) )
 		bank = -1;
 	
 	g_message("%s: profile=%d, screen_id=%d, bank=%d", __func__, profile, screen_id, bank);
@@ -275,422 +571,1517 @@ int32_t get_bank( EProfile profile, uint16_t screen_id )
 	return (int32_t)bank;
 }
 
-void set_descrambling( uint8_t bank, bool enabled )
+// the client's cw index on a demux as key slot of the bank, so services of several demuxes can share a bank
+int get_key_slot( uint8_t bank, uint8_t dmx, int index )
 {
-	int32_t device_fd;
-	char device_name[128] = {0};
-	sprintf(device_name, "/dev/dvb/adapter0/demux%d\0", bank);
+	int slots = descrambler_key_slots(bank);
+	
+	// bank matching, the index is passed through
+	if(!slots)
+		return index;
 	
-	if( (device_fd = open(device_name, O_RDONLY)) < 0 )
-		g_message("Unable to open device %s (%d): %s", device_name, errno, strerror(errno));
+	return keyslot_get(bank, dmx, index, slots);
+}
 
-	ca_config_t cfg = { .mode = enabled ? 1 : 0, .matching_type = 0, .ca_type = enabled ? DMX_CA_DVB_CSA : DMX_CA_BYPASS, .pid = 0, .keyidx = 0, .use_hcas = 0 };
-	if( ioctl(device_fd, SDP_SET_CA_CTRL, &cfg) )
-		g_message("ioctl failed: (device_fd=%d)=%d, bank=%d", device_fd, -1, bank);
-		
-	close(device_fd);
+bool bank_in_use( uint8_t bank )
+{
+	for( int i = 0; i < MAX_HW_DEMUX; i++ )
+		for (auto && p : g_demux[i].profiles)
+			if(p.second.bank == bank)
+				return true;
+	
+	return false;
 }
 
-void set_cw( uint32_t bank, uint8_t *cw )
-{	
-	uint8_t key[256];
-	uint32_t outlen;
+// another demux descrambles on the bank with a different algorithm, which matters when the backend keeps one mode per bank
+bool bank_mode_conflict( uint8_t bank, uint8_t dmx, dmx_ca_type_t ca_type )
+{
+	if(descrambler_key_slots(bank) > 0)
+		return false;
 	
-	g_message("%s: bank=%d", __func__, bank);		
+	for( int i = 0; i < MAX_HW_DEMUX; i++ )
+		for (auto && p : g_demux[i].profiles)
+			if(i != dmx && p.second.bank == bank && p.second.ca_type != ca_type)
+				return true;
 	
-	void* ctx = pvr_drm_client_context_create();
-	if(ctx)
-	{
-//		if( pvr_drm_client_player_stop_decrypt(ctx) )
-//			g_message("%s: pvr_drm_client_player_stop_decrypt failed!", __func__);
-		
-		if( pvr_drm_client_jackpack_convert_key(ctx, cw, 16, 20110906, key, &outlen) )
-			g_message("%s: pvr_drm_client_jackpack_convert_key failed!", __func__);
-		
-		if( pvr_drm_client_player_start_decrypt(ctx, 0, bank, key, 16, 0) )
-			g_message("%s: pvr_drm_client_player_start_decrypt failed!", __func__);
-		
-		pvr_drm_client_context_destroy(ctx);
-	}	
+	return false;
 }
 
-void add_profile( uint8_t dmx, uint32_t profile, uint32_t program_number, TCServiceId service_id )
+// programs the cw on a bank, the first cw after a zap starts the first clear packet measurement
+void set_cw( uint32_t bank, uint8_t dmx, int index, int parity, uint8_t *cw, int key_len )
 {	
-	g_demux[dmx].program_number = program_number;
-	g_demux[dmx].service_id = service_id;
-		
-	// add or update profile to demux
-	g_demux[dmx].profiles[profile].bank = get_bank((EProfile)(profile & 0xFFFF), (uint16_t)(profile >> 16));
+	if(soft_slot(dmx) > -1)
+	{
+		g_message("%s: software slot=%d, index=%d, parity=%d", __func__, soft_slot(dmx), index, parity);
+		softcsa_set_cw(soft_slot(dmx), parity, cw);
+		return;
+	}
 	
-	// enable descrambling
-	set_descrambling(g_demux[dmx].profiles[profile].bank, true);
+	int slot = get_key_slot(bank, dmx, index);
 	
-	g_message("%s: dmx=%d, profile=%s, screen_id=%d, program number=0x%04x, service_id=%llx, bank=%d", __func__, dmx, to_str((EProfile)(profile & 0xFFFF)), profile >> 16, program_number, service_id, g_demux[dmx].profiles[profile].bank);	
+	g_message("%s: bank=%d, index=%d, keyidx=%d, parity=%d, key_len=%d", __func__, bank, index, slot, parity, key_len);
+	
+	if( slot > -1 && descrambler_set_cw(bank, slot, parity, cw, key_len) )
+		tsmon_cw_set(bank);
 }
 
-void remove_profile( uint8_t dmx, uint32_t profile )
+void start_descrambling( uint8_t dmx, uint8_t bank )
 {
-	// stop descrambling on bank
-	void* ctx = pvr_drm_client_context_create();
-	if(ctx)
+	if(soft_slot(dmx) < 0)
 	{
-		if( pvr_drm_client_player_stop_decrypt(ctx) )
-			g_message("%s: pvr_drm_client_player_stop_decrypt failed!", __func__);
-		
-		pvr_drm_client_context_destroy(ctx);
+		descrambler_enable(bank, true);
+		return;
 	}
-
-	set_descrambling(g_demux[dmx].profiles[profile].bank, false);
-		
-	// stop section filters
-	ISectionSubscriber* pSectionSubscriber = NULL;
-	TVServiceAPI::CreateSectionSubscriber( &onSection, (EProfile)(profile & 0xFFFF), (uint16_t)(profile >> 16), &pSectionSubscriber );
-	
-	for (auto && x : g_demux[dmx].profiles[profile].filters)
-		if( x.second > 0 )			
-			g_message("pSectionSubscriber->Unsubscribe=%d, h=%d, profile=%d", pSectionSubscriber->Unsubscribe( x.second ), x.second, profile);
 	
-	g_demux[dmx].profiles[profile].filters.clear();	
-	g_demux[dmx].profiles.erase(profile);
+	char sink[128];
+	sprintf(sink, SOFTCSA_SINK, soft_slot(dmx));
+	softcsa_start(soft_slot(dmx), bank, sink);
+}
+
+bool has_record_profile( uint8_t dmx )
+{
+	for (auto && p : g_demux[dmx].profiles)
+		if( (EProfile)(p.first & 0xFFFF) == PROFILE_TYPE_RECORD )
+			return true;
 	
-	g_message("%s: dmx=%d, %s, screen_id=%d", __func__, dmx, to_str((EProfile)(profile & 0xFFFF)), profile >> 16);
-		
-	if(g_demux[dmx].profiles.size() == 0)
-	{
-		g_demux[dmx].program_number = -1;
-		g_demux[dmx].service_id = 0;
-		send_stop_dmx( g_socket, dmx );	
-	}
+	return false;
 }
 
-void reset_current_channel(EProfile profile, uint16_t screen_id)
-{	
-	if(get_bank( profile, screen_id ) < 0)
+// journal the cws of a recorded program, so parts recorded scrambled can be fixed afterwards (redescramble)
+void open_journal( uint8_t dmx, uint32_t profile )
+{
+	if(!g_cwlog_dir || g_demux[dmx].journal)
 		return;
 	
-	IServiceNavigation* serviceNav;
-	TVServiceAPI::CreateServiceNavigation(profile, screen_id, &serviceNav);
+	g_demux[dmx].journal = cwlog_open(g_cwlog_dir, g_demux[dmx].service_id);
 	
-	TCServiceId serviceId;
-	ESource source;
-	if(serviceNav->GetStartService(serviceId, source) > 0)
-	{
-		if(source == SOURCE_TYPE_TV)
+	// a recording of a running program starts with the cws already in use
+	cw_race_t* r = &g_demux[dmx].race;
+	for (auto && x : g_demux[dmx].profiles)
+		if(x.first != profile)
 		{
-			TSSignalData sigdata = {serviceId};
-			onTTSignalCallback(SIGNAL_TUNE_SUCCESS, profile, screen_id, sigdata, 0);
+			for(int parity = 0; parity < 2; parity++)
+				if(r->winner[parity] > -1)
+					cwlog_append(g_demux[dmx].journal, parity, r->cw[parity][0], x.second.key_len);
+			break;
 		}
-	}
-	else
-		fatal_error("reset_current_channel: GetStartService failed");
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static void onSection( bool isDone, unsigned short length, unsigned char* pData, int userParam )
-{	
-	uint8_t dmx = userParam & 0xFF;
-	uint8_t flt = (userParam >> 8) & 0xFF;
+// section subscriptions and the ts monitors are started and stopped on the ipc thread, in the order they were asked for: the
+// tvs-api calls and the join of a tsmon thread take long, and nobody waits for them under g_state_lock (the socket thread least);
+// the state holds a ticket per subscription, the tvs-api handle behind it is only known to the ipc thread
 
-	g_message( "%s: dmx=%d, flt=%d, [%02X %02X %02X %02X %02X %02X %02X %02X ...]", __func__, dmx, flt, pData[0], pData[1], pData[2], pData[3], pData[4], pData[5], pData[6], pData[7] );
-		
-	if(flt == 255)
-	{
-		int dmx = get_demux_index_by_program_number( (pData[3] << 8) + pData[4] );
-		g_message("%s: got PMT for dmx=%d, program_number=0x%04X, length=%d", __func__, dmx, (pData[3] << 8) + pData[4], length);
-		
-		memcpy(g_demux[dmx].pmt, pData, length);
-		
-		remove_unused_demuxes();
-					
-		for(int i = 0; i < MAX_DEMUX; i++)
-			if(g_demux[i].program_number > -1)
-				send_pmt( g_socket, i == 0 ? CAPMT_LIST_ONLY : CAPMT_LIST_MORE, g_demux[i].pmt, i );
-	}
-	else
-		send_filter_data( g_socket, dmx, flt, pData, length );
+#define IPC_QUEUE		256
+#define IPC_TICKETS		(2 * (FILTER_MAX + MAX_DEMUX * SNAPSHOT_PROFILES))	// the old subscriptions may still be there beside the new ones
+
+typedef enum ipc_op_type {
+	IPC_SUBSCRIBE_PMT,
+	IPC_SUBSCRIBE_FILTER,
+	IPC_UNSUBSCRIBE,
+	IPC_TSMON_START,
+	IPC_TSMON_STOP,
+} ipc_op_type_t;
+
+typedef struct ipc_op {
+	ipc_op_type_t type;
+	int32_t ticket;						// subscriptions
+	uint32_t profile;					// profile tag of a subscription
+	int user_param;
+	int32_t program_number;				// pmt subscription
+	uint16_t pid;						// filter subscription, ts monitor
+	uint8_t bank;						// ts monitor
+	uint8_t filter[FILTER_SIZE];
+	uint8_t mask[FILTER_SIZE];
+} ipc_op_t;
+
+typedef struct ipc_handle {
+	int32_t ticket;						// 0 if the slot is free
+	int handle;
+	uint32_t profile;
+} ipc_handle_t;
+
+static GMutex g_ipc_lock;
+static GCond g_ipc_cond;				// an op queued, or taken off a full queue
+static ipc_op_t g_ipc_queue[IPC_QUEUE];
+static uint32_t g_ipc_head = 0, g_ipc_tail = 0, g_ipc_done = 0;
+static int32_t g_ipc_tickets = 0;
+static ipc_handle_t g_ipc_handles[IPC_TICKETS];	// the ipc thread's own
+
+int32_t new_ticket()
+{
+	return __sync_add_and_fetch(&g_ipc_tickets, 1) & 0x7FFFFFFF;
 }
 
-static int onTTSignalCallback(ESignalType stype, EProfile profile, uint16_t screen_id, TSSignalData sigdata, void* pUserData)
-{		
-	TCServiceId service_id = get_service_id(profile, screen_id);
-	int32_t program_number = get_program_number(profile, screen_id);
-	uint32_t profile_tag = ((uint32_t)screen_id << 16) + profile;
-		
-	// find a demux using this program number
-	int dmx = get_demux_index_by_program_number(program_number);
+void queue_ipc( ipc_op_t* op )
+{
+	g_mutex_lock(&g_ipc_lock);
+	while(g_ipc_head - g_ipc_tail == IPC_QUEUE)
+		g_cond_wait(&g_ipc_cond, &g_ipc_lock);
 	
-	// find a demux using this profile
-	int d = get_demux_index_by_profile(profile_tag);
+	g_ipc_queue[g_ipc_head++ % IPC_QUEUE] = *op;
+	g_cond_broadcast(&g_ipc_cond);
+	g_mutex_unlock(&g_ipc_lock);
+}
 
-	g_message("ESignalType=%s, EProfile=%s, screen_id=%d, program_number=0x%08X, dmx=%d, d=%d", to_str(stype), to_str(profile), screen_id, program_number, dmx, d);
-	
-	if(stype == SIGNAL_TUNE_STOP && d > -1)
-		remove_profile( d, profile_tag );
-		
-	if(stype == SIGNAL_TUNE_SUCCESS)
-	{
-		// exists demux for profile? (aka channel change)		
-		if(d > -1)
+// returns once everything queued so far has been run (zap_bench, whose tvs-api runs on the ipc thread)
+void wait_ipc()
+{
+	g_mutex_lock(&g_ipc_lock);
+	uint32_t queued = g_ipc_head;
+	while((int32_t)(g_ipc_done - queued) < 0)
+		g_cond_wait(&g_ipc_cond, &g_ipc_lock);
+	g_mutex_unlock(&g_ipc_lock);
+}
+
+static void keep_handle( ipc_op_t* op, int handle )
+{
+	for(int i = 0; i < IPC_TICKETS; i++)
+		if(!g_ipc_handles[i].ticket)
 		{
-			g_message("channel change on %s, screen_id=%d, dmx=%d", to_str(profile), screen_id, d);
-			
-			// then stop the profile and possibly the demux
-			remove_profile( d, profile_tag );
-		}
-		
-		// if channel is scrambled
-		if( !(program_number & 0x80000000) )
-		{				
-			// if exist a demux for program number
-			if (dmx > -1)			
-				// stop it, since it will be restarted
-				send_stop_dmx( g_socket, dmx );			
-			else
-				// start new demux			
-				dmx = get_free_demux_index();			
-									
-			// add the channel to the demux
-			add_profile( dmx, profile_tag, program_number, service_id );
-												
-			// start PMT filter					
-			TCSectionCriteriaHelper sectionHelper;
-			sectionHelper.pid = INVALID;
-			sectionHelper.tableId = 0x02;	// PMT
-			sectionHelper.programNumber = program_number;
-			sectionHelper.device = DEVICE_INBAND;
-			sectionHelper.subscribeType = SECTION_SUBSCRIBE_CACHE_OR_STREAM;
-			sectionHelper.checkVersion = true;
-			
-			int userParam = (255 << 8) + dmx;
-			ISectionSubscriber* pSectionSubscriber = NULL;
-			TVServiceAPI::CreateSectionSubscriber( &onSection, profile, screen_id, &pSectionSubscriber );
-									
-			g_message("PMT Subscribe=%d, handle=%d", pSectionSubscriber->Subscribe( userParam, sectionHelper, g_demux[dmx].profiles[profile_tag].filters[255] ), g_demux[dmx].profiles[profile_tag].filters[255] );
+			g_ipc_handles[i] = { op->ticket, handle, op->profile };
+			return;
 		}
-	}
 	
-	print_demuxes();
+	g_message("%s: no room for ticket=%d, h=%d stays subscribed", __func__, op->ticket, handle);
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-void camd_connection_handler(int socket_desc)
+static void run_ipc( ipc_op_t* op )
 {
-    //Get the socket descriptor
-    g_socket = socket_desc;
+	if(op->type == IPC_TSMON_START)
+	{
+		tsmon_start(op->bank, op->pid);
+		return;
+	}
 	
-	init_demux();
+	if(op->type == IPC_TSMON_STOP)
+	{
+		tsmon_stop(op->bank);
+		return;
+	}
+	
+	ipc_handle_t* h = NULL;
+	for(int i = 0; op->type == IPC_UNSUBSCRIBE && i < IPC_TICKETS && !h; i++)
+		if(g_ipc_handles[i].ticket == op->ticket)
+			h = &g_ipc_handles[i];
 	
-	send_client_info(g_socket);
-	if(!recv_server_info(g_socket))
+	// the subscription failed, or never got a handle
+	if(op->type == IPC_UNSUBSCRIBE && !h)
 		return;
-			
-	// subscribe to tvs-api signals
-	ISignalSubscriber* pSignalSubscriber = NULL;		
-	TVServiceAPI::CreateSignalSubscriber(&onTTSignalCallback, &pSignalSubscriber);
-
-	for(int screen_id = 0; screen_id < 2; screen_id++)
+	
+	uint32_t profile = h ? h->profile : op->profile;
+	ISectionSubscriber* pSectionSubscriber = NULL;
+	IPC(TRACE_CREATE_SECTION_SUBSCRIBER, TVServiceAPI::CreateSectionSubscriber( &onSection, (EProfile)(profile & 0xFFFF), (uint16_t)(profile >> 16), &pSectionSubscriber ));
+	
+	int handle = 0;
+	if(op->type == IPC_UNSUBSCRIBE)
+	{
+		g_message("pSectionSubscriber->Unsubscribe=%d, h=%d, profile=%d, ticket=%d", IPC(TRACE_SECTION_UNSUBSCRIBE, pSectionSubscriber->Unsubscribe( h->handle )), h->handle, profile, op->ticket);
+		h->ticket = 0;
+	}
+	else if(op->type == IPC_SUBSCRIBE_PMT)
+	{
+		TCSectionCriteriaHelper sectionHelper;
+		sectionHelper.pid = INVALID;
+		sectionHelper.tableId = 0x02;	// PMT
+		sectionHelper.programNumber = op->program_number;
+		sectionHelper.device = DEVICE_INBAND;
+		sectionHelper.subscribeType = SECTION_SUBSCRIBE_CACHE_OR_STREAM;
+		sectionHelper.checkVersion = true;
+		
+		g_message("PMT Subscribe=%d, handle=%d, ticket=%d", IPC(TRACE_SECTION_SUBSCRIBE, pSectionSubscriber->Subscribe( op->user_param, sectionHelper, handle )), handle, op->ticket);
+	}
+	else
 	{
-		pSignalSubscriber->Subscribe(SIGNAL_TUNE_SUCCESS, 0, PROFILE_TYPE_PIP, screen_id);
-		pSignalSubscriber->Subscribe(SIGNAL_TUNE_SUCCESS, 0, PROFILE_TYPE_MAIN, screen_id);
-		pSignalSubscriber->Subscribe(SIGNAL_TUNE_SUCCESS, 0, PROFILE_TYPE_RECORD, screen_id);
-		pSignalSubscriber->Subscribe(SIGNAL_TUNE_STOP, 0, PROFILE_TYPE_PIP, screen_id);
-		pSignalSubscriber->Subscribe(SIGNAL_TUNE_STOP, 0, PROFILE_TYPE_MAIN, screen_id);
-		pSignalSubscriber->Subscribe(SIGNAL_TUNE_STOP, 0, PROFILE_TYPE_RECORD, screen_id);	
+		TCSectionFilterCriteriaHelper filterCriteria;
+		filterCriteria.filter.assign(op->filter, op->filter + FILTER_SIZE);
+		filterCriteria.mask.assign(op->mask, op->mask + FILTER_SIZE);
+		filterCriteria.invert.assign(FILTER_SIZE, 0);
+		filterCriteria.pid = op->pid;
+		filterCriteria.checkCRC = true;
+		
+		g_message("pSectionSubscriber->SubscribeByFilter=%d, h=%d, profile=%d, id=%d, ticket=%d", IPC(TRACE_SECTION_SUBSCRIBE_BY_FILTER, pSectionSubscriber->SubscribeByFilter( op->user_param, filterCriteria, handle )), handle, profile, op->user_param & 0xFF, op->ticket);
 	}
 	
-	// subscribe to pvr signals
-	g_message("svc_pvr_register_signal_cb=%d", svc_pvr_register_signal_cb(on_pvr_signal, (void*)0xdeadbeef));
+	if(handle > 0)
+		keep_handle(op, handle);
+}
 
-	reset_current_channel(PROFILE_TYPE_MAIN, DEFAULT_SCREEN_ID);
-	reset_current_channel(PROFILE_TYPE_PIP, DEFAULT_SCREEN_ID);
-					
-	uint8_t buff[1024];
-	int32_t nread;
-	uint32_t *request;
-	uint8_t adapter_index;
-		
-	// request
-	while (1)	
-	{ 	
-		nread = recv(g_socket, buff, sizeof(int), MSG_DONTWAIT);
-		if (nread <= 0)
-		{
-			if (nread == 0)
-				break;
-			usleep(20);
+static gpointer ipc_thread_start( gpointer data )
+{
+	for(;;)
+	{
+		g_mutex_lock(&g_ipc_lock);
+		while(g_ipc_head == g_ipc_tail)
+			g_cond_wait(&g_ipc_cond, &g_ipc_lock);
+		
+		ipc_op_t op = g_ipc_queue[g_ipc_tail++ % IPC_QUEUE];
+		g_cond_broadcast(&g_ipc_cond);
+		g_mutex_unlock(&g_ipc_lock);
+		
+		run_ipc(&op);
+		
+		g_mutex_lock(&g_ipc_lock);
+		g_ipc_done++;
+		g_cond_broadcast(&g_ipc_cond);
+		g_mutex_unlock(&g_ipc_lock);
+	}
+	
+	return NULL;
+}
+
+void start_tsmon( uint8_t bank, uint16_t pid )
+{
+	ipc_op_t op = { IPC_TSMON_START };
+	op.bank = bank;
+	op.pid = pid;
+	queue_ipc(&op);
+}
+
+void stop_tsmon( uint8_t bank )
+{
+	ipc_op_t op = { IPC_TSMON_STOP };
+	op.bank = bank;
+	queue_ipc(&op);
+}
+
+void unsubscribe( int32_t ticket )
+{
+	ipc_op_t op = { IPC_UNSUBSCRIBE };
+	op.ticket = ticket;
+	queue_ipc(&op);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// bank is looked up by the caller before it takes g_state_lock
+void add_profile( uint8_t dmx, uint32_t profile, uint32_t program_number, TCServiceId service_id, int32_t bank )
+{	
+	g_demux[dmx].program_number = program_number;
+	g_demux[dmx].service_id = service_id;
+		
+	// add or update profile to demux
+	g_demux[dmx].profiles[profile].bank = bank;
+	g_demux[dmx].profiles[profile].ca_type = DMX_CA_DVB_CSA;
+	g_demux[dmx].profiles[profile].key_len = 8;
+	g_demux[dmx].profile_count = g_demux[dmx].profiles.size();
+	
+	// enable descrambling, in software if all the hardware demuxes are taken
+	start_descrambling(dmx, g_demux[dmx].profiles[profile].bank);
+	
+	if( (EProfile)(profile & 0xFFFF) == PROFILE_TYPE_RECORD )
+		open_journal(dmx, profile);
+	
+	save_demux(dmx);
+	
+	g_message("%s: dmx=%d, profile=%s, screen_id=%d, program number=0x%04x, service_id=%llx, bank=%d", __func__, dmx, to_str((EProfile)(profile & 0xFFFF)), profile >> 16, program_number, service_id, g_demux[dmx].profiles[profile].bank);	
+}
+
+// the sections come with the slot and its generation, those of an old subscription still being unsubscribed are dropped
+void subscribe_filter( int id, uint32_t profile )
+{
+	filter_t* f = &g_filters[id];
+	
+	ipc_op_t op = { IPC_SUBSCRIBE_FILTER };
+	op.ticket = new_ticket();
+	op.profile = profile;
+	op.user_param = (int)(((uint32_t)f->generation << 16) + id);
+	op.pid = f->pid;
+	memcpy(op.filter, f->filter, FILTER_SIZE);
+	memcpy(op.mask, f->mask, FILTER_SIZE);
+	
+	f->profile = profile;
+	f->handle = op.ticket;
+	queue_ipc(&op);
+}
+
+void unsubscribe_filter( int id )
+{
+	filter_t* f = &g_filters[id];
+	if(f->handle <= 0)
+		return;
+	
+	unsubscribe(f->handle);
+	f->handle = 0;
+}
+
+void drop_filter( int id )
+{
+	unsubscribe_filter(id);
+	filter_free(id);
+}
+
+// a subscription without users is parked for a while, the same filter is often asked for again right away
+void park_filter( int id )
+{
+	if(g_filter_grace_ms > 0 && g_filters[id].handle > 0)
+		filter_park(id, stats_now());
+	else
+		drop_filter(id);
+}
+
+// the last user of a subscription parks it
+void release_filter( uint8_t client, uint8_t dmx, uint8_t flt )
+{
+	int id = filter_find_user(client, dmx, flt);
+	if(id > -1 && filter_detach(id, client, dmx, flt))
+		park_filter(id);
+}
+
+void expire_filters()
+{
+	int id;
+	while((id = filter_parked_before(stats_now() - (uint64_t)g_filter_grace_ms * 1000)) > -1)
+		drop_filter(id);
+}
+
+// a demux that is restarted gets fresh subscriptions, a dead one must not be reused (nor kept by the no-op of an identical DMX_SET_FILTER);
+// the parked ones of other demuxes are left alone
+void refresh_filters( uint8_t dmx )
+{
+	for(int id = 0; id < FILTER_MAX; id++)
+	{
+		filter_t* f = filter_get(id);
+		if(!f)
 			continue;
+		
+		bool used = false;
+		for(int u = 0; u < f->users; u++)
+			used |= f->user[u].dmx == dmx;
+		
+		if(f->parked && (f->parked_dmx == dmx || g_demux[dmx].profiles.count(f->profile)))
+			drop_filter(id);
+		else if(used)
+		{
+			unsubscribe_filter(id);
+			subscribe_filter(id, f->profile);
 		}
+	}
+}
 
-		request = (uint32_t *) &buff;
-				
-	    if (ntohl(*request) != DVBAPI_SERVER_INFO)
+// the filters of a demux that lost its last profile are parked, those subscribed on a removed profile move to a profile of a remaining user;
+// a screen profile is tuned again after a zap and keeps its subscriptions for the way back, a recording profile does not come back
+void move_filters( uint8_t dmx, uint32_t profile )
+{
+	for(int id = 0; id < FILTER_MAX; id++)
+	{
+		filter_t* f = filter_get(id);
+		if(!f)
+			continue;
+		
+		if(g_demux[dmx].profiles.size() == 0)
+			for(int u = f->users - 1; u >= 0; u--)
+				if(f->user[u].dmx == dmx)
+					filter_detach(id, f->user[u].client, dmx, f->user[u].flt);
+		
+		if(f->profile != profile)
+		{
+			if(!f->users && !f->parked)
+				park_filter(id);
+			continue;
+		}
+		
+		if(!f->users && (EProfile)(profile & 0xFFFF) != PROFILE_TYPE_RECORD)
+		{
+			if(!f->parked)
+				park_filter(id);
+			continue;
+		}
+		
+		unsubscribe_filter(id);
+		if(!f->users || g_demux[f->user[0].dmx].profiles.size() == 0)
+		{
+			filter_free(id);
+			continue;
+		}
+		
+		auto owner = g_demux[f->user[0].dmx].profiles.begin();
+		f->bank = owner->second.bank;
+		subscribe_filter(id, owner->first);
+	}
+}
+
+void remove_profile( uint8_t dmx, uint32_t profile )
+{
+	uint8_t bank = g_demux[dmx].profiles[profile].bank;
+	
+	// stop section filters
+	if( g_demux[dmx].profiles[profile].pmt_filter > 0 )
+		unsubscribe(g_demux[dmx].profiles[profile].pmt_filter);
+	
+	g_demux[dmx].profiles.erase(profile);
+	g_demux[dmx].profile_count = g_demux[dmx].profiles.size();
+	move_filters(dmx, profile);
+	
+	// the key slots stay while another profile of the demux still descrambles on the bank
+	bool bank_shared = false;
+	for (auto && p : g_demux[dmx].profiles)
+		bank_shared |= p.second.bank == bank;
+	if(!bank_shared)
+		keyslot_release(bank, dmx);
+	
+	if(g_demux[dmx].journal && !has_record_profile(dmx))
+	{
+		cwlog_close(g_demux[dmx].journal);
+		g_demux[dmx].journal = NULL;
+	}
+	
+	// stop descrambling on bank, unless another service still uses it
+	if(soft_slot(dmx) > -1)
+	{
+		if(g_demux[dmx].profiles.size() == 0)
+			softcsa_stop(soft_slot(dmx));
+	}
+	else if(!bank_in_use(bank))
+	{
+		descrambler_stop(bank);
+		descrambler_enable(bank, false);
+		stop_tsmon(bank);
+	}
+	
+	g_message("%s: dmx=%d, %s, screen_id=%d", __func__, dmx, to_str((EProfile)(profile & 0xFFFF)), profile >> 16);
+		
+	if(g_demux[dmx].profiles.size() == 0)
+	{
+		g_demux[dmx].program_number = -1;
+		g_demux[dmx].service_id = 0;
+		memset(&g_demux[dmx].watch, 0, sizeof(cw_watch_t));
+		g_demux[dmx].watch.parity = -1;
+		reset_race(dmx);
+		stop_demux_clients( dmx );
+		
+		// its buffer goes back to the pool, and no stale PMT goes out before the one of the next program
+		set_pmt(dmx, NULL);
+	}
+	
+	save_demux(dmx);
+}
+
+void subscribe_pmt( uint8_t dmx, uint32_t profile_tag, int32_t program_number )
+{
+	ipc_op_t op = { IPC_SUBSCRIBE_PMT };
+	op.ticket = new_ticket();
+	op.profile = profile_tag;
+	op.user_param = (255 << 8) + dmx;
+	op.program_number = program_number;
+	
+	g_demux[dmx].profiles[profile_tag].pmt_filter = op.ticket;
+	queue_ipc(&op);
+}
+
+void reset_current_channel(EProfile profile, uint16_t screen_id)
+{	
+	if(get_bank( profile, screen_id ) < 0)
+		return;
+	
+	IServiceNavigation* serviceNav;
+	IPC(TRACE_CREATE_SERVICE_NAVIGATION, TVServiceAPI::CreateServiceNavigation(profile, screen_id, &serviceNav));
+	
+	TCServiceId serviceId;
+	ESource source;
+	if(IPC(TRACE_GET_START_SERVICE, serviceNav->GetStartService(serviceId, source)) <= 0)
+		fatal_error("reset_current_channel: GetStartService failed");
+	
+	// already resumed from the snapshot
+	pthread_mutex_lock(&g_state_lock);
+	int d = get_demux_index_by_profile(((uint32_t)screen_id << 16) + profile);
+	bool resumed = d > -1 && g_demux[d].service_id == serviceId;
+	pthread_mutex_unlock(&g_state_lock);
+	
+	// the callback does its tvs-api lookups before it takes the lock
+	if(source == SOURCE_TYPE_TV && !resumed)
+	{
+		TSSignalData sigdata = {serviceId};
+		onTTSignalCallback(SIGNAL_TUNE_SUCCESS, profile, screen_id, sigdata, 0);
+	}
+}
+
+// a CA PMT was sent, the first cw is due within STALL_FIRST_CW_MS; a demux given up on is recovered again
+void watch_pmt( int dmx )
+{
+	cw_watch_t* w = &g_demux[dmx].watch;
+	
+	w->last_event = stats_now();
+	w->stall_time = 0;
+	w->got_cw = false;
+	w->level = 0;
+}
+
+void watch_cw( int dmx, int parity )
+{
+	cw_watch_t* w = &g_demux[dmx].watch;
+	uint64_t now = stats_now();
+	
+	if(w->stall_time)
+	{
+		stats_latency_add(&g_stats.recovery, (uint32_t)(now - w->stall_time));
+		g_message("%s: dmx=%d recovered after %d ms, level=%d", __func__, dmx, (int)((now - w->stall_time) / 1000), w->level);
+	}
+	
+	// the time between two parity flips is the crypto period
+	if(w->parity > -1 && parity != w->parity)
+	{
+		if(w->flip_time)
+		{
+			uint32_t period = (uint32_t)(now - w->flip_time);
+			w->crypto_period = w->crypto_period ? (3 * w->crypto_period + period) / 4 : period;
+		}
+		w->flip_time = now;
+	}
+	
+	w->parity = parity;
+	w->last_event = now;
+	w->stall_time = 0;
+	w->got_cw = true;
+	w->level = 0;
+}
+
+// escalates: first ask oscam to update the demux, then restart it, until RECOVERY_MAX_LEVEL
+void recover_demux( int dmx )
+{
+	cw_watch_t* w = &g_demux[dmx].watch;
+	if(w->level > RECOVERY_MAX_LEVEL)
+		return;
+	
+	section_t* pmt = g_demux[dmx].program_number > -1 ? get_pmt(dmx) : NULL;
+	if(!pmt)
+		return;
+	
+	if(!w->stall_time)
+		w->stall_time = stats_now();
+	
+	// the winner may be the client that stalled, so every client gets the demux again,
+	// and a cw equal to the last one counts as an answer
+	promote_clients(dmx);
+	reset_race(dmx);
+	
+	if(w->level == 0)
+	{
+		g_message("%s: dmx=%d, sending CAPMT_LIST_UPDATE", __func__, dmx);
+		for(int c = 0; c < MAX_CLIENTS; c++)
+			if(g_clients[c].ready)
+				client_send(c, [&](dvbapi_link_t* link) { return send_pmt(link, CAPMT_LIST_UPDATE, pmt->data, dmx); });
+		__sync_add_and_fetch(&g_stats.recoveries_update, 1);
+	}
+	else
+	{
+		g_message("%s: dmx=%d, restarting demux (attempt %d)", __func__, dmx, w->level);
+		refresh_filters(dmx);
+		for(int c = 0; c < MAX_CLIENTS; c++)
+			if(g_clients[c].ready)
+			{
+				client_send(c, [&](dvbapi_link_t* link) { return send_stop_dmx(link, dmx) && send_pmt(link, CAPMT_LIST_ADD, pmt->data, dmx); });
+			}
+		__sync_add_and_fetch(&g_stats.recoveries_restart, 1);
+	}
+	
+	w->level++;
+	w->last_event = stats_now();
+	secpool_put(pmt);
+	
+	if(w->level > RECOVERY_MAX_LEVEL)
+	{
+		g_message("%s: dmx=%d, giving up after %d attempts, until the next zap or cw", __func__, dmx, w->level);
+		__sync_add_and_fetch(&g_stats.recoveries_given_up, 1);
+	}
+}
+
+void check_stalls()
+{
+	uint64_t now = stats_now();
+	
+	for( int i = 0; i < MAX_DEMUX; i++ )
+	{
+		cw_watch_t* w = &g_demux[i].watch;
+		if(g_demux[i].program_number < 0 || !w->last_event || w->level > RECOVERY_MAX_LEVEL)
+			continue;
+		
+		// no cw within 1.5 crypto periods (or after the CA PMT), twice as long after each attempt
+		uint64_t timeout = !w->got_cw ? STALL_FIRST_CW_MS * 1000 : (w->crypto_period ? w->crypto_period : STALL_PERIOD_MS * 1000) * 3 / 2;
+		if(now - w->last_event > timeout << w->level)
+		{
+			g_message("%s: dmx=%d, no cw for %d ms", __func__, i, (int)((now - w->last_event) / 1000));
+			recover_demux(i);
+		}
+	}
+}
+
+// the first CA PMT is sent with CAPMT_LIST_ONLY, so the client drops every other program
+void send_client_pmts( int c )
+{
+	int n = 0;
+	
+	for(int i = 0; i < MAX_DEMUX; i++)
+	{
+		section_t* pmt = g_demux[i].program_number > -1 && client_serves(c, i) ? get_pmt(i) : NULL;
+		if(!pmt)
+			continue;
+		
+		char lm = n++ == 0 ? CAPMT_LIST_ONLY : CAPMT_LIST_MORE;
+		client_send(c, [&](dvbapi_link_t* link) { return send_pmt(link, lm, pmt->data, i); });
+		watch_pmt(i);
+		secpool_put(pmt);
+	}
+}
+
+void send_pmts()
+{
+	for(int c = 0; c < MAX_CLIENTS; c++)
+		if(g_clients[c].ready)
+			send_client_pmts(c);
+}
+
+// called on tsmon's thread, a recovery sends to the clients and changes filters, so it is left to the socket thread
+void on_ts_stall( uint8_t bank )
+{
+	__sync_fetch_and_or(&g_stalled_banks, 1u << bank);
+	wake_socket_thread();
+}
+
+void recover_stalled_banks()
+{
+	uint32_t banks = __sync_fetch_and_and(&g_stalled_banks, 0);
+	
+	for( int bank = 0; banks; bank++, banks >>= 1 )
+	{
+		if(!(banks & 1))
+			continue;
+		
+		// main and pip can watch the same service on one bank, all of them get recovered
+		for( int dmx = 0; dmx < MAX_HW_DEMUX; dmx++ )
+			for (auto && x : g_demux[dmx].profiles)
+				if(x.second.bank == bank)
+				{
+					g_message("%s: stream on bank=%d stays scrambled, dmx=%d", __func__, bank, dmx);
+					recover_demux(dmx);
+					break;
+				}
+	}
+}
+
+// the cws are left to the cw thread, held back as if they had just come in
+void restore_snapshot()
+{
+	// a record the crash left half written is dropped
+	for( int i = 0; i < MAX_DEMUX; i++ )
+		if(!snapshot_valid(&g_snapshot->demux[i]))
+		{
+			g_message("%s: dmx=%d, record is damaged, skipped", __func__, i);
+			snapshot_reset(&g_snapshot->demux[i]);
+		}
+	
+	// only resume what tvs-api still has tuned the same way, looked up before the lock is taken
+	bool tuned[MAX_DEMUX][SNAPSHOT_PROFILES] = {};
+	for( int i = 0; i < MAX_DEMUX; i++ )
+		for(int n = 0; n < SNAPSHOT_PROFILES; n++)
+		{
+			snapshot_demux_t* s = &g_snapshot->demux[i];
+			snapshot_profile_t* p = &s->profiles[n];
+			EProfile profile = (EProfile)(p->tag & 0xFFFF);
+			uint16_t screen_id = p->tag >> 16;
+			
+			TCServiceId service_id;
+			tuned[i][n] = s->program_number > -1 && p->tag && query_service_id(profile, screen_id, &service_id) && service_id == s->service_id && get_bank(profile, screen_id) == p->bank;
+		}
+	
+	pthread_mutex_lock(&g_state_lock);
+	
+	for( int i = 0; i < MAX_DEMUX; i++ )
+	{
+		snapshot_demux_t* s = &g_snapshot->demux[i];
+		if(s->program_number < 0)
+			continue;
+		
+		for(int n = 0; n < SNAPSHOT_PROFILES; n++)
+		{
+			snapshot_profile_t* p = &s->profiles[n];
+			if(!p->tag)
+				continue;
+			
+			EProfile profile = (EProfile)(p->tag & 0xFFFF);
+			uint16_t screen_id = p->tag >> 16;
+			
+			if(!tuned[i][n])
+			{
+				g_message("%s: dmx=%d, %s, screen_id=%d is no longer tuned to %llx", __func__, i, to_str(profile), screen_id, s->service_id);
+				continue;
+			}
+			
+			g_demux[i].program_number = s->program_number;
+			g_demux[i].service_id = s->service_id;
+			g_demux[i].profiles[p->tag].bank = p->bank;
+			g_demux[i].profiles[p->tag].ca_type = (dmx_ca_type_t)p->ca_type;
+			g_demux[i].profiles[p->tag].key_len = p->key_len;
+			memcpy(g_demux[i].profiles[p->tag].cw, p->cw, sizeof(p->cw));
+			g_demux[i].profile_count = g_demux[i].profiles.size();
+			
+			start_descrambling(i, p->bank);
+			
+			// the client's cw index is not kept, it is set again with the next cw (and mode)
+			if(p->ca_type != DMX_CA_DVB_CSA)
+				descrambler_set_mode(p->bank, get_key_slot(p->bank, i, 0), (dmx_ca_type_t)p->ca_type);
+			
+			static const uint8_t no_cw[sizeof(p->cw)] = {0};
+			if(memcmp(p->cw, no_cw, sizeof(p->cw)))
+			{
+				profile_t* restored = &g_demux[i].profiles[p->tag];
+				restored->held = 3;
+				restored->held_index = 0;
+				restored->held_since = restored->held_until = stats_now();
+			}
+			
+			subscribe_pmt(i, p->tag, s->program_number);
+			
+			g_message("%s: dmx=%d, %s, screen_id=%d, service_id=%llx, bank=%d, pmt version=%d", __func__, i, to_str(profile), screen_id, s->service_id, p->bank, s->pmt_version);
+		}
+		
+		if(g_demux[i].program_number > -1 && s->pmt_length)
+			set_pmt(i, secpool_get(s->pmt, s->pmt_length));
+		
+		save_demux(i);
+	}
+	
+	print_demuxes();
+	pthread_mutex_unlock(&g_state_lock);
+	
+	wake_socket_thread();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void onSection( bool isDone, unsigned short length, unsigned char* pData, int userParam )
+{	
+	uint8_t flt = (userParam >> 8) & 0xFF;
+
+	g_message( "%s: userParam=0x%04X, [%02X %02X %02X %02X %02X %02X %02X %02X ...]", __func__, userParam, pData[0], pData[1], pData[2], pData[3], pData[4], pData[5], pData[6], pData[7] );
+		
+	// (255 << 8) + dmx for the PMT, the index in g_filters otherwise
+	if(flt == 255)
+	{
+		pthread_mutex_lock(&g_state_lock);
+		
+		int dmx = get_demux_index_by_program_number( (pData[3] << 8) + pData[4] );
+		g_message("%s: got PMT for dmx=%d, program_number=0x%04X, length=%d", __func__, dmx, (pData[3] << 8) + pData[4], length);
+		if(dmx < 0)
+		{
+			pthread_mutex_unlock(&g_state_lock);
+			return;
+		}
+		
+		// the one copy of the section, everybody else holds a reference
+		set_pmt(dmx, secpool_get(pData, length));
+		save_demux(dmx);
+		
+		if(soft_slot(dmx) > -1)
+			softcsa_set_pmt(soft_slot(dmx), pData);
+		
+		remove_unused_demuxes();
+					
+		send_pmts();
+		
+		// watch the scrambling control bits of the service
+		for(int i = 0; i < MAX_HW_DEMUX; i++)
+		{
+			section_t* pmt = g_demux[i].program_number > -1 ? get_pmt(i) : NULL;
+			if(!pmt)
+				continue;
+			
+			for (auto && p : g_demux[i].profiles)
+				start_tsmon(p.second.bank, get_pmt_monitor_pid(pmt->data));
+			secpool_put(pmt);
+		}
+		
+		pthread_mutex_unlock(&g_state_lock);
+	}
+	else
+	{
+		// ecm and emm sections go to the client filters of the subscription that match them, taken from it
+		// under its lock, so the socket thread can change the users meanwhile
+		filter_user_t users[FILTER_USERS];
+		int matched = filter_match_users(userParam & 0xFF, (uint16_t)((uint32_t)userParam >> 16), pData, length, users);
+		if(matched < 0)
+			return;
+		
+		if(!matched)
+			__sync_add_and_fetch(&g_stats.filter_unmatched, 1);
+		
+		uint32_t copies = 0;
+		for(int u = 0; u < matched; u++)
+		{
+			filter_user_t fu = users[u];
+			if(fu.client < MAX_CLIENTS && g_clients[fu.client].ready)
+				client_send(fu.client, [&](dvbapi_link_t* link) { return send_filter_data(link, fu.dmx, fu.flt, pData, length); });
+			
+			// a subscription per profile and request used to deliver a copy each
+			copies += g_demux[fu.dmx].profile_count;
+		}
+		
+		if(copies > 1)
+			__sync_add_and_fetch(&g_stats.filter_sections_saved, copies - 1);
+	}
+}
+
+static int onTTSignalCallback(ESignalType stype, EProfile profile, uint16_t screen_id, TSSignalData sigdata, void* pUserData)
+{		
+	TCServiceId service_id = get_service_id(profile, screen_id);
+	int32_t program_number = get_program_number(profile, screen_id);
+	int32_t bank = stype == SIGNAL_TUNE_SUCCESS && !(program_number & 0x80000000) ? get_bank(profile, screen_id) : -1;
+	uint32_t profile_tag = ((uint32_t)screen_id << 16) + profile;
+	
+	zap_t zap;
+	stats_zap_begin(&zap);
+	
+	pthread_mutex_lock(&g_state_lock);
+		
+	// find a demux using this program number
+	int dmx = get_demux_index_by_program_number(program_number);
+	
+	// find a demux using this profile
+	int d = get_demux_index_by_profile(profile_tag);
+
+	g_message("ESignalType=%s, EProfile=%s, screen_id=%d, program_number=0x%08X, dmx=%d, d=%d", to_str(stype), to_str(profile), screen_id, program_number, dmx, d);
+	
+	if(stype == SIGNAL_TUNE_STOP && d > -1)
+		remove_profile( d, profile_tag );
+		
+	if(stype == SIGNAL_TUNE_SUCCESS)
+	{
+		// exists demux for profile? (aka channel change)		
+		if(d > -1)
+		{
+			g_message("channel change on %s, screen_id=%d, dmx=%d", to_str(profile), screen_id, d);
+			
+			// then stop the profile and possibly the demux
+			remove_profile( d, profile_tag );
+		}
+		
+		// if channel is scrambled
+		if( !(program_number & 0x80000000) )
+		{				
+			// if exist a demux for program number
+			if (dmx > -1)			
+				// stop it, since it will be restarted
+				stop_demux_clients( dmx );
+			else
+				// start new demux			
+				dmx = get_free_demux_index();			
+									
+			// add the channel to the demux
+			add_profile( dmx, profile_tag, program_number, service_id, bank );
+			g_demux[dmx].zap = zap;
+												
+			// start PMT filter					
+			subscribe_pmt( dmx, profile_tag, program_number );
+		}
+	}
+	
+	print_demuxes();
+	pthread_mutex_unlock(&g_state_lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void lose_cw_race( int c, int dmx, uint32_t lag )
+{
+	g_stats.clients[c].losses++;
+	stats_latency_add(&g_stats.clients[c].lag, lag);
+	
+	if(++g_clients[c].losses[dmx] < DEMOTE_LOSSES || (g_clients[c].demoted & (1 << dmx)))
+		return;
+	
+	// leave the demux to the faster clients until it stalls or the winner goes away
+	g_message("%s: client=%d lost %d cws in a row on dmx=%d, demoting", __func__, c, g_clients[c].losses[dmx], dmx);
+	
+	g_clients[c].demoted |= 1 << dmx;
+	g_stats.clients[c].demotions++;
+	client_send(c, [&](dvbapi_link_t* link) { return send_stop_dmx(link, dmx); });
+}
+
+// the first client to deliver a cw for a parity wins, returns false for a cw that is already applied
+bool win_cw_race( int c, int dmx, int parity, uint8_t* cw, int key_len )
+{
+	cw_race_t* r = &g_demux[dmx].race;
+	uint64_t now = stats_now();
+	
+	uint8_t key[DESCRAMBLER_KEY_MAX] = {0};
+	memcpy(key, cw, key_len);
+	
+	if(r->winner[parity] > -1 && (!memcmp(r->cw[parity][0], key, sizeof(key)) || !memcmp(r->cw[parity][1], key, sizeof(key))))
+	{
+		// a copy of the previous cw is just stale, a copy of the current one came in second
+		if(r->winner[parity] != c && !memcmp(r->cw[parity][0], key, sizeof(key)))
+			lose_cw_race(c, dmx, (uint32_t)(now - r->time[parity]));
+		
+		return false;
+	}
+	
+	memcpy(r->cw[parity][1], r->cw[parity][0], sizeof(key));
+	memcpy(r->cw[parity][0], key, sizeof(key));
+	r->time[parity] = now;
+	r->winner[parity] = c;
+	
+	g_clients[c].losses[dmx] = 0;
+	g_stats.clients[c].wins++;
+	
+	return true;
+}
+
+// programs the held back cws of a bank, both parities in one call
+void flush_cw( uint8_t dmx, profile_t* p )
+{
+	if(!p->held)
+		return;
+	
+	if(p->held == 3)
+		g_stats.cw_coalesced++;
+	stats_latency_add(&g_stats.cw_held, (uint32_t)(stats_now() - p->held_since));
+	
+	set_cw(p->bank, dmx, p->held_index, p->held == 3 ? -1 : p->held >> 1, p->cw, p->key_len);
+	p->held = 0;
+	
+	stats_zap_end(&g_demux[dmx].zap);
+	stats_startup_mark(&g_stats.startup.first_cw, "first cw");
+}
+
+// programs the held back cws that are due, returns when the next ones are (us), 0 if none are held back
+uint64_t flush_due_cws()
+{
+	uint64_t now = stats_now(), next = 0;
+	
+	for(int i = 0; i < MAX_DEMUX; i++)
+		for (auto && x : g_demux[i].profiles)
+		{
+			if(!x.second.held)
+				continue;
+			
+			if(x.second.held_until <= now)
+				flush_cw(i, &x.second);
+			else if(!next || x.second.held_until < next)
+				next = x.second.held_until;
+		}
+	
+	return next;
+}
+
+// oscam sends the cws of both parities back to back after an ecm, the first one waits a little for the second;
+// a cw for the parity on air is needed right away and never waits
+void hold_cw( uint8_t dmx, profile_t* p, int index, int parity, uint8_t* cw )
+{
+	uint64_t now = stats_now();
+	
+	if(p->held && p->held_index != index)
+		flush_cw(dmx, p);
+	
+	memcpy(&p->cw[p->key_len * parity], cw, p->key_len);
+	
+	if(!p->held)
+	{
+		p->held_since = now;
+		p->held_until = now + g_cw_window_us;
+	}
+	p->held |= 1 << parity;
+	p->held_index = index;
+	
+	if(tsmon_parity(p->bank) == 2 + parity)
+		p->held_until = now;
+	
+	if(p->held == 3 || p->held_until <= now)
+		flush_cw(dmx, p);
+}
+
+// a cw from CA_SET_DESCR or CA_SET_DESCR_DATA, on every bank of the demux in the length of its mode
+void apply_cw( int client, uint8_t dmx, int index, int parity, uint8_t* cw, int key_len )
+{
+	if(dmx >= MAX_DEMUX) fatal_error("demux idx greater than MAX_DEMUX");
+	
+	if(!win_cw_race( client, dmx, parity, cw, key_len ))
+		return;
+	
+	cwlog_append( g_demux[dmx].journal, parity, cw, key_len );
+	
+	for (auto && x : g_demux[dmx].profiles)
+	{
+		if(x.second.key_len != key_len)
+		{
+			g_message("%s: dmx=%d, bank=%d expects %d byte keys, got %d", __func__, dmx, x.second.bank, x.second.key_len, key_len);
+			continue;
+		}
+		
+		hold_cw( dmx, &x.second, index, parity, cw );
+	}
+	
+	watch_cw( dmx, parity );
+	save_cw( dmx );
+}
+
+void handle_request( int client, dvbapi_request_t* request )
+{
+	uint8_t *data = request->data;
+	
+	if (request->opcode == DVBAPI_SERVER_INFO)
+	{
+		uint16_t protocol = (data[0] << 8) + data[1];
+		g_message("Got SERVER_INFO from client %d: %.*s, protocol_version = %d", client, data[2], &data[3], protocol);
+		
+		// both sides speak the lower version, from 3 on every message after this one is framed
+		client_t* cl = &g_clients[client];
+		g_mutex_lock(&cl->lock);
+		cl->link.protocol = std::min(protocol, (uint16_t)DVBAPI_PROTOCOL_VERSION);
+		g_mutex_unlock(&cl->lock);
+		cl->ready = true;
+		stats_startup_mark(&g_stats.startup.first_client, "first client");
+		
+		// replay the CA PMTs of the programs already running, they were prepared while nobody was connected
+		send_client_pmts(client);
+	}
+	else if (request->opcode == DVBAPI_ECM_INFO)
+	{
+		ecm_info_t info;
+		if (parse_ecm_info(request, &info))
 		{
-			// first byte -> adapter_index
-			nread = recv(g_socket, &adapter_index, 1, MSG_DONTWAIT);
-			if (nread <= 0)
+			stats_ecm_add(&info);
+			g_message("ECM_INFO: service %04x, caid %04x, pid %04x, provider %06x, %u ms, %s %s from %s (%s), %u hops", info.service_id, info.caid, info.pid, info.provider, info.ecm_time,
+				info.cardsystem, info.reader, info.from, info.protocol, info.hops);
+		}
+	}
+	else if (request->opcode == CA_SET_PID)
+	{								
+		ca_pid_t ca_pid;
+		memcpy(&ca_pid, data, sizeof(ca_pid_t));
+		ca_pid.pid = ntohl(ca_pid.pid);
+		ca_pid.index = ntohl(ca_pid.index);
+		
+		//g_message("Got CA_SET_PID request, adapter=%d, idx=%d, pid=0x%04X", request->adapter, ca_pid.index, ca_pid.pid);			
+		
+		// software slots descramble every stream of the pmt, there is nothing to match
+		if(request->adapter < MAX_DEMUX && soft_slot(request->adapter) < 0)
+			for (auto && x : g_demux[request->adapter].profiles)
 			{
-				if (nread == 0)
-					break;
-				usleep(20);
-				continue;
+				int slot = ca_pid.index < 0 ? -1 : get_key_slot(x.second.bank, request->adapter, ca_pid.index);
+				if(ca_pid.index < 0 || slot > -1)
+					descrambler_set_pid( x.second.bank, ca_pid.pid, slot );
 			}
-		}
+	}
+	else if (request->opcode == CA_SET_DESCR)
+	{
+		ca_descr_t ca_descr;						
+		memcpy(&ca_descr, data, sizeof(ca_descr_t));
+		ca_descr.index = ntohl(ca_descr.index);
+		ca_descr.parity = ntohl(ca_descr.parity);	// 0:odd, 1:even
 		
-		*request = ntohl(*request);
-
-		if (*request == CA_SET_PID)
-		  nread = recv(g_socket, buff+4, sizeof(ca_pid_t), MSG_DONTWAIT);
-		else if (*request == DVBAPI_ECM_INFO)
-		  nread = recv(g_socket, buff+4, 14, MSG_DONTWAIT);
-		else if (*request == CA_SET_DESCR)
-		  nread = recv(g_socket, buff+4, sizeof(ca_descr_t), MSG_DONTWAIT);
-		else if (*request == DMX_SET_FILTER)
-		  nread = recv(g_socket, buff+4, sizeof(dmx_sct_filter_params), MSG_DONTWAIT);
-		else if (*request == DMX_STOP)
-		  nread = recv(g_socket, buff+4, 2 + 2, MSG_DONTWAIT);
-		else
-		{		  
-			g_message("unknown request received");
-			usleep(20);
-			continue;
+		uint8_t dmx = request->adapter;
+												
+		g_message("Got CA_SET_DESCR request, client=%d, adapter=%d, idx=%d, cw parity=%d", client, request->adapter, ca_descr.index, ca_descr.parity);
+				
+		apply_cw( client, dmx, ca_descr.index, ca_descr.parity & 1, ca_descr.cw, 8 );
+	}
+	else if (request->opcode == DVBAPI_CA_SET_DESCR_MODE)
+	{
+		uint8_t dmx = request->adapter;
+		int32_t index = ntohl(*(uint32_t *) &data[0]);
+		uint32_t algo = ntohl(*(uint32_t *) &data[4]);
+		uint32_t cipher_mode = ntohl(*(uint32_t *) &data[8]);
+		
+		g_message("Got CA_SET_DESCR_MODE request, client=%d, adapter=%d, idx=%d, algo=%d, cipher_mode=%d", client, dmx, index, algo, cipher_mode);
+		
+		if(dmx >= MAX_DEMUX) fatal_error("demux idx greater than MAX_DEMUX");
+		
+		dmx_ca_type_t ca_type;
+		int key_len;
+		if(!get_descr_mode(algo, cipher_mode, &ca_type, &key_len))
+		{
+			g_message("%s: algo=%d, cipher_mode=%d is not supported by the descrambler", __func__, algo, cipher_mode);
+			return;
 		}
 		
-		if (nread <= 0)
+		if(soft_slot(dmx) > -1 && ca_type != DMX_CA_DVB_CSA)
 		{
-			if (nread == 0)
-				break;
-			usleep(20);
-			continue;
-		}			
+			g_message("%s: dmx=%d is descrambled in software, which only does csa", __func__, dmx);
+			return;
+		}
 		
-		if (*request == DVBAPI_ECM_INFO)
-		{						
-			//g_message("Got DVBAPI_ECM_INFO");
+		// the keys of the old mode are useless, the next cws of either parity start over
+		bool changed = false;
+		for (auto && x : g_demux[dmx].profiles)
+		{
+			if(x.second.ca_type == ca_type)
+				continue;
 			
-			// read 4 strings + 1 byte (hops)
-			int p = 14;
-			for(int i = 0; i < 4; i++)
+			if(bank_mode_conflict(x.second.bank, dmx, ca_type))
 			{
-				nread = recv(g_socket, buff + p, 1, MSG_DONTWAIT);					// strlen				
-				nread = recv(g_socket, buff + p + 1, buff[p], MSG_DONTWAIT);		// str
-				p += buff[p] + 1;				
-			}			
+				g_message("%s: dmx=%d shares bank=%d with a demux using another algorithm, mode change refused", __func__, dmx, x.second.bank);
+				continue;
+			}
 			
-			nread = recv(g_socket, buff + p, 1, MSG_DONTWAIT);		// hops						
+			int slot = get_key_slot(x.second.bank, dmx, index);
+			if(slot < 0 || !descrambler_set_mode(x.second.bank, slot, ca_type))
+				continue;
+			
+			x.second.ca_type = ca_type;
+			x.second.key_len = key_len;
+			x.second.held = 0;
+			memset(x.second.cw, 0, sizeof(x.second.cw));
+			changed = true;
 		}
-		else if (*request == CA_SET_PID)
-		{								
-			//g_message("Got CA_SET_PID request, adapter=%d, idx=%d, pid=0x%04X", adapter_index, ca_pid.index, ca_pid.pid);			
+		
+		if(changed)
+		{
+			reset_race(dmx);
+			save_demux(dmx);
 		}
-		else if (*request == CA_SET_DESCR)
+	}
+	else if (request->opcode == DVBAPI_CA_SET_DESCR_DATA)
+	{
+		uint8_t dmx = request->adapter;
+		int32_t index = ntohl(*(uint32_t *) &data[0]);
+		uint32_t parity = ntohl(*(uint32_t *) &data[4]);
+		uint32_t data_type = ntohl(*(uint32_t *) &data[8]);
+		uint32_t length = ntohl(*(uint32_t *) &data[12]);
+		
+		g_message("Got CA_SET_DESCR_DATA request, client=%d, adapter=%d, idx=%d, parity=%d, type=%d, length=%d", client, dmx, index, parity, data_type, length);
+		
+		// ca_config of the sdp has no room for an iv, aes-cbc runs with the one the hardware derives
+		if(data_type != CA_DATA_KEY)
+			return;
+		
+		if(length == 0 || length > DESCRAMBLER_KEY_MAX)
 		{
-			ca_descr_t ca_descr;						
-			memcpy(&ca_descr, &buff[sizeof(int)], sizeof(ca_descr_t));
-			ca_descr.index = ntohl(ca_descr.index);
-			ca_descr.parity = ntohl(ca_descr.parity);	// 0:odd, 1:even
-			
-			uint8_t dmx = adapter_index;
-													
-			g_message("Got CA_SET_DESCR request, adapter=%d, idx=%d, cw parity=%d", adapter_index, ca_descr.index, ca_descr.parity);
+			g_message("%s: unsupported key length %d", __func__, length);
+			return;
+		}
+		
+		apply_cw( client, dmx, index, parity & 1, &data[16], length );
+	}
+	else if (request->opcode == DMX_SET_FILTER)
+	{				
+		uint8_t dmx = data[0];
+		uint8_t flt = data[1];			
+		uint16_t pid = ntohs(*((uint16_t *) &data[2]));
 					
-			if(dmx >= MAX_DEMUX) fatal_error("demux idx greater than MAX_DEMUX");
-			
-			for (auto && x : g_demux[dmx].profiles)
-			{									
-				memcpy( &x.second.cw[8 * ca_descr.parity], ca_descr.cw, 8 );						
-				set_cw( x.second.bank, x.second.cw );
-			}
-		}		
-		else if (*request == DMX_SET_FILTER)
-		{				
-			uint8_t dmx = buff[4];
-			uint8_t flt = buff[5];			
-			uint16_t pid = ntohs(*((uint16_t *) &buff[6]));
-						
-			g_message("Got DMX_SET_FILTER request, idx=0x%02X, flt=0x%02X, pid=0x%04X, tableid=0x%02X, mask=0x%02X", dmx, flt, pid, buff[8], buff[24]);
-			
-			if(dmx >= MAX_DEMUX) fatal_error("demux idx greater than MAX_DEMUX");
-						
-			#define MAX_FILTER_SIZE 12	// 16 doesn't work
-			
-			TCSectionFilterCriteriaHelper filterCriteria;
-	
-			filterCriteria.filter.resize(MAX_FILTER_SIZE);
-			filterCriteria.mask.resize(MAX_FILTER_SIZE);
-			filterCriteria.invert.resize(MAX_FILTER_SIZE);
-			
-			filterCriteria.pid = pid;			
-			filterCriteria.filter[0] = buff[8];
-			filterCriteria.mask[0] = buff[24];
-			filterCriteria.checkCRC = true;
+		g_message("Got DMX_SET_FILTER request, idx=0x%02X, flt=0x%02X, pid=0x%04X, tableid=0x%02X, mask=0x%02X", dmx, flt, pid, data[4], data[20]);
+		
+		if(dmx >= MAX_DEMUX) fatal_error("demux idx greater than MAX_DEMUX");
 					
-			memcpy(&filterCriteria.filter[3], &buff[9], MAX_FILTER_SIZE - 3);
-			memcpy(&filterCriteria.mask[3], &buff[25], MAX_FILTER_SIZE - 3);	
-			memset(&filterCriteria.invert[0], 0, sizeof(filterCriteria.invert[0]) * MAX_FILTER_SIZE);
+		filter_user_t user;
+		filter_make_user(&user, &data[4], &data[4 + FILTER_DVBAPI_SIZE], &data[4 + 2 * FILTER_DVBAPI_SIZE], client, dmx, flt);
+		
+		if(g_demux[dmx].profiles.size() == 0)
+			return;
+		
+		// oscam restarting its ecm filtering sends the active filter again
+		auto owner = g_demux[dmx].profiles.begin();
+		int id = filter_find_user(client, dmx, flt);
+		filter_user_t* fu = filter_get_user(id, client, dmx, flt);
+		if(fu && g_filters[id].handle > 0 && g_filters[id].bank == owner->second.bank && g_filters[id].pid == pid && filter_user_equal(fu, &user))
+		{
+			g_stats.filter_reissues++;
+			return;
+		}
+		
+		// the filter number gets a new filter, the old one goes
+		release_filter(client, dmx, flt);
+		
+		// one subscription per pid on one profile of the demux, the others carry the same sections
+		bool widened;
+		id = filter_attach(owner->second.bank, pid, &user, &widened);
+		if(id < 0 && (id = filter_parked_before(0)) > -1)
+		{
+			drop_filter(id);
+			id = filter_attach(owner->second.bank, pid, &user, &widened);
+		}
+		
+		if(id < 0)
+		{
+			g_message("%s: no free section filter for dmx=%d, flt=%d", __func__, dmx, flt);
+			return;
+		}
+		
+		if(g_filters[id].handle > 0)
+		{
+			g_message("%s: dmx=%d, flt=%d shares subscription id=%d with %d other filters%s", __func__, dmx, flt, id, g_filters[id].users - 1, widened ? ", widened" : "");
+			if(g_filters[id].users == 1)
+				g_stats.filter_reclaims++;
+			else
+				g_stats.filter_subscribes_saved++;
 			
-			uint32_t userParam = (flt << 8) + dmx;
+			if(!widened)
+				return;
 			
-			for (auto && x : g_demux[dmx].profiles)
-			{			
-				ISectionSubscriber* pSectionSubscriber = NULL;
-				TVServiceAPI::CreateSectionSubscriber( &onSection, (EProfile)(x.first & 0xFFFF), x.first >> 16, &pSectionSubscriber );
-				
-				if( x.second.filters[flt] > 0 )
-					g_message("pSectionSubscriber->Unsubscribe=%d, h=%d, profile=%d", pSectionSubscriber->Unsubscribe( x.second.filters[flt] ), x.second.filters[flt], x.first);
-
-				g_message("pSectionSubscriber->SubscribeByFilter=%d, h=%d, profile=%d", pSectionSubscriber->SubscribeByFilter( userParam, filterCriteria, x.second.filters[flt] ), x.second.filters[flt], x.first);
-			}
+			// the filter the new user needs is not covered, the subscription is made again with what all users have in common
+			g_stats.filter_widened++;
+			uint32_t profile = g_filters[id].profile;
+			unsubscribe_filter(id);
+			subscribe_filter(id, profile);
+			return;
 		}
-		else if (*request == DMX_STOP)
-		{			
-			uint8_t dmx = buff[4];
-			uint8_t flt = buff[5];
-			uint16_t pid = ntohs(*((uint16_t *) &buff[6]));
-			
-			g_message("Got DMX_STOP request, idx=0x%02X, flt=0x%02X, pid=0x%04X", dmx, flt, pid);
+		
+		subscribe_filter(id, owner->first);
+	}
+	else if (request->opcode == DMX_STOP)
+	{			
+		uint8_t dmx = data[0];
+		uint8_t flt = data[1];
+		uint16_t pid = ntohs(*((uint16_t *) &data[2]));
+		
+		g_message("Got DMX_STOP request, idx=0x%02X, flt=0x%02X, pid=0x%04X", dmx, flt, pid);
+		
+		if(dmx >= MAX_DEMUX) fatal_error("demux idx greater than MAX_DEMUX");
+		
+		release_filter(client, dmx, flt);
+	}
+	else
+		g_message("unhandled data found");
+}
+
+// signal subscriptions live as long as the process, so demuxes keep tracking the tuners while no client is connected
+void subscribe_signals()
+{
+	// subscribe to tvs-api signals
+	ISignalSubscriber* pSignalSubscriber = NULL;		
+	IPC(TRACE_CREATE_SIGNAL_SUBSCRIBER, TVServiceAPI::CreateSignalSubscriber(&onTTSignalCallback, &pSignalSubscriber));
+
+	for(int screen_id = 0; screen_id < 2; screen_id++)
+	{
+		IPC(TRACE_SIGNAL_SUBSCRIBE, pSignalSubscriber->Subscribe(SIGNAL_TUNE_SUCCESS, 0, PROFILE_TYPE_PIP, screen_id));
+		IPC(TRACE_SIGNAL_SUBSCRIBE, pSignalSubscriber->Subscribe(SIGNAL_TUNE_SUCCESS, 0, PROFILE_TYPE_MAIN, screen_id));
+		IPC(TRACE_SIGNAL_SUBSCRIBE, pSignalSubscriber->Subscribe(SIGNAL_TUNE_SUCCESS, 0, PROFILE_TYPE_RECORD, screen_id));
+		IPC(TRACE_SIGNAL_SUBSCRIBE, pSignalSubscriber->Subscribe(SIGNAL_TUNE_STOP, 0, PROFILE_TYPE_PIP, screen_id));
+		IPC(TRACE_SIGNAL_SUBSCRIBE, pSignalSubscriber->Subscribe(SIGNAL_TUNE_STOP, 0, PROFILE_TYPE_MAIN, screen_id));
+		IPC(TRACE_SIGNAL_SUBSCRIBE, pSignalSubscriber->Subscribe(SIGNAL_TUNE_STOP, 0, PROFILE_TYPE_RECORD, screen_id));	
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the startup steps run side by side while the socket already listens, each one is a few ipcs that used to wait for the one before
+
+static gpointer init_pvr( gpointer data )
+{
+	g_message("svc_pvr_service_init=%d", IPC(TRACE_PVR_SERVICE_INIT, svc_pvr_service_init()));
+	
+	// subscribe to pvr signals
+	g_message("svc_pvr_register_signal_cb=%d", IPC(TRACE_PVR_REGISTER_SIGNAL_CB, svc_pvr_register_signal_cb(on_pvr_signal, (void*)0xdeadbeef)));
+	
+	stats_startup_mark(&g_stats.startup.pvr, "pvr service");
+	return NULL;
+}
+
+static gpointer init_signals( gpointer data )
+{
+	subscribe_signals();
+	
+	stats_startup_mark(&g_stats.startup.signals, "tvs-api signals");
+	return NULL;
+}
+
+// the CA PMTs are ready before the first client connects
+static gpointer init_services( gpointer data )
+{
+	// resume descrambling of every profile that is still tuned since the last run
+	if(data)
+		restore_snapshot();
+	
+	reset_current_channel(PROFILE_TYPE_MAIN, DEFAULT_SCREEN_ID);
+	reset_current_channel(PROFILE_TYPE_PIP, DEFAULT_SCREEN_ID);
+	
+	stats_startup_mark(&g_stats.startup.lookup, "service lookup");
+	return NULL;
+}
+
+static gpointer startup_thread_start( gpointer data )
+{
+	GThread* steps[] = {
+		g_thread_new("init_pvr", init_pvr, NULL),
+		g_thread_new("init_signals", init_signals, NULL),
+		g_thread_new("init_services", init_services, data),
+	};
+	
+	for(auto && step : steps)
+		g_thread_join(step);
+	
+	// a zap between the lookup and the signal subscription went unnoticed, looking again skips the services already found
+	reset_current_channel(PROFILE_TYPE_MAIN, DEFAULT_SCREEN_ID);
+	reset_current_channel(PROFILE_TYPE_PIP, DEFAULT_SCREEN_ID);
+	
+	g_message("%s: done after %d ms", __func__, (int)((stats_now() - g_stats.startup.start) / 1000));
+	return NULL;
+}
+
+// the ecm/emm filters belong to the disconnected client, descrambling goes on with the last cws
+void release_client_filters( int client )
+{
+	for(int id = 0; id < FILTER_MAX; id++)
+	{
+		filter_t* f = filter_get(id);
+		for(int u = f ? f->users - 1 : -1; u >= 0; u--)
+			if(f->user[u].client == client)
+				release_filter(client, f->user[u].dmx, f->user[u].flt);
+	}
+	
+	for( int i = 0; i < MAX_DEMUX; i++ )
+	{
+		// nobody to ask for cws until the next client
+		if(!ready_clients())
+			g_demux[i].watch.last_event = 0;
+	}
+}
+
+void accept_client( int socket_desc, bool tcp )
+{
+	int fd = accept(socket_desc, NULL, NULL);
+	if (fd < 0)
+	{
+		g_message("Accept failed: %s", strerror(errno));
+		return;
+	}
+	
+	if (tcp)
+		set_tcp_options(fd);
+	
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	
+	for(int c = 0; c < MAX_CLIENTS; c++)
+		if(g_clients[c].link.fd == -1)
+		{
+			client_t* cl = &g_clients[c];
+			g_mutex_lock(&cl->lock);
+			cl->link.fd = fd;
+			cl->link.protocol = 0;
+			cl->link.msgid = 0;
+			cl->ready = false;
+			cl->failed = false;
+			g_mutex_unlock(&cl->lock);
+			cl->buffered = 0;
+			cl->demoted = 0;
+			memset(cl->losses, 0, sizeof(cl->losses));
+			memset(&g_stats.clients[c], 0, sizeof(client_stats_t));
 			
-			if(dmx >= MAX_DEMUX) fatal_error("demux idx greater than MAX_DEMUX");
+			g_message("Client %d connected (%s)", c, tcp ? "tcp" : "unix");
 			
-			for (auto && x : g_demux[dmx].profiles)
-			{
-				ISectionSubscriber* pSectionSubscriber = NULL;
-				TVServiceAPI::CreateSectionSubscriber( &onSection, (EProfile)(x.first & 0xFFFF), x.first >> 16, &pSectionSubscriber );
-				
-				if( x.second.filters[flt] > 0 )
-					g_message("pSectionSubscriber->Unsubscribe=%d, h=%d, profile=%d", pSectionSubscriber->Unsubscribe( x.second.filters[flt] ), x.second.filters[flt], x.first);
-				
-				x.second.filters[flt] = 0;
-			}
+			// the client answers with SERVER_INFO
+			client_send(c, send_client_info);
+			return;
 		}
-		else
-			g_message("unhandled data found");
-	}	
+	
+	g_message("Client rejected, already serving %d clients", MAX_CLIENTS);
+	close(fd);
+}
 
-	for(int screen_id = 0; screen_id < 2; screen_id++)
+void disconnect_client( int c )
+{
+	// nobody writes to the socket any more once it is closed
+	client_t* cl = &g_clients[c];
+	g_mutex_lock(&cl->lock);
+	int fd = cl->link.fd;
+	cl->link.fd = -1;
+	cl->ready = false;
+	cl->failed = false;
+	g_mutex_unlock(&cl->lock);
+	close(fd);
+	
+	release_client_filters(c);
+	
+	// fail over: the demuxes this client was winning go back to the clients demoted from them
+	for(int i = 0; i < MAX_DEMUX; i++)
+	{
+		cw_race_t* r = &g_demux[i].race;
+		if(r->winner[0] != c && r->winner[1] != c)
+			continue;
+		
+		for(int parity = 0; parity < 2; parity++)
+			if(r->winner[parity] == c)
+				r->winner[parity] = -1;
+		
+		uint32_t promoted = promote_clients(i);
+		section_t* pmt = g_demux[i].program_number > -1 ? get_pmt(i) : NULL;
+		for(int n = 0; pmt && n < MAX_CLIENTS; n++)
+			if((promoted & (1 << n)) && g_clients[n].ready)
+				client_send(n, [&](dvbapi_link_t* link) { return send_pmt(link, CAPMT_LIST_ADD, pmt->data, i); });
+		secpool_put(pmt);
+	}
+	
+	g_message("Client %d disconnected", c);
+}
+
+void read_client( int c )
+{
+	client_t* cl = &g_clients[c];
+	dvbapi_request_t request;
+	
+	int32_t nread = recv(cl->link.fd, cl->buff + cl->buffered, sizeof(cl->buff) - cl->buffered, MSG_DONTWAIT);
+	if (nread <= 0)
+	{
+		if (nread == 0 || (errno != EAGAIN && errno != EINTR))
+			disconnect_client(c);
+		return;
+	}
+	
+	cl->buffered += nread;
+	
+	// handle every complete request, keep the incomplete tail for the next recv
+	int p = 0, n;
+	while ( (n = parse_request(cl->buff + p, cl->buffered - p, &request)) > 0 )
+	{
+		handle_request(c, &request);
+		p += n;
+	}
+	
+	if (n < 0)
 	{
-		pSignalSubscriber->Unsubscribe(SIGNAL_TUNE_SUCCESS, PROFILE_TYPE_PIP, screen_id);
-		pSignalSubscriber->Unsubscribe(SIGNAL_TUNE_SUCCESS, PROFILE_TYPE_MAIN, screen_id);
-		pSignalSubscriber->Unsubscribe(SIGNAL_TUNE_SUCCESS, PROFILE_TYPE_RECORD, screen_id);
-		pSignalSubscriber->Unsubscribe(SIGNAL_TUNE_STOP, PROFILE_TYPE_PIP, screen_id);
-		pSignalSubscriber->Unsubscribe(SIGNAL_TUNE_STOP, PROFILE_TYPE_MAIN, screen_id);
-		pSignalSubscriber->Unsubscribe(SIGNAL_TUNE_STOP, PROFILE_TYPE_RECORD, screen_id);
+		g_message("unknown request received from client %d", c);
+		p = cl->buffered;
 	}
 	
-//	g_message("svc_pvr_unregister_signal_cb=%d", svc_pvr_unregister_signal_cb(on_pvr_signal));
-       
-	close(g_socket);
-	g_socket = -1;
-	g_message("Client disconnected");    
-} 
+	cl->buffered -= p;
+	memmove(cl->buff, cl->buff + p, cl->buffered);
+}
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// for clients that can't reach the unix socket, e.g. oscam running in another container
+int create_tcp_listener()
+{
+	struct sockaddr_in server;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(g_tcp_port);
+	
+	if (inet_pton(AF_INET, g_tcp_address, &server.sin_addr) != 1)
+	{
+		g_message("Invalid tcp address: %s", g_tcp_address);
+		return -1;
+	}
+	
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+	{
+		g_message("Could not create tcp socket: %s", strerror(errno));
+		return -1;
+	}
+	
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	
+	// the buffer sizes have to be set before listen to be inherited by the accepted sockets
+	set_tcp_options(fd);
+	
+	if (bind(fd, (struct sockaddr *)&server, sizeof(server)) < 0 || listen(fd, MAX_CLIENTS) < 0)
+	{
+		g_message("Tcp socket bind failed: %s:%d: %s", g_tcp_address, g_tcp_port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	g_message("Listening on %s:%d", g_tcp_address, g_tcp_port);
+	
+	return fd;
+}
+
 static gpointer camd_socket_handler_thread_start( gpointer _data )
 {						
-	int socket_desc, client_sock, c;    
-	struct sockaddr_un server, client;
+	int socket_desc;    
+	struct sockaddr_un server;
 	
 	unlink(capmt_socket_name);
 		     
@@ -715,34 +2106,100 @@ static gpointer camd_socket_handler_thread_start( gpointer _data )
     }
      
     //Listen
-    listen(socket_desc , 3);
-     
-    //Accept an incoming connection
+    listen(socket_desc , MAX_CLIENTS);
+	stats_startup_mark(&g_stats.startup.listening, "listening");
+	
+	int tcp_desc = g_tcp_port ? create_tcp_listener() : -1;
+	
 	g_message("Waiting for incoming connections...");
-    c = sizeof(struct sockaddr_un);
 	
-    while( (client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c)) )
-    {
-        g_message("Client connected");
-		camd_connection_handler(client_sock);
-    }
-     
-    if (client_sock < 0)
-    {
-		g_message("Accept failed");
-        return NULL;
-    }
+	// pollfds for the unix and tcp listeners and the wake eventfd, then one per client slot (fd -1 is skipped by poll)
+	struct pollfd fds[3 + MAX_CLIENTS];
+	uint64_t last_stall_check = 0, next_cw = 0;
+	
+	while (1)
+	{
+		fds[0].fd = socket_desc;
+		fds[0].events = POLLIN;
+		fds[1].fd = tcp_desc;
+		fds[1].events = POLLIN;
+		fds[2].fd = g_wake_fd;
+		fds[2].events = POLLIN;
+		
+		for(int c = 0; c < MAX_CLIENTS; c++)
+		{
+			fds[3 + c].fd = g_clients[c].link.fd;
+			fds[3 + c].events = POLLIN;
+		}
+		
+		// a held back cw shortens the wait to the microsecond
+		uint64_t now = stats_now(), wait_us = STALL_CHECK_MS * 1000;
+		if (next_cw)
+			wait_us = next_cw > now ? std::min(wait_us, next_cw - now) : 0;
+		struct timespec timeout = { (time_t)(wait_us / 1000000), (long)(wait_us % 1000000) * 1000 };
+		
+		int ready = ppoll(fds, 3 + MAX_CLIENTS, &timeout, NULL);
+		if (ready < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			
+			g_message("poll failed: %s", strerror(errno));
+			return NULL;
+		}
+		
+		// a timeout that ends late shows what the scheduler does to the cw path
+		if (ready == 0)
+			stats_histogram_add(&g_stats.cw_jitter, (uint32_t)std::max((int64_t)0, (int64_t)(stats_now() - now - wait_us)));
+		
+		pthread_mutex_lock(&g_state_lock);
+		
+		if (stats_now() - last_stall_check > STALL_CHECK_MS * 1000)
+		{
+			check_stalls();
+			expire_filters();
+			last_stall_check = stats_now();
+		}
+		
+		if (fds[2].revents & POLLIN)
+		{
+			uint64_t posted;
+			read(g_wake_fd, &posted, sizeof(posted));
+		}
+		recover_stalled_banks();
+		
+		for(int c = 0; c < MAX_CLIENTS; c++)
+			if (fds[3 + c].fd > -1 && fds[3 + c].revents)
+				read_client(c);
+		
+		for(int c = 0; c < MAX_CLIENTS; c++)
+			if (g_clients[c].failed && g_clients[c].link.fd > -1)
+				disconnect_client(c);
+		
+		next_cw = flush_due_cws();
+		
+		if (fds[0].revents & POLLIN)
+			accept_client(socket_desc, false);
+		
+		if (fds[1].revents & POLLIN)
+			accept_client(tcp_desc, true);
+		
+		pthread_mutex_unlock(&g_state_lock);
+	}
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////
 
 void termination_handler (int signum)
 {
-	svc_pvr_unregister_signal_cb(on_pvr_signal);	
+	IPC(TRACE_PVR_UNREGISTER_SIGNAL_CB, svc_pvr_unregister_signal_cb(on_pvr_signal));	
 	
 	TVServiceAPI::Destroy();
 	
-	close(g_socket);	
+	for(int c = 0; c < MAX_CLIENTS; c++)
+		if(g_clients[c].link.fd > -1)
+			close(g_clients[c].link.fd);
+	
 	unlink(capmt_socket_name);
 		
 	g_message("exit successful");
@@ -750,6 +2207,13 @@ void termination_handler (int signum)
 	exit(EXIT_SUCCESS);
 }
 
+static gboolean on_sigusr1( gpointer user_data )
+{
+	stats_dump_file();
+	
+	return G_SOURCE_CONTINUE;
+}
+
 static void log_handler_cb( const gchar *log_domain, GLogLevelFlags  log_level, const gchar *message, gpointer user_data )
 {	
 	g_printerr ("(%s): %s\n", g_date_time_format( g_date_time_new_now_local(), "%H:%M:%S" ), message);    
@@ -779,12 +2243,94 @@ void fatal_error( const char* str )
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// oscam tries the ecm pids in the order of the CA descriptors: the CAID that was fastest on this service goes first,
+// then by how fast it was on the others, CAIDs without an ECM_INFO yet keep their order behind them
+static int rank_ca( uint16_t program_number, uint16_t caid )
+{
+	if (g_ca_allowed && std::find(g_ca_allow, g_ca_allow + g_ca_allowed, caid) == g_ca_allow + g_ca_allowed)
+		return -1;
+	
+	int32_t ms = stats_ecm_time(program_number, caid);
+	if (ms < 0)
+		ms = stats_ecm_time(0, caid);
+	
+	return ms < 0 ? CA_RANK_UNKNOWN : std::min(ms, CA_RANK_UNKNOWN - 1);
+}
+
+// "0100,1830" to g_ca_allow, false if it is no list of CAIDs
+static bool parse_ca_allow( const char* list )
+{
+	g_ca_allowed = 0;
+	while (*list)
+	{
+		char* end;
+		long caid = strtol(list, &end, 16);
+		if (end == list || caid < 0 || caid > 0xFFFF || (*end && *end != ',') || g_ca_allowed == CA_ALLOW_MAX)
+			return false;
+		
+		g_ca_allow[g_ca_allowed++] = caid;
+		list = *end ? end + 1 : end;
+	}
+	
+	return g_ca_allowed > 0;
+}
+
 int main( int argc, char *argv[] ) 
 {
+	int opt;
+	while ((opt = getopt(argc, argv, "t:j:g:w:r:m:a:")) != -1)
+	{
+		if (opt == 't')
+		{
+			// [address:]port
+			char* colon = strrchr(optarg, ':');
+			g_tcp_port = atoi(colon ? colon + 1 : optarg);
+			
+			if (colon)
+			{
+				*colon = 0;
+				g_tcp_address = optarg;
+			}
+		}
+		else if (opt == 'j')
+			g_cwlog_dir = strcmp(optarg, "-") ? optarg : NULL;
+		else if (opt == 'g')
+			g_filter_grace_ms = atoi(optarg);
+		else if (opt == 'w')
+			g_cw_window_us = atoi(optarg);
+		else if (opt == 'r')
+		{
+			// priority[:cpus]
+			char* colon = strchr(optarg, ':');
+			g_rt.priority = std::min(atoi(optarg), RT_PRIORITY_MAX);
+			g_rt.cpus = colon ? rt_parse_cpus(colon + 1) : 0;
+			g_rt.lock = true;
+		}
+		else if (opt == 'm')
+			g_section_budget = atoi(optarg) * 1024;
+		else if (opt == 'a' && parse_ca_allow(optarg))
+			;
+		else
+		{
+			printf("usage: %s [-t [address:]port] [-j dir] [-g ms] [-w us] [-r priority[:cpus]] [-m kB] [-a caid[,caid...]]\n"
+				"\t-t\talso accept dvbapi clients over tcp (address defaults to %s)\n"
+				"\t-j\tdirectory for the cw journals of recordings, on the recordings' storage (default none)\n"
+				"\t-g\tkeep released section filters for reuse this long (default %d, 0 for off)\n"
+				"\t-w\tlet a cw wait this long for the other parity to program both at once (default %d, 0 for off)\n"
+				"\t-r\trun the cw path with SCHED_FIFO priority (0 to keep the default) on cpus (as in 2,3) in locked memory\n"
+				"\t-m\tmemory for section buffers (default %d)\n"
+				"\t-a\toffer oscam only these CAIDs (hex) in the CA PMTs\n", argv[0], DEFAULT_TCP_ADDRESS, FILTER_GRACE_MS, CW_WINDOW_US, SECPOOL_BUDGET / 1024);
+			return 1;
+		}
+	}
+	
+	stats_startup_begin();
 	g_log_set_handler(G_LOG_DOMAIN, G_LOG_LEVEL_MASK, log_handler_cb, NULL);
 	
 	g_message("### dvbcam (build %s) [%s] - MrB 2021 ###", SVN_REV, get_fw_version().c_str());	
-	g_message("svc_pvr_service_init=%d", svc_pvr_service_init());
+	
+	if(g_cwlog_dir && !cwlog_dir_usable(g_cwlog_dir))
+		g_cwlog_dir = NULL;
 	
 	// some clean up is required before exit
 	if (signal (SIGINT, termination_handler) == SIG_IGN)
@@ -794,11 +2340,33 @@ int main( int argc, char *argv[] )
 	if (signal (SIGTERM, termination_handler) == SIG_IGN)
 		signal (SIGTERM, SIG_IGN);
 	
+	// a client closing its socket must not kill us while we write to it
+	signal (SIGPIPE, SIG_IGN);
+	
+	secpool_init(g_section_budget);
+	capmt_ca_rank = rank_ca;
+	init_demux();
+	for(int c = 0; c < MAX_CLIENTS; c++)
+		g_clients[c].link.fd = -1;
+	rt_mutex_init(&g_state_lock);
+	g_wake_fd = eventfd(0, EFD_NONBLOCK);
+	tsmon_init(on_ts_stall);
+	g_thread_new("ipc", ipc_thread_start, NULL);
+	
+	bool restored;
+	g_snapshot = snapshot_open(SNAPSHOT_FILE, &restored);
+	
+	// dump stats on SIGUSR1
+	g_unix_signal_add(SIGUSR1, on_sigusr1, NULL);
+	
 	// redirect stdout to /dev/null to stop annoying teec messages
 //	freopen("/dev/null", "w", stdout);
 		
-	// start oscam socket handler thread
-	g_thread_new(NULL, camd_socket_handler_thread_start, NULL);
+	// start oscam socket handler thread, it programs all the cws
+	if (!g_rt.lock || !rt_thread_new(camd_socket_handler_thread_start, NULL, &g_rt))
+		g_thread_new(NULL, camd_socket_handler_thread_start, NULL);
+	
+	g_thread_new("startup", startup_thread_start, restored ? g_snapshot : NULL);
 						
 	GMainLoop* loop = g_main_loop_new(NULL, FALSE);
 	g_main_loop_run(loop);
@@ -0,0 +1,270 @@
+#include <glib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "filters.h"
+
+filter_t g_filters[FILTER_MAX];
+
+// held while the users of a subscription change or are matched, filter_t itself is cleared with memset
+static GMutex g_filter_locks[FILTER_MAX];
+static uint16_t g_filter_generations[FILTER_MAX];
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool vec_zero( filter_vec_t v )
+{
+	uint64_t w[2];
+	memcpy(w, &v, sizeof(w));
+
+	return !(w[0] | w[1]);
+}
+
+// the section bytes a dvbapi filter is compared to: table id, then 3~17
+static filter_vec_t section_vec( uint8_t* section, int length )
+{
+	uint8_t b[FILTER_DVBAPI_SIZE] = {0};
+	b[0] = section[0];
+	if(length > 3)
+		memcpy(&b[1], &section[3], std::min(FILTER_DVBAPI_SIZE - 1, length - 3));
+
+	filter_vec_t v;
+	memcpy(&v, b, sizeof(v));
+
+	return v;
+}
+
+// the bits every user wants equal with the same value, on the bytes tvs-api matches
+static void common_filter( filter_t* f, uint8_t* filter, uint8_t* mask )
+{
+	filter_vec_t m = f->user[0].positive;
+	for(int u = 1; u < f->users; u++)
+		m &= f->user[u].positive & ~(f->user[u].value ^ f->user[0].value);
+
+	uint8_t vb[FILTER_DVBAPI_SIZE], mb[FILTER_DVBAPI_SIZE];
+	filter_vec_t v = f->user[0].value & m;
+	memcpy(vb, &v, sizeof(vb));
+	memcpy(mb, &m, sizeof(mb));
+
+	memset(filter, 0, FILTER_SIZE);
+	memset(mask, 0, FILTER_SIZE);
+	filter[0] = vb[0];
+	mask[0] = mb[0];
+	memcpy(&filter[3], &vb[1], FILTER_SIZE - 3);
+	memcpy(&mask[3], &mb[1], FILTER_SIZE - 3);
+}
+
+// everything filter and mask let through passes the subscribed filter too
+static bool covers( filter_t* f, uint8_t* filter, uint8_t* mask )
+{
+	for(int i = 0; i < FILTER_SIZE; i++)
+		if((f->mask[i] & ~mask[i]) || ((f->filter[i] ^ filter[i]) & f->mask[i]))
+			return false;
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void filter_make_user( filter_user_t* fu, uint8_t* filter, uint8_t* mask, uint8_t* mode, uint8_t client, uint8_t dmx, uint8_t flt )
+{
+	filter_vec_t f, m, n;
+	memcpy(&f, filter, sizeof(f));
+	memcpy(&m, mask, sizeof(m));
+	memcpy(&n, mode, sizeof(n));
+
+	fu->value = f & m;
+	fu->positive = m & ~n;
+	fu->negative = m & n;
+	fu->client = client;
+	fu->dmx = dmx;
+	fu->flt = flt;
+}
+
+bool filter_user_equal( filter_user_t* a, filter_user_t* b )
+{
+	return vec_zero((a->value ^ b->value) | (a->positive ^ b->positive) | (a->negative ^ b->negative));
+}
+
+int filter_find_user( uint8_t client, uint8_t dmx, uint8_t flt )
+{
+	for(int id = 0; id < FILTER_MAX; id++)
+		if(filter_get_user(id, client, dmx, flt))
+			return id;
+
+	return -1;
+}
+
+filter_user_t* filter_get_user( int id, uint8_t client, uint8_t dmx, uint8_t flt )
+{
+	filter_t* f = filter_get(id);
+	for(int u = 0; f && u < f->users; u++)
+		if(f->user[u].client == client && f->user[u].dmx == dmx && f->user[u].flt == flt)
+			return &f->user[u];
+
+	return NULL;
+}
+
+int filter_attach( uint8_t bank, uint16_t pid, filter_user_t* request, bool* widened )
+{
+	int id, free_id = -1;
+	for(id = 0; id < FILTER_MAX; id++)
+	{
+		filter_t* f = &g_filters[id];
+		if(!f->used)
+		{
+			if(free_id < 0)
+				free_id = id;
+			continue;
+		}
+
+		if(f->bank == bank && f->pid == pid && f->users < FILTER_USERS)
+			break;
+	}
+
+	if(id == FILTER_MAX)
+	{
+		if(free_id < 0)
+			return -1;
+
+		id = free_id;
+		g_mutex_lock(&g_filter_locks[id]);
+		filter_t* f = &g_filters[id];
+		memset(f, 0, sizeof(filter_t));
+		f->generation = ++g_filter_generations[id];
+		f->bank = bank;
+		f->pid = pid;
+		f->used = true;
+	}
+	else
+		g_mutex_lock(&g_filter_locks[id]);
+
+	filter_t* f = &g_filters[id];
+	f->parked = 0;
+	f->user[f->users++] = *request;
+	g_mutex_unlock(&g_filter_locks[id]);
+
+	// a subscription is only ever widened, the users' filters sort out the rest
+	uint8_t filter[FILTER_SIZE], mask[FILTER_SIZE];
+	common_filter(f, filter, mask);
+
+	*widened = f->handle > 0 && !covers(f, filter, mask);
+	if(f->handle <= 0 || *widened)
+	{
+		memcpy(f->filter, filter, FILTER_SIZE);
+		memcpy(f->mask, mask, FILTER_SIZE);
+	}
+
+	return id;
+}
+
+bool filter_detach( int id, uint8_t client, uint8_t dmx, uint8_t flt )
+{
+	filter_t* f = filter_get(id);
+	if(!f)
+		return false;
+
+	g_mutex_lock(&g_filter_locks[id]);
+	for(int u = 0; u < f->users; u++)
+		if(f->user[u].client == client && f->user[u].dmx == dmx && f->user[u].flt == flt)
+		{
+			f->user[u] = f->user[f->users - 1];
+			f->users--;
+			f->parked_dmx = dmx;
+			break;
+		}
+	g_mutex_unlock(&g_filter_locks[id]);
+
+	return f->users == 0;
+}
+
+void filter_free( int id )
+{
+	if(id < 0 || id >= FILTER_MAX)
+		return;
+
+	g_mutex_lock(&g_filter_locks[id]);
+	memset(&g_filters[id], 0, sizeof(filter_t));
+	g_mutex_unlock(&g_filter_locks[id]);
+}
+
+void filter_park( int id, uint64_t now )
+{
+	filter_t* f = filter_get(id);
+	if(f && !f->users)
+		f->parked = now ? now : 1;
+}
+
+int filter_parked_before( uint64_t time )
+{
+	int oldest = -1;
+	for(int id = 0; id < FILTER_MAX; id++)
+	{
+		filter_t* f = &g_filters[id];
+		if(f->used && f->parked && (!time || f->parked < time) && (oldest < 0 || f->parked < g_filters[oldest].parked))
+			oldest = id;
+	}
+
+	return oldest;
+}
+
+void filter_swap_demux( uint8_t i, uint8_t j )
+{
+	for(int id = 0; id < FILTER_MAX; id++)
+	{
+		g_mutex_lock(&g_filter_locks[id]);
+		for(int u = 0; u < g_filters[id].users; u++)
+		{
+			filter_user_t* fu = &g_filters[id].user[u];
+			if(fu->dmx == i)
+				fu->dmx = j;
+			else if(fu->dmx == j)
+				fu->dmx = i;
+		}
+		
+		filter_t* f = &g_filters[id];
+		if(f->parked && f->parked_dmx == i)
+			f->parked_dmx = j;
+		else if(f->parked && f->parked_dmx == j)
+			f->parked_dmx = i;
+		g_mutex_unlock(&g_filter_locks[id]);
+	}
+}
+
+// one vector compare per user, the section is loaded once
+uint32_t filter_match( filter_t* f, uint8_t* section, int length )
+{
+	filter_vec_t s = section_vec(section, length);
+	uint32_t matches = 0;
+
+	for(int u = 0; u < f->users; u++)
+	{
+		filter_user_t* fu = &f->user[u];
+		filter_vec_t d = s ^ fu->value;
+
+		if(vec_zero(d & fu->positive) && (vec_zero(fu->negative) || !vec_zero(d & fu->negative)))
+			matches |= 1u << u;
+	}
+
+	return matches;
+}
+
+int filter_match_users( int id, uint16_t generation, uint8_t* section, int length, filter_user_t* users )
+{
+	if(id < 0 || id >= FILTER_MAX)
+		return -1;
+
+	int n = -1;
+	g_mutex_lock(&g_filter_locks[id]);
+	filter_t* f = filter_get(id);
+	if(f && f->generation == generation)
+	{
+		uint32_t matches = filter_match(f, section, length);
+		for(int u = n = 0; u < f->users; u++)
+			if(matches & (1u << u))
+				users[n++] = f->user[u];
+	}
+	g_mutex_unlock(&g_filter_locks[id]);
+
+	return n;
+}
@@ -0,0 +1,81 @@
+#ifndef _FILTERS_H_
+#define _FILTERS_H_
+
+#include <stdint.h>
+
+#define FILTER_SIZE			12				// section bytes tvs-api matches: table id, 2 unused, 3~11 (16 doesn't work)
+#define FILTER_DVBAPI_SIZE	16				// dvbapi filter bytes: table id, then section bytes 3~17
+#define FILTER_MAX			64				// tvs-api section subscriptions at once
+#define FILTER_USERS		32				// demux filters served by one subscription (bits of a filter_match result)
+#define FILTER_GRACE_MS		5000			// default time a subscription without users is kept for reuse
+
+// 16 bytes compared at once (neon / sse2 on the targets we build for)
+typedef uint8_t filter_vec_t __attribute__((vector_size(FILTER_DVBAPI_SIZE)));
+
+// a DMX_SET_FILTER of a client on a demux, matched in software
+typedef struct filter_user {
+	filter_vec_t value;
+	filter_vec_t positive;					// mask & ~mode: bits that have to be equal
+	filter_vec_t negative;					// mask & mode: bits of which at least one has to differ
+	uint8_t client;
+	uint8_t dmx;
+	uint8_t flt;
+} filter_user_t;
+
+// one tvs-api subscription per pid on a bank, subscribed with the widest filter all its users have in common
+typedef struct filter {
+	bool used;
+	uint8_t bank;
+	uint16_t pid;
+	uint8_t filter[FILTER_SIZE];			// as subscribed
+	uint8_t mask[FILTER_SIZE];
+	uint32_t profile;						// profile tag the subscription was made on
+	int32_t handle;							// ticket of the tvs-api subscription (see queue_ipc in dvbcam.cpp), 0 if not subscribed
+	uint16_t generation;					// of the slot, changes when it is taken again; in the subscription's userParam
+	uint64_t parked;						// when the last user left (us), 0 while in use
+	uint8_t parked_dmx;						// demux of the last user, kept while parked
+	uint8_t users;							// changed under the subscription's lock, see filter_match_users
+	filter_user_t user[FILTER_USERS];
+} filter_t;
+
+extern filter_t g_filters[FILTER_MAX];
+
+// filter, mask and mode as sent in DMX_SET_FILTER
+void filter_make_user( filter_user_t* fu, uint8_t* filter, uint8_t* mask, uint8_t* mode, uint8_t client, uint8_t dmx, uint8_t flt );
+bool filter_user_equal( filter_user_t* a, filter_user_t* b );
+
+// the subscription serving a request, -1 if it has none
+int filter_find_user( uint8_t client, uint8_t dmx, uint8_t flt );
+filter_user_t* filter_get_user( int id, uint8_t client, uint8_t dmx, uint8_t flt );
+
+// adds a request to the subscription of its pid, parked ones included (a new one with handle 0 if there is none), -1 if all are taken;
+// widened is set if the subscribed filter no longer lets through all the sections the users want
+int filter_attach( uint8_t bank, uint16_t pid, filter_user_t* request, bool* widened );
+
+// removes a request, returns true if the subscription has no users left and has to be parked or unsubscribed
+bool filter_detach( int id, uint8_t client, uint8_t dmx, uint8_t flt );
+void filter_free( int id );
+
+// keeps a subscription without users until it is reclaimed by filter_attach or expires
+void filter_park( int id, uint64_t now );
+
+// the parked subscription parked before time (the oldest if time is 0), -1 if there is none
+int filter_parked_before( uint64_t time );
+
+// the users follow their demux when two demuxes are swapped
+void filter_swap_demux( uint8_t i, uint8_t j );
+
+// users (bit mask) whose filter matches a section
+uint32_t filter_match( filter_t* f, uint8_t* section, int length );
+
+// for the section callback, which runs beside the socket thread that attaches and detaches users: copies the users
+// matching a section to users (FILTER_USERS of them) under the subscription's lock, returns how many, -1 if id is unused
+// or taken again since generation (a subscription still being unsubscribed)
+int filter_match_users( int id, uint16_t generation, uint8_t* section, int length, filter_user_t* users );
+
+static inline filter_t* filter_get( int id )
+{
+	return id >= 0 && id < FILTER_MAX && g_filters[id].used ? &g_filters[id] : 0;
+}
+
+#endif
@@ -0,0 +1,188 @@
+/*
+	filters_bench - software matching of the demux filters sharing one section subscription (make filters_bench)
+
+	usage: filters_bench [-n sections] [-r rounds]
+		-n	sections per round, default 65536
+		-r	rounds, default 10
+
+	emm like filters (table ids 0x82~0x8F, unique and shared addresses, some with mode bits) are put on one pid
+	1, 4, 8, 16 and 32 at a time; every section is checked against a byte by byte reference, so a wrong
+	common filter or a broken vector compare fails the run
+*/
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "filters.h"
+
+#define SECTION_SIZE		64
+
+typedef struct request {
+	uint8_t filter[FILTER_DVBAPI_SIZE];
+	uint8_t mask[FILTER_DVBAPI_SIZE];
+	uint8_t mode[FILTER_DVBAPI_SIZE];
+} request_t;
+
+static void null_log_handler( const gchar *log_domain, GLogLevelFlags log_level, const gchar *message, gpointer user_data )
+{
+}
+
+// what oscam's emm filters look like: a table id, a card address in the bytes after the section header
+static void make_request( request_t* r, int n )
+{
+	memset(r, 0, sizeof(request_t));
+
+	r->filter[0] = 0x82 + n % 14;
+	r->mask[0] = 0xFF;
+
+	if(n % 4 == 3)
+	{
+		// shared emm, only the table id counts
+		return;
+	}
+
+	r->filter[1] = 0x10 + n;
+	r->filter[2] = 0x20;
+	r->filter[3] = n * 7;
+	r->mask[1] = r->mask[2] = r->mask[3] = 0xFF;
+
+	// not the last emm of this address: mode asks for a differing byte
+	if(n % 8 == 5)
+	{
+		r->filter[4] = 0x00;
+		r->mask[4] = 0xFF;
+		r->mode[4] = 0xFF;
+	}
+}
+
+// the dvbapi semantics spelled out, one byte at a time
+static bool reference_match( request_t* r, uint8_t* section, int length )
+{
+	bool differs = false, any_negative = false;
+
+	for(int i = 0; i < FILTER_DVBAPI_SIZE; i++)
+	{
+		int at = i ? i + 2 : 0;
+		uint8_t byte = at < length ? section[at] : 0;
+		uint8_t positive = r->mask[i] & ~r->mode[i];
+		uint8_t negative = r->mask[i] & r->mode[i];
+
+		if((byte ^ r->filter[i]) & positive)
+			return false;
+
+		any_negative |= negative != 0;
+		differs |= ((byte ^ r->filter[i]) & negative) != 0;
+	}
+
+	return !any_negative || differs;
+}
+
+// sections that hit the filters about half of the time
+static void make_sections( uint8_t* sections, int count, request_t* requests, int users )
+{
+	srand(1);
+	for(int s = 0; s < count; s++)
+	{
+		uint8_t* sec = sections + s * SECTION_SIZE;
+		for(int i = 0; i < SECTION_SIZE; i++)
+			sec[i] = rand();
+
+		request_t* r = &requests[rand() % users];
+		if(rand() & 1)
+		{
+			sec[0] = r->filter[0];
+			for(int i = 1; i < FILTER_DVBAPI_SIZE; i++)
+				sec[i + 2] = (sec[i + 2] & ~r->mask[i]) | (r->filter[i] & r->mask[i]);
+		}
+	}
+}
+
+int main( int argc, char *argv[] )
+{
+	int count = 65536, rounds = 10, opt;
+
+	while((opt = getopt(argc, argv, "n:r:")) != -1)
+	{
+		if(opt == 'n')
+			count = atoi(optarg);
+		else if(opt == 'r')
+			rounds = atoi(optarg);
+		else
+		{
+			printf("usage: %s [-n sections] [-r rounds]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	g_log_set_handler(G_LOG_DOMAIN, G_LOG_LEVEL_MASK, null_log_handler, NULL);
+
+	request_t requests[FILTER_USERS];
+	for(int n = 0; n < FILTER_USERS; n++)
+		make_request(&requests[n], n);
+
+	uint8_t* sections = new uint8_t[count * SECTION_SIZE];
+	int sizes[] = { 1, 4, 8, 16, 32 };
+	int failures = 0;
+
+	for(int users : sizes)
+	{
+		memset(g_filters, 0, sizeof(g_filters));
+
+		int id = -1, widened = 0;
+		for(int n = 0; n < users; n++)
+		{
+			filter_user_t fu;
+			filter_make_user(&fu, requests[n].filter, requests[n].mask, requests[n].mode, 0, 0, n);
+
+			bool w;
+			id = filter_attach(0, 0x0011, &fu, &w);
+			g_filters[id].handle = 1;
+			widened += w;
+		}
+
+		filter_t* f = &g_filters[id];
+		make_sections(sections, count, requests, users);
+
+		// the subscribed filter has to let through every section a user wants
+		uint32_t matched = 0;
+		for(int s = 0; s < count; s++)
+		{
+			uint8_t* sec = sections + s * SECTION_SIZE;
+			uint32_t matches = filter_match(f, sec, SECTION_SIZE);
+
+			for(int u = 0; u < f->users; u++)
+			{
+				request_t* r = &requests[f->user[u].flt];
+				bool expected = reference_match(r, sec, SECTION_SIZE);
+				bool subscribed = true;
+				for(int i = 0; i < FILTER_SIZE; i++)
+					subscribed &= ((sec[i] ^ f->filter[i]) & f->mask[i]) == 0;
+
+				if(expected != !!(matches & (1u << u)) || (expected && !subscribed))
+					failures++;
+			}
+
+			matched += matches != 0;
+		}
+
+		uint64_t start = stats_now();
+		for(int r = 0; r < rounds; r++)
+			for(int s = 0; s < count; s++)
+				filter_match(f, sections + s * SECTION_SIZE, SECTION_SIZE);
+		uint64_t us = stats_now() - start;
+
+		printf("filters.users_%d.ns_per_section %.1f (widened %d times, %u%% of the sections matched)\n", users,
+			(double)us * 1000 / ((double)count * rounds), widened, matched * 100 / count);
+	}
+
+	printf("filters.failures %d\n", failures);
+
+	delete[] sections;
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,71 @@
+#include <glib.h>
+
+#include "keyslot.h"
+
+typedef struct keyslot {
+	bool used;
+	uint8_t dmx;
+	int index;						// cw index as sent by the client
+} keyslot_t;
+
+static keyslot_t g_keyslots[KEYSLOT_BANKS][KEYSLOT_MAX];
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int keyslot_get( uint8_t bank, uint8_t dmx, int index, int slots )
+{
+	if(bank >= KEYSLOT_BANKS || index < 0)
+		return -1;
+
+	if(slots > KEYSLOT_MAX)
+		slots = KEYSLOT_MAX;
+
+	keyslot_t* s = g_keyslots[bank];
+	int free_slot = -1;
+
+	for(int i = 0; i < slots; i++)
+	{
+		if(s[i].used && s[i].dmx == dmx && s[i].index == index)
+			return i;
+
+		if(!s[i].used && free_slot < 0)
+			free_slot = i;
+	}
+
+	if(free_slot < 0)
+	{
+		g_message("%s: no free key slot on bank=%d for dmx=%d, index=%d", __func__, bank, dmx, index);
+		return -1;
+	}
+
+	s[free_slot].used = true;
+	s[free_slot].dmx = dmx;
+	s[free_slot].index = index;
+
+	g_message("%s: bank=%d, dmx=%d, index=%d -> keyidx=%d", __func__, bank, dmx, index, free_slot);
+
+	return free_slot;
+}
+
+void keyslot_release( uint8_t bank, uint8_t dmx )
+{
+	if(bank >= KEYSLOT_BANKS)
+		return;
+
+	for(int i = 0; i < KEYSLOT_MAX; i++)
+		if(g_keyslots[bank][i].used && g_keyslots[bank][i].dmx == dmx)
+			g_keyslots[bank][i].used = false;
+}
+
+void keyslot_swap_demux( uint8_t i, uint8_t j )
+{
+	for(int b = 0; b < KEYSLOT_BANKS; b++)
+		for(int k = 0; k < KEYSLOT_MAX; k++)
+		{
+			keyslot_t* s = &g_keyslots[b][k];
+			if(s->used && s->dmx == i)
+				s->dmx = j;
+			else if(s->used && s->dmx == j)
+				s->dmx = i;
+		}
+}
@@ -0,0 +1,18 @@
+#ifndef _KEYSLOT_H_
+#define _KEYSLOT_H_
+
+#include <stdint.h>
+
+#define KEYSLOT_BANKS		8
+#define KEYSLOT_MAX			32				// keyidx 0~31 of ca_config_t
+
+// key slot of a bank for the cw index a client uses on a demux, allocated on first use, -1 if the bank is full
+int keyslot_get( uint8_t bank, uint8_t dmx, int index, int slots );
+
+// frees the slots of a demux on a bank
+void keyslot_release( uint8_t bank, uint8_t dmx );
+
+// the slots of two demuxes change owner when the demuxes swap places
+void keyslot_swap_demux( uint8_t i, uint8_t j );
+
+#endif
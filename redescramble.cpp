@@ -0,0 +1,306 @@
+/*
+	redescramble - descrambles what a recording has left scrambled with the cws dvbcam journaled for it (make redescramble)
+
+	usage: redescramble [-t threads] [-w window] journal input.ts output.ts
+		-t	worker threads, default one per core
+		-w	seconds a crypto period may lie away from the journal time of its cw, default 30
+
+	the recording is cut into crypto periods where the scrambling parity changes, each period is placed in time by
+	the pcr and gets the journal entry of its parity close to that time which turns its first pes header clear
+*/
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <dvbcsa/dvbcsa.h>
+
+#include "cwlog.h"
+
+#define TS_PACKET_SIZE		188
+#define PCR_WRAP			(1ULL << 33)
+
+typedef struct period {
+	uint32_t first, last;				// packets
+	int parity;
+	uint64_t time;						// into the recording (us), from the pcr
+	int32_t probe;						// first scrambled packet starting a pes, -1 if none
+	int32_t key;						// journal entry, -1 if none matched
+} period_t;
+
+static uint8_t* g_ts;					// output mapping
+static std::vector<period_t> g_periods;
+static cwlog_header_t* g_journal;
+static volatile uint32_t g_next_period = 0;
+static volatile uint32_t g_descrambled = 0;
+
+static void null_log_handler( const gchar *log_domain, GLogLevelFlags log_level, const gchar *message, gpointer user_data )
+{
+}
+
+static int payload_offset( uint8_t* pkt )
+{
+	return 4 + (pkt[3] & 0x20 ? 1 + pkt[4] : 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// periods of equal parity and their position in time, returns false if there was no pcr to place them
+static bool scan( uint8_t* ts, uint32_t packets )
+{
+	uint64_t first_pcr = PCR_WRAP, time = 0;
+	int pcr_pid = -1;
+
+	for(uint32_t i = 0; i < packets; i++)
+	{
+		uint8_t* pkt = ts + (size_t)i * TS_PACKET_SIZE;
+		if(pkt[0] != 0x47)
+			continue;
+
+		int pid = ((pkt[1] & 0x1F) << 8) + pkt[2];
+
+		// adaptation field with a pcr, the first pid carrying one is the clock
+		if((pkt[3] & 0x20) && pkt[4] >= 7 && (pkt[5] & 0x10) && (pcr_pid < 0 || pcr_pid == pid))
+		{
+			uint64_t pcr = ((uint64_t)pkt[6] << 25) + (pkt[7] << 17) + (pkt[8] << 9) + (pkt[9] << 1) + (pkt[10] >> 7);
+			if(pcr_pid < 0)
+			{
+				pcr_pid = pid;
+				first_pcr = pcr;
+			}
+
+			time = ((pcr - first_pcr) & (PCR_WRAP - 1)) * 100 / 9;
+		}
+
+		if(!(pkt[3] & 0x80) || !(pkt[3] & 0x10))
+			continue;
+
+		int parity = (pkt[3] >> 6) & 1;
+		if(g_periods.empty() || g_periods.back().parity != parity)
+			g_periods.push_back({ i, i, parity, time, -1, -1 });
+
+		period_t* p = &g_periods.back();
+		p->last = i;
+		if(p->probe < 0 && (pkt[1] & 0x40) && payload_offset(pkt) + 3 <= TS_PACKET_SIZE)
+			p->probe = i;
+	}
+
+	return pcr_pid > -1;
+}
+
+// a cw is right if the pes header of the probe packet comes out clear
+static bool check_key( struct dvbcsa_key_s* key, uint32_t entry, uint8_t* pkt )
+{
+	cwlog_entry_t* e = &cwlog_entries(g_journal)[entry];
+	if(e->key_len != 8)
+		return false;
+
+	uint8_t payload[TS_PACKET_SIZE];
+	int offset = payload_offset(pkt);
+	memcpy(payload, pkt + offset, TS_PACKET_SIZE - offset);
+
+	dvbcsa_key_set(e->cw, key);
+	dvbcsa_decrypt(key, payload, TS_PACKET_SIZE - offset);
+
+	return payload[0] == 0x00 && payload[1] == 0x00 && payload[2] == 0x01;
+}
+
+static void resolve( bool timed, uint64_t window )
+{
+	struct dvbcsa_key_s* key = dvbcsa_key_alloc();
+	cwlog_entry_t* e = cwlog_entries(g_journal);
+	int32_t last[2] = { -1, -1 };
+
+	for(auto && p : g_periods)
+	{
+		// the cw of the last period of the same parity is the first guess, a period without pes start has to take it
+		if(last[p.parity] > -1 && (p.probe < 0 || check_key(key, last[p.parity], g_ts + (size_t)p.probe * TS_PACKET_SIZE)))
+		{
+			p.key = last[p.parity];
+			continue;
+		}
+
+		if(p.probe < 0)
+			continue;
+
+		// of the entries around the time of the period the nearest one that fits wins
+		uint64_t t = g_journal->start + p.time;
+		uint32_t lo = 0, hi = g_journal->count;
+		if(timed)
+		{
+			lo = cwlog_find(g_journal, t > window ? t - window : 0);
+			hi = cwlog_find(g_journal, t + window);
+			if(lo > 0)
+				lo--;						// the cw that was current when the window opened
+		}
+
+		uint64_t best = ~0ULL;
+		for(uint32_t n = lo; n < hi; n++)
+		{
+			uint64_t distance = e[n].time > t ? e[n].time - t : t - e[n].time;
+			if(e[n].parity != p.parity || distance >= best || !check_key(key, n, g_ts + (size_t)p.probe * TS_PACKET_SIZE))
+				continue;
+
+			p.key = n;
+			best = distance;
+		}
+
+		if(p.key > -1)
+			last[p.parity] = p.key;
+		else
+			printf("no cw for the %s period at %.1f s (packets %u-%u) among %u journal entries\n", p.parity ? "odd" : "even",
+				p.time / 1000000.0, p.first, p.last, hi - lo);
+	}
+
+	dvbcsa_key_free(key);
+}
+
+// periods are taken one at a time, so a slow one does not hold up the other threads
+static gpointer worker_thread( gpointer data )
+{
+	unsigned int batch_size = dvbcsa_bs_batch_size();
+	struct dvbcsa_bs_key_s* key = dvbcsa_bs_key_alloc();
+	struct dvbcsa_bs_batch_s* batch = new dvbcsa_bs_batch_s[batch_size + 1];
+
+	uint32_t i;
+	while((i = __sync_fetch_and_add(&g_next_period, 1)) < g_periods.size())
+	{
+		period_t* p = &g_periods[i];
+		if(p->key < 0)
+			continue;
+
+		dvbcsa_bs_key_set(cwlog_entries(g_journal)[p->key].cw, key);
+
+		unsigned int n = 0, done = 0;
+		for(uint32_t k = p->first; k <= p->last; k++)
+		{
+			uint8_t* pkt = g_ts + (size_t)k * TS_PACKET_SIZE;
+			int offset = payload_offset(pkt);
+			if(pkt[0] != 0x47 || (pkt[3] & 0xC0) != (0x80 | (p->parity << 6)) || !(pkt[3] & 0x10) || offset >= TS_PACKET_SIZE)
+				continue;
+
+			pkt[3] &= 0x3F;
+			batch[n].data = pkt + offset;
+			batch[n].len = TS_PACKET_SIZE - offset;
+
+			if(++n == batch_size)
+			{
+				batch[n].data = NULL;
+				dvbcsa_bs_decrypt(key, batch, TS_PACKET_SIZE - 4);
+				done += n;
+				n = 0;
+			}
+		}
+
+		if(n)
+		{
+			batch[n].data = NULL;
+			dvbcsa_bs_decrypt(key, batch, TS_PACKET_SIZE - 4);
+			done += n;
+		}
+
+		__sync_add_and_fetch(&g_descrambled, done);
+	}
+
+	delete[] batch;
+	dvbcsa_bs_key_free(key);
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int main( int argc, char *argv[] )
+{
+	int threads = sysconf(_SC_NPROCESSORS_ONLN), window = 30, opt;
+
+	while((opt = getopt(argc, argv, "t:w:")) != -1)
+	{
+		if(opt == 't')
+			threads = atoi(optarg);
+		else if(opt == 'w')
+			window = atoi(optarg);
+		else
+			break;
+	}
+
+	if(opt != -1 || argc - optind != 3 || threads < 1)
+	{
+		printf("usage: %s [-t threads] [-w window] journal input.ts output.ts\n", argv[0]);
+		return 1;
+	}
+
+	g_log_set_handler(G_LOG_DOMAIN, G_LOG_LEVEL_MASK, null_log_handler, NULL);
+
+	g_journal = cwlog_map(argv[optind]);
+	if(!g_journal)
+	{
+		printf("%s is no cw journal\n", argv[optind]);
+		return 1;
+	}
+
+	int in = open(argv[optind + 1], O_RDONLY);
+	struct stat st;
+	if(in < 0 || fstat(in, &st) < 0)
+	{
+		printf("unable to open %s: %s\n", argv[optind + 1], strerror(errno));
+		return 1;
+	}
+
+	int out = open(argv[optind + 2], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(out < 0 || ftruncate(out, st.st_size) < 0)
+	{
+		printf("unable to create %s: %s\n", argv[optind + 2], strerror(errno));
+		return 1;
+	}
+
+	uint8_t* src = (uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, in, 0);
+	g_ts = (uint8_t*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+	if(src == MAP_FAILED || g_ts == MAP_FAILED)
+	{
+		printf("unable to map the recording: %s\n", strerror(errno));
+		return 1;
+	}
+
+	memcpy(g_ts, src, st.st_size);
+	munmap(src, st.st_size);
+	close(in);
+
+	uint32_t packets = st.st_size / TS_PACKET_SIZE;
+	bool timed = scan(g_ts, packets);
+	if(!timed)
+		printf("no pcr found, every journal entry is tried\n");
+
+	resolve(timed, (uint64_t)window * 1000000);
+
+	uint64_t start = cwlog_now();
+	std::vector<GThread*> workers;
+	for(int i = 0; i < threads; i++)
+		workers.push_back(g_thread_new("redescramble", worker_thread, NULL));
+	for(auto && w : workers)
+		g_thread_join(w);
+	uint64_t us = cwlog_now() - start;
+
+	uint32_t resolved = 0, left = 0;
+	for(auto && p : g_periods)
+		if(p.key > -1)
+			resolved++;
+		else
+			left += p.last - p.first + 1;
+
+	printf("%u packets, %u crypto periods, %u with a cw, %u journal entries\n", packets, (uint32_t)g_periods.size(), resolved, g_journal->count);
+	printf("%u packets descrambled on %d threads in %.1f s (%.1f Mbit/s), up to %u left scrambled\n", g_descrambled, threads, us / 1000000.0,
+		us ? (double)g_descrambled * TS_PACKET_SIZE * 8 / us : 0.0, left);
+
+	munmap(g_ts, st.st_size);
+	close(out);
+
+	return resolved == g_periods.size() ? 0 : 2;
+}
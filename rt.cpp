@@ -0,0 +1,133 @@
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "rt.h"
+
+typedef struct rt_start {
+	rt_thread_func func;
+	void* data;
+	rt_config_t config;
+} rt_start_t;
+
+// the pages of the stack the thread will use are faulted in now instead of in the middle of a cw
+static void __attribute__((noinline)) prefault_stack()
+{
+	volatile uint8_t stack[RT_STACK_SIZE - 64 * 1024];
+	for(size_t i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+static void setup( rt_config_t* config )
+{
+	if(config->cpus)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for(int cpu = 0; cpu < 32; cpu++)
+			if(config->cpus & (1u << cpu))
+				CPU_SET(cpu, &set);
+
+		if(sched_setaffinity(0, sizeof(set), &set) < 0)
+			g_message("%s: unable to set the affinity to 0x%x: %s", __func__, config->cpus, strerror(errno));
+	}
+
+	// MCL_ONFAULT keeps the stacks of the threads started later from being locked whole
+	if(config->lock)
+	{
+#ifdef MCL_ONFAULT
+		if(mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) < 0 && mlockall(MCL_CURRENT) < 0)
+#else
+		if(mlockall(MCL_CURRENT) < 0)
+#endif
+			g_message("%s: unable to lock the memory: %s", __func__, strerror(errno));
+
+		prefault_stack();
+	}
+
+	if(config->priority > 0)
+	{
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = config->priority;
+
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if(err)
+			g_message("%s: unable to set SCHED_FIFO priority %d: %s", __func__, config->priority, strerror(err));
+	}
+
+	g_message("%s: priority=%d, cpus=0x%x, locked=%d", __func__, config->priority, config->cpus, config->lock);
+}
+
+static void* rt_thread( void* data )
+{
+	rt_start_t start = *(rt_start_t*)data;
+	delete (rt_start_t*)data;
+
+	setup(&start.config);
+
+	return start.func(start.data);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint32_t rt_parse_cpus( const char* list )
+{
+	uint32_t cpus = 0;
+
+	while(*list)
+	{
+		char* end;
+		long cpu = strtol(list, &end, 10);
+		if(end == list || cpu < 0 || cpu > 31 || (*end && *end != ','))
+			return 0;
+
+		cpus |= 1u << cpu;
+		list = *end ? end + 1 : end;
+	}
+
+	return cpus;
+}
+
+bool rt_thread_new( rt_thread_func func, void* data, rt_config_t* config )
+{
+	rt_start_t* start = new rt_start_t;
+	start->func = func;
+	start->data = data;
+	start->config = *config;
+
+	// a small stack of our own, a locked default one would pin 8 MB
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_t thread;
+	int err = pthread_create(&thread, &attr, rt_thread, start);
+	pthread_attr_destroy(&attr);
+
+	if(err)
+	{
+		g_message("%s: unable to start the thread: %s", __func__, strerror(err));
+		delete start;
+		return false;
+	}
+
+	return true;
+}
+
+void rt_mutex_init( pthread_mutex_t* mutex )
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if(pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT))
+		g_message("%s: no priority inheritance", __func__);
+
+	pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
@@ -0,0 +1,28 @@
+#ifndef _RT_H_
+#define _RT_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define RT_STACK_SIZE		(512 * 1024)	// stack of the cw thread, touched and locked up front
+#define RT_PRIORITY_MAX		99
+
+typedef void* (*rt_thread_func)( void* data );
+
+// what the cw thread runs with, priority 0 and cpus 0 leave the scheduler alone
+typedef struct rt_config {
+	int priority;							// SCHED_FIFO priority, 0 for SCHED_OTHER
+	uint32_t cpus;							// cpus (bit mask) the thread may run on, 0 for any
+	bool lock;								// mlockall and a prefaulted stack, no page fault on the cw path
+} rt_config_t;
+
+// "2" or "2,3" to a bit mask, 0 if it is none
+uint32_t rt_parse_cpus( const char* list );
+
+// a thread that is set up before func runs, settings that fail are logged and skipped
+bool rt_thread_new( rt_thread_func func, void* data, rt_config_t* config );
+
+// recursive and priority inheriting: the cw thread never waits behind a lower priority holder that got preempted
+void rt_mutex_init( pthread_mutex_t* mutex );
+
+#endif
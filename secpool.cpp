@@ -0,0 +1,134 @@
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "stats.h"
+#include "secpool.h"
+
+static_assert(SECPOOL_CLASSES == STATS_POOL_CLASSES, "pool stats per size class");
+
+typedef struct slab {
+	uint32_t size;
+	uint32_t buffers;
+	uint8_t* memory;						// buffers * size bytes, allocated once
+	section_t sections[SECPOOL_BUFFERS];
+	volatile uint64_t used;					// buffers (bit mask) handed out, the bits beyond buffers are always set
+} slab_t;
+
+static slab_t g_slabs[SECPOOL_CLASSES];
+static volatile uint32_t g_bytes_in_use = 0;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the bit of a free buffer is claimed by compare and swap, two threads never get the same one and nobody waits
+static int take( slab_t* s )
+{
+	uint64_t used;
+	while((used = s->used) != ~0ULL)
+	{
+		int n = __builtin_ctzll(~used);
+		if(__sync_bool_compare_and_swap(&s->used, used, used | (1ULL << n)))
+			return n;
+	}
+
+	return -1;
+}
+
+// racy by design, a missed maximum is one a concurrent caller is about to write
+static void high_water( volatile uint32_t* mark, uint32_t value )
+{
+	if(value > *mark)
+		*mark = value;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void secpool_init( uint32_t budget )
+{
+	static const uint32_t sizes[SECPOOL_CLASSES] = { 256, 1024, SECPOOL_SECTION_MAX };
+
+	for(int c = 0; c < SECPOOL_CLASSES; c++)
+	{
+		slab_t* s = &g_slabs[c];
+		s->size = sizes[c];
+		s->buffers = std::min(budget / SECPOOL_CLASSES / s->size, (uint32_t)SECPOOL_BUFFERS);
+		s->memory = s->buffers ? (uint8_t*)malloc(s->buffers * s->size) : NULL;
+		if(!s->memory)
+			s->buffers = 0;
+
+		for(uint32_t n = 0; n < s->buffers; n++)
+		{
+			s->sections[n].data = s->memory + n * s->size;
+			s->sections[n].cls = c;
+			s->sections[n].index = n;
+		}
+		s->used = s->buffers < 64 ? ~0ULL << s->buffers : 0;
+
+		g_stats.sections[c].size = s->size;
+		g_stats.sections[c].buffers = s->buffers;
+		g_message("%s: %u buffers of %u bytes", __func__, s->buffers, s->size);
+	}
+
+	g_stats.section_budget = budget;
+}
+
+section_t* secpool_get( const uint8_t* data, int length )
+{
+	if(length < 0 || length > SECPOOL_SECTION_MAX)
+		return NULL;
+
+	// the smallest class that fits and has a buffer left
+	section_t* s = NULL;
+	for(int c = 0; c < SECPOOL_CLASSES && !s; c++)
+	{
+		int n = length <= (int)g_slabs[c].size ? take(&g_slabs[c]) : -1;
+		if(n < 0)
+			continue;
+
+		s = &g_slabs[c].sections[n];
+		high_water(&g_stats.sections[c].high_water, __sync_add_and_fetch(&g_stats.sections[c].in_use, 1));
+		high_water(&g_stats.section_bytes_high_water, __sync_add_and_fetch(&g_bytes_in_use, g_slabs[c].size));
+	}
+
+	// over budget the section is not lost, it only costs an allocation
+	if(!s)
+	{
+		__sync_add_and_fetch(&g_stats.section_overflows, 1);
+		s = new section_t;
+		s->data = new uint8_t[std::max(length, 1)];
+		s->cls = -1;
+		s->index = 0;
+	}
+
+	memcpy(s->data, data, length);
+	s->length = length;
+	s->refs = 1;
+
+	return s;
+}
+
+section_t* secpool_ref( section_t* s )
+{
+	if(s)
+		__sync_add_and_fetch(&s->refs, 1);
+
+	return s;
+}
+
+void secpool_put( section_t* s )
+{
+	if(!s || __sync_sub_and_fetch(&s->refs, 1) > 0)
+		return;
+
+	if(s->cls < 0)
+	{
+		delete[] s->data;
+		delete s;
+		return;
+	}
+
+	__sync_sub_and_fetch(&g_stats.sections[s->cls].in_use, 1);
+	__sync_sub_and_fetch(&g_bytes_in_use, g_slabs[s->cls].size);
+	__sync_fetch_and_and(&g_slabs[s->cls].used, ~(1ULL << s->index));
+}
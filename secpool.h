@@ -0,0 +1,32 @@
+#ifndef _SECPOOL_H_
+#define _SECPOOL_H_
+
+#include <stdint.h>
+
+#define SECPOOL_CLASSES		3				// buffer sizes 256, 1024 and 4096
+#define SECPOOL_SECTION_MAX	4096			// longest private section
+#define SECPOOL_BUFFERS		64				// per class at most (bits of the free mask)
+#define SECPOOL_BUDGET		(64 * 1024)		// default bytes of section buffers, -m overrides it
+
+// a section copied once where it comes in, shared by everyone holding a reference
+typedef struct section {
+	uint8_t* data;
+	uint16_t length;
+	int8_t cls;								// size class, -1 if it was allocated because its class was used up
+	uint8_t index;							// buffer in its class
+	volatile int32_t refs;
+} section_t;
+
+// slabs of the classes, budget is split evenly among them
+void secpool_init( uint32_t budget );
+
+// copies a section into a free buffer (or the heap if there is none) with one reference, NULL if it is longer than SECPOOL_SECTION_MAX
+section_t* secpool_get( const uint8_t* data, int length );
+
+// another reference, NULL stays NULL
+section_t* secpool_ref( section_t* s );
+
+// the last reference returns the buffer to its class
+void secpool_put( section_t* s );
+
+#endif
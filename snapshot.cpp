@@ -0,0 +1,120 @@
+#include <glib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/unistd.h>
+
+#include "snapshot.h"
+
+static uint32_t g_crc_table[256];
+
+static void crc_init()
+{
+	for(uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for(int b = 0; b < 8; b++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		g_crc_table[i] = crc;
+	}
+}
+
+static uint32_t record_crc( snapshot_demux_t* s )
+{
+	const uint8_t* p = (const uint8_t*)&s->program_number;
+	int len = offsetof(snapshot_demux_t, pmt) - offsetof(snapshot_demux_t, program_number) + s->pmt_length;
+
+	uint32_t crc = 0xFFFFFFFF;
+	while(len--)
+		crc = (crc >> 8) ^ g_crc_table[(crc ^ *p++) & 0xFF];
+
+	return ~crc;
+}
+
+void snapshot_begin( snapshot_demux_t* s )
+{
+	if(!(s->generation & 1))
+		s->generation++;
+	__sync_synchronize();
+}
+
+void snapshot_commit( snapshot_demux_t* s )
+{
+	s->check = record_crc(s);
+	__sync_synchronize();
+	s->generation++;
+}
+
+bool snapshot_valid( snapshot_demux_t* s )
+{
+	return !(s->generation & 1) && s->pmt_length <= SNAPSHOT_PMTSIZE && s->check == record_crc(s);
+}
+
+void snapshot_reset( snapshot_demux_t* s )
+{
+	snapshot_begin(s);
+	s->program_number = -1;
+	s->service_id = 0;
+	s->pmt_length = 0;
+	s->pmt_version = 0;
+	memset(s->profiles, 0, sizeof(s->profiles));
+	snapshot_commit(s);
+}
+
+// maps the snapshot file, restored is set if it holds the state of a previous run
+snapshot_t* snapshot_open( const char* name, bool* restored )
+{
+	*restored = false;
+	crc_init();
+
+	// the cws are in there, an existing file (or one left with other modes) gets closed to others too
+	int fd = open(name, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+	if(fd < 0)
+	{
+		g_message("%s: unable to open %s: %s", __func__, name, strerror(errno));
+		return NULL;
+	}
+
+	if(fchmod(fd, 0600) < 0)
+	{
+		g_message("%s: unable to restrict %s: %s", __func__, name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	if(ftruncate(fd, sizeof(snapshot_t)) < 0)
+	{
+		g_message("%s: unable to resize %s: %s", __func__, name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	void* p = mmap(NULL, sizeof(snapshot_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(p == MAP_FAILED)
+	{
+		g_message("%s: unable to map %s: %s", __func__, name, strerror(errno));
+		return NULL;
+	}
+
+	snapshot_t* snapshot = (snapshot_t*)p;
+
+	if(snapshot->magic == SNAPSHOT_MAGIC && snapshot->version == SNAPSHOT_VERSION && snapshot->size == sizeof(snapshot_t))
+		*restored = true;
+	else
+	{
+		memset(snapshot, 0, sizeof(snapshot_t));
+		for(int i = 0; i < SNAPSHOT_DEMUX; i++)
+			snapshot_reset(&snapshot->demux[i]);
+
+		snapshot->magic = SNAPSHOT_MAGIC;
+		snapshot->version = SNAPSHOT_VERSION;
+		snapshot->size = sizeof(snapshot_t);
+	}
+
+	return snapshot;
+}
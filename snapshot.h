@@ -0,0 +1,54 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+
+#define SNAPSHOT_FILE			"/tmp/dvbcam.state"
+#define SNAPSHOT_MAGIC			0x4D414344		// "DCAM"
+#define SNAPSHOT_VERSION		3
+
+#define SNAPSHOT_DEMUX			8
+#define SNAPSHOT_PROFILES		4				// per demux
+#define SNAPSHOT_PMTSIZE		4096
+
+typedef struct snapshot_profile {
+	uint32_t tag;								// (screen_id << 16) + profile, 0 if unused
+	int32_t bank;
+	uint8_t cw[32];								// last cw [key_len * parity0 + key_len * parity1]
+	uint8_t ca_type;							// dmx_ca_type_t
+	uint8_t key_len;
+} snapshot_profile_t;
+
+// a record is rewritten in place, a crash halfway leaves it with an odd generation or a wrong check
+typedef struct snapshot_demux {
+	uint32_t generation;						// odd while the record is being written
+	uint32_t check;								// crc32 of the record from program_number on, pmt up to pmt_length
+	int32_t program_number;						// -1 if unused
+	uint64_t service_id;
+	uint16_t pmt_length;						// 0 if no pmt was received
+	uint8_t pmt_version;
+	snapshot_profile_t profiles[SNAPSHOT_PROFILES];
+	uint8_t pmt[SNAPSHOT_PMTSIZE];
+} snapshot_demux_t;
+
+// lives in a shared file mapping: every store is in the page cache at once and survives a crash of the process
+typedef struct snapshot {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	snapshot_demux_t demux[SNAPSHOT_DEMUX];
+} snapshot_t;
+
+snapshot_t* snapshot_open( const char* name, bool* restored );
+
+// brackets every change of a record
+void snapshot_begin( snapshot_demux_t* s );
+void snapshot_commit( snapshot_demux_t* s );
+
+// false for a record a crash left half written
+bool snapshot_valid( snapshot_demux_t* s );
+
+// an unused record
+void snapshot_reset( snapshot_demux_t* s );
+
+#endif
@@ -0,0 +1,302 @@
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/dvb/dmx.h>
+#include <dvbcsa/dvbcsa.h>
+
+#include "stats.h"
+#include "softcsa.h"
+
+#define TS_PACKET_SIZE		188
+#define TS_READ_PACKETS		512
+#define TS_BUFFER_SIZE		(TS_PACKET_SIZE * 4096)		// dvr ring buffer, ~100 ms of a full mux
+
+// one dvr reader per slot
+typedef struct softcsa {
+	GThread* thread;
+	volatile bool running;
+	uint8_t bank;
+	char sink[128];
+	GMutex lock;								// keys and pids, held while a buffer is descrambled
+	struct dvbcsa_bs_key_s* key[2];				// per parity
+	bool keyed[2];
+	struct dvbcsa_bs_batch_s* batch[2];			// per parity, batch_size packets and the terminating NULL
+	unsigned int batch_size;					// packets descrambled at once, depends on the simd width libdvbcsa was built for
+	bool filtered;								// pids is set from the pmt
+	uint32_t pids[8192 / 32];
+} softcsa_t;
+
+static softcsa_t g_softcsa[SOFTCSA_SLOTS];
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static softcsa_t* get_slot( int slot )
+{
+	if(slot < 0 || slot >= SOFTCSA_SLOTS)
+		return NULL;
+
+	softcsa_t* s = &g_softcsa[slot];
+	if(!s->batch_size)
+	{
+		g_mutex_init(&s->lock);
+		s->batch_size = dvbcsa_bs_batch_size();
+		for(int p = 0; p < 2; p++)
+		{
+			s->key[p] = dvbcsa_bs_key_alloc();
+			s->batch[p] = new dvbcsa_bs_batch_s[s->batch_size + 1];
+		}
+	}
+
+	return s;
+}
+
+static void flush_batch( softcsa_t* s, int parity, int count )
+{
+	s->batch[parity][count].data = NULL;
+	dvbcsa_bs_decrypt(s->key[parity], s->batch[parity], TS_PACKET_SIZE - 4);
+}
+
+// only an existing fifo is taken, once there is a reader; a regular file would grow on tmpfs until the ram is gone,
+// so the path is never created and anything else there returns -2 and is not tried again
+static int open_sink( const char* sink )
+{
+	int fd = open(sink, O_WRONLY | O_NONBLOCK);
+	if(fd < 0)
+	{
+		if(errno != ENXIO && errno != ENOENT)
+			g_message("%s: unable to open %s: %s", __func__, sink, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode))
+	{
+		g_message("%s: %s is not a fifo, the descrambled ts is dropped", __func__, sink);
+		close(fd);
+		return -2;
+	}
+
+	return fd;
+}
+
+static gpointer softcsa_thread( gpointer data )
+{
+	int slot = (int)(uintptr_t)data;
+	softcsa_t* s = &g_softcsa[slot];
+
+	char device_name[128];
+	sprintf(device_name, "/dev/dvb/adapter0/demux%d", s->bank);
+
+	int demux_fd = open(device_name, O_RDONLY | O_NONBLOCK);
+	if(demux_fd < 0)
+	{
+		g_message("%s: unable to open device %s (%d): %s", __func__, device_name, errno, strerror(errno));
+		return NULL;
+	}
+
+	// the whole mux goes to the sink, so the pvr still finds pat and pmt, only the service's streams get descrambled
+	struct dmx_pes_filter_params params;
+	params.pid = 0x2000;
+	params.input = DMX_IN_FRONTEND;
+	params.output = DMX_OUT_TS_TAP;
+	params.pes_type = DMX_PES_OTHER;
+	params.flags = DMX_IMMEDIATE_START;
+
+	if(ioctl(demux_fd, DMX_SET_PES_FILTER, &params) < 0)
+	{
+		g_message("%s: DMX_SET_PES_FILTER failed, bank=%d: %s", __func__, s->bank, strerror(errno));
+		close(demux_fd);
+		return NULL;
+	}
+
+	sprintf(device_name, "/dev/dvb/adapter0/dvr%d", s->bank);
+
+	int dvr_fd = open(device_name, O_RDONLY | O_NONBLOCK);
+	if(dvr_fd < 0)
+	{
+		g_message("%s: unable to open device %s (%d): %s", __func__, device_name, errno, strerror(errno));
+		ioctl(demux_fd, DMX_STOP);
+		close(demux_fd);
+		return NULL;
+	}
+
+	ioctl(dvr_fd, DMX_SET_BUFFER_SIZE, TS_BUFFER_SIZE);
+
+	g_message("%s: slot=%d descrambling bank=%d to %s", __func__, slot, s->bank, s->sink);
+
+	uint8_t* buff = new uint8_t[TS_PACKET_SIZE * TS_READ_PACKETS];
+	struct pollfd pfd = { dvr_fd, POLLIN, 0 };
+	int sink_fd = -1;
+
+	while(s->running)
+	{
+		if(poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		int nread = read(dvr_fd, buff, TS_PACKET_SIZE * TS_READ_PACKETS);
+		if(nread < 0)
+		{
+			if(errno != EAGAIN && errno != EOVERFLOW)
+				g_message("%s: read failed, bank=%d: %s", __func__, s->bank, strerror(errno));
+			continue;
+		}
+
+		nread -= nread % TS_PACKET_SIZE;
+		softcsa_descramble(slot, buff, nread);
+
+		if(sink_fd == -1)
+			sink_fd = open_sink(s->sink);
+
+		// a slow reader loses packets rather than stalling the dvr
+		int written = sink_fd < 0 ? -1 : write(sink_fd, buff, nread);
+		if(written != nread)
+		{
+			__sync_add_and_fetch(&g_stats.soft_dropped, (nread - (written > 0 ? written : 0)) / TS_PACKET_SIZE);
+
+			if(sink_fd > -1 && written < 0 && errno != EAGAIN)
+			{
+				g_message("%s: write to %s failed: %s", __func__, s->sink, strerror(errno));
+				close(sink_fd);
+				sink_fd = -1;
+			}
+		}
+	}
+
+	delete[] buff;
+	if(sink_fd > -1)
+		close(sink_fd);
+	close(dvr_fd);
+	ioctl(demux_fd, DMX_STOP);
+	close(demux_fd);
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool softcsa_start( int slot, uint8_t bank, const char* sink )
+{
+	softcsa_t* s = get_slot(slot);
+	if(!s)
+		return false;
+
+	if(s->thread && s->bank == bank && !strcmp(s->sink, sink))
+		return true;
+
+	softcsa_stop(slot);
+
+	s->bank = bank;
+	snprintf(s->sink, sizeof(s->sink), "%s", sink);
+	s->running = true;
+	s->thread = g_thread_new("softcsa", softcsa_thread, (gpointer)(uintptr_t)slot);
+
+	return true;
+}
+
+void softcsa_stop( int slot )
+{
+	softcsa_t* s = get_slot(slot);
+	if(!s || !s->thread)
+		return;
+
+	s->running = false;
+	g_thread_join(s->thread);
+	s->thread = NULL;
+
+	// the next service starts without keys and pids
+	g_mutex_lock(&s->lock);
+	s->keyed[0] = s->keyed[1] = false;
+	s->filtered = false;
+	g_mutex_unlock(&s->lock);
+}
+
+void softcsa_set_cw( int slot, int parity, uint8_t* cw )
+{
+	softcsa_t* s = get_slot(slot);
+	if(!s)
+		return;
+
+	g_mutex_lock(&s->lock);
+	for(int p = parity < 0 ? 0 : parity; p <= (parity < 0 ? 1 : parity); p++)
+	{
+		dvbcsa_bs_key_set(&cw[8 * p], s->key[p]);
+		s->keyed[p] = true;
+	}
+	g_mutex_unlock(&s->lock);
+}
+
+void softcsa_set_pmt( int slot, uint8_t* pmt )
+{
+	softcsa_t* s = get_slot(slot);
+	if(!s)
+		return;
+
+	int len = 3 + ((pmt[1] & 0x0F) << 8) + pmt[2] - 4;		// without crc
+	int p = 12 + ((pmt[10] & 0x0F) << 8) + pmt[11];
+
+	g_mutex_lock(&s->lock);
+	memset(s->pids, 0, sizeof(s->pids));
+	for( ; p + 5 <= len; p += 5 + ((pmt[p + 3] & 0x0F) << 8) + pmt[p + 4])
+	{
+		uint16_t es_pid = ((pmt[p + 1] & 0x1F) << 8) + pmt[p + 2];
+		s->pids[es_pid >> 5] |= 1u << (es_pid & 31);
+	}
+	s->filtered = true;
+	g_mutex_unlock(&s->lock);
+}
+
+// packets are collected per parity and handed to the bitsliced kernel a full batch at a time
+int softcsa_descramble( int slot, uint8_t* buff, int len )
+{
+	softcsa_t* s = get_slot(slot);
+	if(!s)
+		return 0;
+
+	int count[2] = {0, 0}, done = 0;
+
+	g_mutex_lock(&s->lock);
+	for(int i = 0; i + TS_PACKET_SIZE <= len; i += TS_PACKET_SIZE)
+	{
+		uint8_t* pkt = buff + i;
+
+		// sync byte, scrambled, payload present
+		if(pkt[0] != 0x47 || !(pkt[3] & 0x80) || !(pkt[3] & 0x10))
+			continue;
+
+		uint16_t pid = ((pkt[1] & 0x1F) << 8) + pkt[2];
+		if(s->filtered && !(s->pids[pid >> 5] & (1u << (pid & 31))))
+			continue;
+
+		int parity = (pkt[3] >> 6) & 1;
+		int offset = 4 + (pkt[3] & 0x20 ? 1 + pkt[4] : 0);
+		if(!s->keyed[parity] || offset >= TS_PACKET_SIZE)
+			continue;
+
+		pkt[3] &= 0x3F;
+		s->batch[parity][count[parity]].data = pkt + offset;
+		s->batch[parity][count[parity]].len = TS_PACKET_SIZE - offset;
+
+		if(++count[parity] == (int)s->batch_size)
+		{
+			flush_batch(s, parity, count[parity]);
+			done += count[parity];
+			count[parity] = 0;
+		}
+	}
+
+	for(int p = 0; p < 2; p++)
+		if(count[p])
+			flush_batch(s, p, count[p]);
+	g_mutex_unlock(&s->lock);
+
+	done += count[0] + count[1];
+	__sync_add_and_fetch(&g_stats.soft_packets, done);
+
+	return done;
+}
@@ -0,0 +1,36 @@
+#ifndef _SOFTCSA_H_
+#define _SOFTCSA_H_
+
+#include <stdint.h>
+
+#define SOFTCSA_SINK		"/tmp/dvbcam.soft%d.ts"	// clear ts per slot, only written to a fifo made there
+
+#ifdef DVBCAM_SOFTCSA
+
+#define SOFTCSA_SLOTS		2				// services descrambled in software on top of the hardware banks
+
+// reads the ts of bank from its dvr device and writes it descrambled to sink
+bool softcsa_start( int slot, uint8_t bank, const char* sink );
+void softcsa_stop( int slot );
+
+// cw is [8 * parity0 + 8 * parity1], parity -1 sets both
+void softcsa_set_cw( int slot, int parity, uint8_t* cw );
+
+// restricts descrambling to the elementary streams of a pmt section, every scrambled packet is tried until then
+void softcsa_set_pmt( int slot, uint8_t* pmt );
+
+// descrambles whole ts packets in place with the keys of slot, returns the number of packets descrambled
+int softcsa_descramble( int slot, uint8_t* buff, int len );
+
+#else
+
+#define SOFTCSA_SLOTS		0
+
+static inline bool softcsa_start( int slot, uint8_t bank, const char* sink ) { return false; }
+static inline void softcsa_stop( int slot ) {}
+static inline void softcsa_set_cw( int slot, int parity, uint8_t* cw ) {}
+static inline void softcsa_set_pmt( int slot, uint8_t* pmt ) {}
+
+#endif
+
+#endif
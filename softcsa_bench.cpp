@@ -0,0 +1,207 @@
+/*
+	softcsa_bench - throughput of the software csa path on one core (make softcsa_bench)
+
+	usage: softcsa_bench [-n packets] [-r rounds] [-k vectors]
+		-n	ts packets per round, default 16384 (~3 MB)
+		-r	rounds, default 20
+		-k	known answers, default softcsa_bench.vectors
+
+	the packets are scrambled with libdvbcsa's reference (non bitsliced) implementation and must come back
+	out of softcsa_descramble unchanged, so a broken batch or offset handling fails the run; as both sides are
+	libdvbcsa, the payloads of the known answers file are descrambled first and must match the published clear text
+	(a file without answers is reported and skipped, a broken one fails the run)
+
+	softcsa has no kernels of its own, the throughput is that of libdvbcsa's bitsliced code as it was built:
+	softcsa.bs_batch_size tells which one (32 or 64 plain integers, 128 sse2 or neon, 256 avx2)
+*/
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dvbcsa/dvbcsa.h>
+
+#include "stats.h"
+#include "softcsa.h"
+
+#define TS_PACKET_SIZE		188
+
+static void null_log_handler( const gchar *log_domain, GLogLevelFlags log_level, const gchar *message, gpointer user_data )
+{
+}
+
+// even and odd crypto periods of 1024 packets, every 8th packet with an adaptation field, every 16th clear
+static void make_stream( uint8_t* clear, uint8_t* scrambled, int packets, uint8_t* cw )
+{
+	struct dvbcsa_key_s* key[2] = { dvbcsa_key_alloc(), dvbcsa_key_alloc() };
+	dvbcsa_key_set(&cw[0], key[0]);
+	dvbcsa_key_set(&cw[8], key[1]);
+
+	srand(1);
+	for(int i = 0; i < packets; i++)
+	{
+		uint8_t* pkt = clear + i * TS_PACKET_SIZE;
+		for(int n = 0; n < TS_PACKET_SIZE; n++)
+			pkt[n] = rand();
+
+		pkt[0] = 0x47;
+		pkt[1] = 0x01;
+		pkt[2] = 0x00;
+		pkt[3] = (i % 8 == 0 ? 0x30 : 0x10) | (i & 0x0F);
+		if(i % 8 == 0)
+			pkt[4] = i % 64;
+
+		uint8_t* out = scrambled + i * TS_PACKET_SIZE;
+		memcpy(out, pkt, TS_PACKET_SIZE);
+		if(i % 16 == 1)
+			continue;
+
+		int parity = (i / 1024) & 1;
+		int offset = 4 + (pkt[3] & 0x20 ? 1 + pkt[4] : 0);
+		out[3] |= 0x80 | (parity << 6);
+		dvbcsa_encrypt(key[parity], out + offset, TS_PACKET_SIZE - offset);
+	}
+
+	dvbcsa_key_free(key[0]);
+	dvbcsa_key_free(key[1]);
+}
+
+static int parse_hex( const char* hex, uint8_t* out, int max )
+{
+	int n = 0;
+	for(; hex[0] && hex[1] && n < max; hex += 2)
+		if(sscanf(hex, "%2hhx", &out[n++]) != 1)
+			return -1;
+
+	return *hex ? -1 : n;
+}
+
+// one known answer per line: cw (8 bytes, even key), scrambled payload, clear payload, all hex; the payload goes
+// into one packet behind adaptation field stuffing; returns the failed answers, -1 if the file is broken
+static int check_known_answers( const char* name, int* checked )
+{
+	*checked = 0;
+
+	FILE* f = fopen(name, "r");
+	if(!f)
+	{
+		printf("Unable to read %s\n", name);
+		return 0;
+	}
+
+	char line[1024], cw_hex[64], in_hex[512], out_hex[512];
+	int failures = 0;
+
+	while(fgets(line, sizeof(line), f))
+	{
+		if(line[0] == '#' || sscanf(line, "%63s %511s %511s", cw_hex, in_hex, out_hex) != 3)
+			continue;
+
+		uint8_t cw[16] = {0}, in[TS_PACKET_SIZE], out[TS_PACKET_SIZE], pkt[TS_PACKET_SIZE];
+		int len = parse_hex(in_hex, in, TS_PACKET_SIZE - 4);
+		if(parse_hex(cw_hex, cw, 8) != 8 || len < 0 || parse_hex(out_hex, out, TS_PACKET_SIZE - 4) != len)
+		{
+			printf("%s: broken line: %s", name, line);
+			fclose(f);
+			return -1;
+		}
+
+		int offset = TS_PACKET_SIZE - len;
+		memset(pkt, 0xFF, sizeof(pkt));
+		pkt[0] = 0x47;
+		pkt[1] = 0x01;
+		pkt[2] = 0x00;
+		pkt[3] = offset > 4 ? 0xB0 : 0x90;		// even key, payload behind an adaptation field if it is short
+		if(offset > 4)
+			pkt[4] = offset - 5;
+		if(offset > 5)
+			pkt[5] = 0x00;
+		memcpy(pkt + offset, in, len);
+
+		softcsa_set_cw(0, 0, cw);
+		softcsa_descramble(0, pkt, TS_PACKET_SIZE);
+
+		bool ok = !memcmp(pkt + offset, out, len) && !(pkt[3] & 0xC0);
+		if(!ok)
+			printf("softcsa.known_answer %d failed\n", *checked);
+		failures += !ok;
+		(*checked)++;
+	}
+
+	fclose(f);
+	return failures;
+}
+
+int main( int argc, char *argv[] )
+{
+	int packets = 16384, rounds = 20, opt;
+	const char* vectors = "softcsa_bench.vectors";
+
+	while((opt = getopt(argc, argv, "n:r:k:")) != -1)
+	{
+		if(opt == 'n')
+			packets = atoi(optarg);
+		else if(opt == 'r')
+			rounds = atoi(optarg);
+		else if(opt == 'k')
+			vectors = optarg;
+		else
+		{
+			printf("usage: %s [-n packets] [-r rounds] [-k vectors]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	g_log_set_handler(G_LOG_DOMAIN, G_LOG_LEVEL_MASK, null_log_handler, NULL);
+
+	int checked = 0;
+	int known_failures = check_known_answers(vectors, &checked);
+	printf("softcsa.known_answers %d\n", checked);
+	if(known_failures < 0)
+		return 1;
+	if(!checked)
+		printf("%s has no known answers, softcsa is only checked against libdvbcsa's reference implementation\n", vectors);
+
+	printf("softcsa.bs_batch_size %u\n", dvbcsa_bs_batch_size());
+
+	uint8_t cw[16] = { 0x11, 0x22, 0x33, 0x66, 0x44, 0x55, 0x66, 0xFF, 0xA0, 0xB1, 0xC2, 0x13, 0xD4, 0xE5, 0xF6, 0xCF };
+	uint8_t* clear = new uint8_t[packets * TS_PACKET_SIZE];
+	uint8_t* scrambled = new uint8_t[packets * TS_PACKET_SIZE];
+	uint8_t* buff = new uint8_t[packets * TS_PACKET_SIZE];
+
+	make_stream(clear, scrambled, packets, cw);
+	softcsa_set_cw(0, -1, cw);
+
+	latency_t round_us;
+	memset(&round_us, 0, sizeof(round_us));
+	uint64_t total_us = 0;
+	int failures = 0;
+
+	for(int r = 0; r < rounds; r++)
+	{
+		memcpy(buff, scrambled, packets * TS_PACKET_SIZE);
+
+		uint64_t start = stats_now();
+		softcsa_descramble(0, buff, packets * TS_PACKET_SIZE);
+		uint64_t us = stats_now() - start;
+
+		total_us += us;
+		stats_latency_add(&round_us, (uint32_t)us);
+
+		if(memcmp(buff, clear, packets * TS_PACKET_SIZE))
+			failures++;
+	}
+
+	stats_latency_dump(stdout, "softcsa.round_us", &round_us);
+	printf("softcsa.mbit_per_s %.1f\n", total_us ? (double)packets * rounds * TS_PACKET_SIZE * 8 / total_us : 0.0);
+	printf("softcsa.packets_per_s %.0f\n", total_us ? (double)packets * rounds * 1000000 / total_us : 0.0);
+	printf("softcsa.failures %d\n", failures + known_failures);
+
+	delete[] clear;
+	delete[] scrambled;
+	delete[] buff;
+
+	return failures || known_failures ? 1 : 0;
+}
@@ -0,0 +1,405 @@
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <new>
+#include <algorithm>
+
+#include "stats.h"
+#include "trace.h"
+
+stats_t g_stats;
+
+typedef struct zap_sample {
+	uint32_t first_cw;			// tune signal to first CA_SET_DESCR (us)
+	uint32_t ipc_calls;
+	uint32_t syscalls;
+	uint32_t allocs;
+} zap_sample_t;
+
+static zap_sample_t g_zap_samples[STATS_ZAP_SAMPLES];
+static uint32_t g_zap_count = 0;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// counting allocations and reading /proc/self/io are too much for the cw path, so only trace builds do it
+#ifdef DVBCAM_TRACE
+void* operator new( size_t size )
+{
+	__sync_add_and_fetch(&g_stats.allocs, 1);
+
+	void* p = malloc(size ? size : 1);
+	if(!p)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void operator delete( void* p ) noexcept
+{
+	free(p);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t stats_monotonic()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t (*stats_clock)() = stats_monotonic;
+
+uint64_t stats_now()
+{
+	return stats_clock();
+}
+
+#ifdef DVBCAM_TRACE
+// read + write syscalls issued by the whole process so far (needs task io accounting, 0 otherwise)
+static uint32_t get_syscalls()
+{
+	FILE* f = fopen("/proc/self/io", "r");
+	if(!f)
+		return 0;
+
+	char line[64];
+	unsigned long long value, total = 0;
+
+	while( fgets(line, sizeof(line), f) )
+		if( sscanf(line, "syscr: %llu", &value) == 1 || sscanf(line, "syscw: %llu", &value) == 1 )
+			total += value;
+
+	fclose(f);
+
+	return (uint32_t)total;
+}
+#endif
+
+void stats_startup_begin()
+{
+	g_stats.startup.start = stats_now();
+}
+
+// only the first time counts, steps are marked from several threads
+void stats_startup_mark( volatile uint32_t* step, const char* name )
+{
+	uint32_t us = (uint32_t)(stats_now() - g_stats.startup.start);
+	if(__sync_bool_compare_and_swap(step, 0, us ? us : 1))
+		g_message("%s: %s after %d ms", __func__, name, us / 1000);
+}
+
+void stats_zap_begin( zap_t* zap )
+{
+	zap->start = stats_now();
+	zap->ipc_calls = g_stats.ipc_calls;
+#ifdef DVBCAM_TRACE
+	zap->syscalls = get_syscalls();
+	zap->allocs = g_stats.allocs;
+#endif
+}
+
+void stats_zap_end( zap_t* zap )
+{
+	if(!zap->start)
+		return;
+
+	zap_sample_t* s = &g_zap_samples[g_zap_count++ % STATS_ZAP_SAMPLES];
+	s->first_cw = (uint32_t)(stats_now() - zap->start);
+	s->ipc_calls = g_stats.ipc_calls - zap->ipc_calls;
+#ifdef DVBCAM_TRACE
+	s->syscalls = get_syscalls() - zap->syscalls;
+	s->allocs = g_stats.allocs - zap->allocs;
+
+	g_message("%s: first cw after %d ms, ipc=%d, syscalls=%d, allocs=%d", __func__, s->first_cw / 1000, s->ipc_calls, s->syscalls, s->allocs);
+#else
+	g_message("%s: first cw after %d ms, ipc=%d", __func__, s->first_cw / 1000, s->ipc_calls);
+#endif
+
+	zap->start = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static uint32_t percentile( uint32_t* sorted, uint32_t n, uint32_t p )
+{
+	return n ? sorted[(n - 1) * p / 100] : 0;
+}
+
+void stats_latency_add( latency_t* l, uint32_t us )
+{
+	l->samples[l->count++ % STATS_SAMPLES] = us;
+}
+
+void stats_latency_dump( FILE* f, const char* name, latency_t* l )
+{
+	uint32_t n = std::min(l->count, (uint32_t)STATS_SAMPLES);
+	uint32_t sorted[STATS_SAMPLES];
+
+	memcpy(sorted, l->samples, n * sizeof(uint32_t));
+	std::sort(sorted, sorted + n);
+
+	fprintf(f, "%s.count %u\n", name, l->count);
+	fprintf(f, "%s.p50 %u\n", name, percentile(sorted, n, 50));
+	fprintf(f, "%s.p90 %u\n", name, percentile(sorted, n, 90));
+	fprintf(f, "%s.p99 %u\n", name, percentile(sorted, n, 99));
+	fprintf(f, "%s.max %u\n", name, percentile(sorted, n, 100));
+}
+
+void stats_histogram_add( histogram_t* h, uint32_t us )
+{
+	int n = 0;
+	while(n < STATS_BUCKETS - 1 && us >= (1u << n))
+		n++;
+
+	h->buckets[n]++;
+}
+
+void stats_histogram_dump( FILE* f, const char* name, histogram_t* h )
+{
+	for(int n = 0; n < STATS_BUCKETS - 1; n++)
+		fprintf(f, "%s.lt_%u %u\n", name, 1u << n, h->buckets[n]);
+	fprintf(f, "%s.ge_%u %u\n", name, 1u << (STATS_BUCKETS - 2), h->buckets[STATS_BUCKETS - 1]);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the slot matching, else (if add) a free one or the one updated longest ago, cleared;
+// only the cw thread adds, a reader racing it may rank a CA descriptor with a stale time which the next ECM_INFO fixes
+template<typename T, typename M> static T* lru_slot( T* slots, int n, M match, bool add )
+{
+	T* oldest = &slots[0];
+	for(int i = 0; i < n; i++)
+	{
+		T* e = &slots[i];
+		if(e->count && match(e))
+			return e;
+		if(!e->count || (oldest->count && e->updated < oldest->updated))
+			oldest = e;
+	}
+
+	if(!add)
+		return NULL;
+
+	memset(oldest, 0, sizeof(T));
+	return oldest;
+}
+
+static ecm_stats_t* ecm_slot( uint16_t service_id, uint16_t caid, bool add )
+{
+	ecm_stats_t* e = lru_slot(g_stats.ecm, STATS_ECM, [=](ecm_stats_t* e) { return e->service_id == service_id && e->caid == caid; }, add);
+	if(e && !e->count)
+	{
+		e->service_id = service_id;
+		e->caid = caid;
+	}
+
+	return e;
+}
+
+// old samples fade out: every STATS_WINDOW samples the buckets are halved
+static void histogram_roll( histogram_t* h, uint32_t ms, uint32_t count )
+{
+	stats_histogram_add(h, ms);
+
+	if(count % STATS_WINDOW == 0)
+		for(int n = 0; n < STATS_BUCKETS; n++)
+			h->buckets[n] /= 2;
+}
+
+// per service and CAID and for the CAID on all services (a service zapped to for the first time is ranked by what its CAIDs
+// did elsewhere), per reader and per service
+void stats_ecm_add( ecm_info_t* info )
+{
+	uint64_t now = stats_now();
+	uint32_t ms = info->ecm_time;
+
+	uint16_t services[] = { info->service_id, 0 };
+	for(int i = 0; i < (info->service_id ? 2 : 1); i++)
+	{
+		ecm_stats_t* e = ecm_slot(services[i], info->caid, true);
+		e->avg_ms = e->count ? (e->avg_ms * 3 + ms) / 4 : ms;
+		e->best_ms = e->count ? std::min(e->best_ms, ms) : ms;
+		e->updated = now;
+		e->count++;
+	}
+
+	ecm_reader_t* r = lru_slot(g_stats.readers, STATS_READERS, [=](ecm_reader_t* r) { return !strcmp(r->name, info->reader); }, true);
+	strcpy(r->name, info->reader);
+	r->updated = now;
+	histogram_roll(&r->time, ms, ++r->count);
+
+	ecm_service_t* s = lru_slot(g_stats.services, STATS_SERVICES, [=](ecm_service_t* s) { return s->last.service_id == info->service_id; }, true);
+	s->last = *info;
+	s->updated = now;
+	histogram_roll(&s->time, ms, ++s->count);
+}
+
+// expected ecm time (ms), -1 if there was no ECM_INFO for it yet
+int32_t stats_ecm_time( uint16_t service_id, uint16_t caid )
+{
+	ecm_stats_t* e = ecm_slot(service_id, caid, false);
+	return e ? (int32_t)e->avg_ms : -1;
+}
+
+// a reader name as part of a stats name: no blanks or dots in it
+static void stats_name( char* name, const char* prefix, const char* s )
+{
+	int n = sprintf(name, "%s", prefix);
+	for(; *s; s++)
+		name[n++] = isalnum((unsigned char)*s) || *s == '-' || *s == '_' ? *s : '_';
+	name[n] = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// one "name value" pair per line, so dumps of two builds can be diffed or loaded by a script
+void stats_dump( FILE* f )
+{
+	uint32_t n = std::min(g_zap_count, (uint32_t)STATS_ZAP_SAMPLES);
+	uint32_t first_cw[STATS_ZAP_SAMPLES];
+	uint64_t ipc_calls = 0, syscalls = 0, allocs = 0;
+
+	for(uint32_t i = 0; i < n; i++)
+	{
+		first_cw[i] = g_zap_samples[i].first_cw;
+		ipc_calls += g_zap_samples[i].ipc_calls;
+		syscalls += g_zap_samples[i].syscalls;
+		allocs += g_zap_samples[i].allocs;
+	}
+
+	std::sort(first_cw, first_cw + n);
+
+	startup_t* s = &g_stats.startup;
+	fprintf(f, "startup.boot_us %llu\n", (unsigned long long)s->start);
+	fprintf(f, "startup.listening_us %u\n", s->listening);
+	fprintf(f, "startup.pvr_us %u\n", s->pvr);
+	fprintf(f, "startup.signals_us %u\n", s->signals);
+	fprintf(f, "startup.lookup_us %u\n", s->lookup);
+	fprintf(f, "startup.first_client_us %u\n", s->first_client);
+	fprintf(f, "startup.first_cw_us %u\n", s->first_cw);
+	fprintf(f, "startup.boot_to_first_cw_us %llu\n", s->first_cw ? (unsigned long long)(s->start + s->first_cw) : 0ULL);
+	fprintf(f, "zap.count %u\n", g_zap_count);
+	fprintf(f, "zap.first_cw_us.p50 %u\n", percentile(first_cw, n, 50));
+	fprintf(f, "zap.first_cw_us.p90 %u\n", percentile(first_cw, n, 90));
+	fprintf(f, "zap.first_cw_us.p99 %u\n", percentile(first_cw, n, 99));
+	fprintf(f, "zap.first_cw_us.max %u\n", percentile(first_cw, n, 100));
+	fprintf(f, "zap.ipc_calls.avg %.1f\n", n ? (double)ipc_calls / n : 0.0);
+#ifdef DVBCAM_TRACE
+	fprintf(f, "zap.syscalls.avg %.1f\n", n ? (double)syscalls / n : 0.0);
+	fprintf(f, "zap.allocs.avg %.1f\n", n ? (double)allocs / n : 0.0);
+#endif
+	fprintf(f, "total.ipc_calls %u\n", g_stats.ipc_calls);
+#ifdef DVBCAM_TRACE
+	fprintf(f, "total.allocs %u\n", g_stats.allocs);
+#endif
+	stats_latency_dump(f, "descramble.first_clear_us", &g_stats.first_clear);
+	fprintf(f, "descramble.stalls %u\n", g_stats.ts_stalls);
+	stats_latency_dump(f, "recovery.time_us", &g_stats.recovery);
+	fprintf(f, "recovery.list_update %u\n", g_stats.recoveries_update);
+	fprintf(f, "recovery.restart %u\n", g_stats.recoveries_restart);
+	fprintf(f, "recovery.given_up %u\n", g_stats.recoveries_given_up);
+	fprintf(f, "softcsa.packets %u\n", g_stats.soft_packets);
+	fprintf(f, "softcsa.dropped %u\n", g_stats.soft_dropped);
+	fprintf(f, "filters.subscribes_saved %u\n", g_stats.filter_subscribes_saved);
+	fprintf(f, "filters.sections_saved %u\n", g_stats.filter_sections_saved);
+	fprintf(f, "filters.reissues %u\n", g_stats.filter_reissues);
+	fprintf(f, "filters.reclaims %u\n", g_stats.filter_reclaims);
+	fprintf(f, "filters.widened %u\n", g_stats.filter_widened);
+	fprintf(f, "filters.unmatched %u\n", g_stats.filter_unmatched);
+	fprintf(f, "cw.coalesced %u\n", g_stats.cw_coalesced);
+	stats_latency_dump(f, "cw.held_us", &g_stats.cw_held);
+	stats_histogram_dump(f, "cw.jitter_us", &g_stats.cw_jitter);
+	for(int i = 0; i < STATS_ECM; i++)
+	{
+		ecm_stats_t* e = &g_stats.ecm[i];
+		if(!e->count)
+			continue;
+
+		char name[32];
+		if(e->service_id)
+			sprintf(name, "ecm.%04x.%04x", e->service_id, e->caid);
+		else
+			sprintf(name, "ecm.all.%04x", e->caid);
+
+		fprintf(f, "%s.count %u\n", name, e->count);
+		fprintf(f, "%s.avg_ms %u\n", name, e->avg_ms);
+		fprintf(f, "%s.best_ms %u\n", name, e->best_ms);
+	}
+	for(int i = 0; i < STATS_READERS; i++)
+	{
+		ecm_reader_t* r = &g_stats.readers[i];
+		if(!r->count)
+			continue;
+
+		char name[64];
+		stats_name(name, "ecm.reader.", r->name);
+		fprintf(f, "%s.count %u\n", name, r->count);
+		strcat(name, ".time_ms");
+		stats_histogram_dump(f, name, &r->time);
+	}
+	for(int i = 0; i < STATS_SERVICES; i++)
+	{
+		ecm_service_t* s = &g_stats.services[i];
+		if(!s->count)
+			continue;
+
+		ecm_info_t* e = &s->last;
+		char name[64];
+		sprintf(name, "ecm.service.%04x", e->service_id);
+		fprintf(f, "%s.count %u\n", name, s->count);
+		fprintf(f, "%s.caid %04x\n", name, e->caid);
+		fprintf(f, "%s.pid %04x\n", name, e->pid);
+		fprintf(f, "%s.provider %06x\n", name, e->provider);
+		fprintf(f, "%s.ecm_ms %u\n", name, e->ecm_time);
+		fprintf(f, "%s.cardsystem %s\n", name, e->cardsystem);
+		fprintf(f, "%s.reader %s\n", name, e->reader);
+		fprintf(f, "%s.from %s\n", name, e->from);
+		fprintf(f, "%s.protocol %s\n", name, e->protocol);
+		fprintf(f, "%s.hops %u\n", name, e->hops);
+		strcat(name, ".time_ms");
+		stats_histogram_dump(f, name, &s->time);
+	}
+	fprintf(f, "secpool.budget %u\n", g_stats.section_budget);
+	for(int c = 0; c < STATS_POOL_CLASSES; c++)
+	{
+		pool_stats_t* p = &g_stats.sections[c];
+		fprintf(f, "secpool.%u.buffers %u\n", p->size, p->buffers);
+		fprintf(f, "secpool.%u.in_use %u\n", p->size, p->in_use);
+		fprintf(f, "secpool.%u.high_water %u\n", p->size, p->high_water);
+	}
+	fprintf(f, "secpool.bytes_high_water %u\n", g_stats.section_bytes_high_water);
+	fprintf(f, "secpool.overflows %u\n", g_stats.section_overflows);
+	
+	for(int c = 0; c < STATS_CLIENTS; c++)
+	{
+		char name[32];
+		sprintf(name, "client.%d.lag_us", c);
+		
+		fprintf(f, "client.%d.wins %u\n", c, g_stats.clients[c].wins);
+		fprintf(f, "client.%d.losses %u\n", c, g_stats.clients[c].losses);
+		fprintf(f, "client.%d.demotions %u\n", c, g_stats.clients[c].demotions);
+		stats_latency_dump(f, name, &g_stats.clients[c].lag);
+	}
+	
+	trace_dump(f);
+}
+
+void stats_dump_file()
+{
+	FILE* f = fopen(STATS_FILE, "w");
+	if(!f)
+	{
+		g_message("Unable to write %s", STATS_FILE);
+		return;
+	}
+
+	stats_dump(f);
+	fclose(f);
+
+	g_message("stats written to %s", STATS_FILE);
+}
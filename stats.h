@@ -0,0 +1,136 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "capmt.h"
+
+#define STATS_FILE			"/tmp/dvbcam.stats"
+#define STATS_ZAP_SAMPLES	256					// zap samples kept for the percentiles
+#define STATS_SAMPLES		256					// samples kept per latency_t
+#define STATS_CLIENTS		4					// dvbapi client slots
+#define STATS_POOL_CLASSES	3					// section pool size classes
+#define STATS_ECM			64					// service and CAID pairs with ecm times
+#define STATS_READERS		8					// oscam readers with ecm time histograms
+#define STATS_SERVICES		16					// services with ecm time histograms and their last ECM_INFO
+#define STATS_WINDOW		256					// samples after which a rolling histogram is halved
+#define STATS_BUCKETS		16					// per histogram_t: < 1 us, < 2 us, < 4 us, ... and the rest
+
+typedef struct latency {
+	uint32_t samples[STATS_SAMPLES];			// us, ring buffer
+	uint32_t count;
+} latency_t;
+
+typedef struct histogram {
+	uint32_t buckets[STATS_BUCKETS];			// bucket n counts samples below 2^n us, the last one all above
+} histogram_t;
+
+typedef struct client_stats {
+	uint32_t wins;								// cws applied from this client
+	uint32_t losses;							// cws this client delivered after another one
+	uint32_t demotions;							// demuxes dropped for losing too often
+	latency_t lag;								// how far behind the winner a lost cw arrived
+} client_stats_t;
+
+typedef struct pool_stats {
+	uint32_t size;								// bytes per buffer
+	uint32_t buffers;
+	volatile uint32_t in_use;
+	volatile uint32_t high_water;				// most buffers in use at once
+} pool_stats_t;
+
+// ecm times oscam reported for a CAID on a service (service 0: on all of them)
+typedef struct ecm_stats {
+	uint16_t service_id;
+	uint16_t caid;
+	uint32_t count;								// ECM_INFOs, 0 if the slot is free
+	uint32_t avg_ms;							// moving average, the last ecms count most
+	uint32_t best_ms;
+	uint64_t updated;							// us, the pair updated longest ago makes room for a new one
+} ecm_stats_t;
+
+typedef struct ecm_reader {
+	char name[ECM_INFO_STRING];
+	uint32_t count;								// ECM_INFOs, 0 if the slot is free
+	uint64_t updated;
+	histogram_t time;							// ms, rolling
+} ecm_reader_t;
+
+typedef struct ecm_service {
+	ecm_info_t last;							// as decoded
+	uint32_t count;								// ECM_INFOs, 0 if the slot is free
+	uint64_t updated;
+	histogram_t time;							// ms, rolling
+} ecm_service_t;
+
+// when the startup steps were done (us after the process start, 0 if not yet)
+typedef struct startup {
+	uint64_t start;								// process start (us since boot)
+	volatile uint32_t listening;				// dvbapi socket
+	volatile uint32_t pvr;						// pvr service initialized and its signals registered
+	volatile uint32_t signals;					// tvs-api signals subscribed
+	volatile uint32_t lookup;					// current services looked up (after the snapshot restore)
+	volatile uint32_t first_client;				// first SERVER_INFO
+	volatile uint32_t first_cw;					// first cw from a client programmed
+} startup_t;
+
+typedef struct stats {
+	volatile uint32_t ipc_calls;				// tvs-api and pvr_drm_client calls
+	volatile uint32_t allocs;					// operator new calls (trace builds)
+	latency_t first_clear;						// cw programmed to first clear ts packet
+	volatile uint32_t ts_stalls;				// streams found scrambled too long
+	latency_t recovery;							// first recovery attempt to the next cw
+	volatile uint32_t recoveries_update;		// CA PMT re-sent with CAPMT_LIST_UPDATE
+	volatile uint32_t recoveries_restart;		// demux stopped and CA PMT re-sent
+	volatile uint32_t recoveries_given_up;		// demuxes left alone after RECOVERY_MAX_LEVEL, until the next zap or cw
+	volatile uint32_t soft_packets;				// ts packets descrambled in software
+	volatile uint32_t soft_dropped;				// ts packets the software sink did not take
+	uint32_t filter_subscribes_saved;			// DMX_SET_FILTERs served by an existing subscription
+	volatile uint32_t filter_sections_saved;	// duplicate sections a subscription per profile and filter would have delivered
+	uint32_t filter_reissues;					// DMX_SET_FILTERs equal to the active filter, ignored
+	uint32_t filter_reclaims;					// DMX_SET_FILTERs served by a parked subscription
+	uint32_t filter_widened;					// subscriptions made again with a wider filter for a new user
+	volatile uint32_t filter_unmatched;			// sections of a widened subscription no user wanted
+	uint32_t cw_coalesced;						// cws of both parities programmed in one call
+	latency_t cw_held;							// first cw held back to programmed
+	startup_t startup;
+	uint32_t section_budget;					// bytes the section pool may take
+	pool_stats_t sections[STATS_POOL_CLASSES];	// section pool per size class
+	volatile uint32_t section_bytes_high_water;	// most buffer bytes in use at once
+	volatile uint32_t section_overflows;		// sections allocated because their class was used up
+	ecm_stats_t ecm[STATS_ECM];					// see stats_ecm_add
+	ecm_reader_t readers[STATS_READERS];
+	ecm_service_t services[STATS_SERVICES];
+	histogram_t cw_jitter;						// how late the cw thread woke up for a held back cw or a stall check
+	client_stats_t clients[STATS_CLIENTS];		// per client slot, reset on connect
+} stats_t;
+
+extern stats_t g_stats;
+
+typedef struct zap {
+	uint64_t start;								// time of the tune signal (us), 0 if no zap pending
+	uint32_t ipc_calls;							// counters at the time of the tune signal
+	uint32_t syscalls;							// trace builds only
+	uint32_t allocs;
+} zap_t;
+
+// every time stamp is taken from stats_clock, which zap_bench points at its virtual clock
+extern uint64_t (*stats_clock)();
+
+uint64_t stats_monotonic();
+uint64_t stats_now();
+void stats_startup_begin();
+void stats_startup_mark( volatile uint32_t* step, const char* name );
+void stats_zap_begin( zap_t* zap );
+void stats_zap_end( zap_t* zap );
+void stats_latency_add( latency_t* l, uint32_t us );
+void stats_latency_dump( FILE* f, const char* name, latency_t* l );
+void stats_histogram_add( histogram_t* h, uint32_t us );
+void stats_histogram_dump( FILE* f, const char* name, histogram_t* h );
+void stats_ecm_add( ecm_info_t* info );
+int32_t stats_ecm_time( uint16_t service_id, uint16_t caid );
+void stats_dump( FILE* f );
+void stats_dump_file();
+
+#endif
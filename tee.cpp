@@ -0,0 +1,120 @@
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tee_client_api.h"
+#include "trace.h"
+#include "tee.h"
+
+// opened with the first cw and kept for the lifetime of the process
+static TEEC_Context g_context;
+static TEEC_Session g_session;
+static TEEC_SharedMemory g_shm;
+static uint8_t g_cw_buffer[TEE_CW_BUFFER];
+static bool g_open = false;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool tee_open()
+{
+	if(g_open)
+		return true;
+
+	TEEC_Result r = TEEC_InitializeContext(NULL, &g_context);
+	if(r != TEEC_SUCCESS)
+	{
+		g_message("%s: TEEC_InitializeContext failed: 0x%08X", __func__, r);
+		return false;
+	}
+
+	TEEC_UUID uuid;
+	uint8_t* n = uuid.clockSeqAndNode;
+	if(sscanf(TEE_TA_UUID, "%8x-%4hx-%4hx-%2hhx%2hhx-%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx", &uuid.timeLow, &uuid.timeMid, &uuid.timeHiAndVersion,
+		&n[0], &n[1], &n[2], &n[3], &n[4], &n[5], &n[6], &n[7]) != 11)
+	{
+		g_message("%s: malformed ta uuid %s", __func__, TEE_TA_UUID);
+		TEEC_FinalizeContext(&g_context);
+		return false;
+	}
+	
+	uint32_t origin = 0;
+
+	r = TEEC_OpenSession(&g_context, &g_session, &uuid, TEEC_LOGIN_PUBLIC, NULL, NULL, &origin);
+	if(r != TEEC_SUCCESS)
+	{
+		g_message("%s: TEEC_OpenSession failed: 0x%08X, origin=%d", __func__, r, origin);
+		TEEC_FinalizeContext(&g_context);
+		return false;
+	}
+
+	// one block for all cws, every command only references it
+	memset(&g_shm, 0, sizeof(g_shm));
+	g_shm.buffer = g_cw_buffer;
+	g_shm.size = sizeof(g_cw_buffer);
+	g_shm.flags = TEEC_MEM_INPUT;
+
+	r = TEEC_RegisterSharedMemory(&g_context, &g_shm);
+	if(r == TEEC_ERROR_NOT_SUPPORTED)
+	{
+		// samsung's libteec can't register client memory, let the tee allocate the block
+		g_shm.buffer = NULL;
+		r = TEEC_AllocateSharedMemory(&g_context, &g_shm);
+	}
+
+	if(r != TEEC_SUCCESS)
+	{
+		g_message("%s: unable to set up the shared memory: 0x%08X", __func__, r);
+		TEEC_CloseSession(&g_session);
+		TEEC_FinalizeContext(&g_context);
+		return false;
+	}
+
+	g_message("%s: session open, shared memory %s", __func__, g_shm.buffer == g_cw_buffer ? "registered" : "allocated");
+
+	g_open = true;
+	return true;
+}
+
+void tee_close()
+{
+	if(!g_open)
+		return;
+
+	TEEC_ReleaseSharedMemory(&g_shm);
+	TEEC_CloseSession(&g_session);
+	TEEC_FinalizeContext(&g_context);
+
+	g_open = false;
+}
+
+bool tee_set_cw( uint8_t bank, int keyidx, uint8_t* cw, uint32_t len )
+{
+	if(len > TEE_CW_BUFFER || !tee_open())
+		return false;
+
+	memcpy(g_shm.buffer, cw, len);
+
+	TEEC_Operation op;
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT, TEEC_MEMREF_PARTIAL_INPUT, TEEC_NONE, TEEC_NONE);
+	op.params[0].value.a = bank;
+	op.params[0].value.b = keyidx < 0 ? 0 : keyidx;	// bank matching uses key 0
+	op.params[1].memref.parent = &g_shm;
+	op.params[1].memref.offset = 0;
+	op.params[1].memref.size = len;
+
+	uint32_t origin = 0;
+	TEEC_Result r = IPC(TRACE_TEE_SET_CW, TEEC_InvokeCommand(&g_session, TEE_CMD_SET_CW, &op, &origin));
+	if(r != TEEC_SUCCESS)
+	{
+		g_message("%s: TEEC_InvokeCommand failed: 0x%08X, origin=%d, bank=%d", __func__, r, origin, bank);
+
+		// the session died with the ta, open a new one with the next cw
+		if(r == TEEC_ERROR_TARGET_DEAD || r == TEEC_ERROR_COMMUNICATION)
+			tee_close();
+
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,18 @@
+#ifndef _TEE_H_
+#define _TEE_H_
+
+#include <stdint.h>
+
+// trusted application doing the key ladder and the descrambler programming: its uuid (a string) and the id of its
+// set cw command (value (bank, keyidx), memref cw) are the firmware's and have no default, the Makefile passes them in
+#if !defined(TEE_TA_UUID) || !defined(TEE_CMD_SET_CW)
+#error "make TEE=1 TEE_UUID=<uuid of the ta> TEE_CMD_SET_CW=<its set cw command id>"
+#endif
+
+#define TEE_CW_BUFFER		64				// largest key sent to the ta
+
+bool tee_open();
+void tee_close();
+bool tee_set_cw( uint8_t bank, int keyidx, uint8_t* cw, uint32_t len );
+
+#endif
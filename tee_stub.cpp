@@ -0,0 +1,92 @@
+/*
+	tee_stub - stand-in for libteec, to run dvbcam's tee path without a trusted os
+
+	make tee_stub && make TEE=1 TEE_UUID=<uuid> TEE_CMD_SET_CW=<id> TEE_LIB="-L. -lteec_stub"
+	every command is logged, the last cw per bank can be checked in the log
+*/
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tee_client_api.h"
+
+static int g_sessions = 0;
+
+TEEC_Result TEEC_InitializeContext( const char *name, TEEC_Context *context )
+{
+	context->imp = NULL;
+	g_message("%s: %s", __func__, name ? name : "default");
+	return TEEC_SUCCESS;
+}
+
+void TEEC_FinalizeContext( TEEC_Context *context )
+{
+	g_message("%s", __func__);
+}
+
+// like the real library: client memory can't be registered
+TEEC_Result TEEC_RegisterSharedMemory( TEEC_Context *context, TEEC_SharedMemory *sharedMem )
+{
+	return TEEC_ERROR_NOT_SUPPORTED;
+}
+
+TEEC_Result TEEC_AllocateSharedMemory( TEEC_Context *context, TEEC_SharedMemory *sharedMem )
+{
+	if(sharedMem->size > TEEC_CONFIG_SHAREDMEM_MAX_SIZE)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	sharedMem->buffer = calloc(1, sharedMem->size);
+	if(!sharedMem->buffer)
+		return TEEC_ERROR_OUT_OF_MEMORY;
+
+	sharedMem->imp.context = context;
+	sharedMem->imp.flags = TEEC_SHMEM_IMP_ALLOCED;
+	return TEEC_SUCCESS;
+}
+
+void TEEC_ReleaseSharedMemory( TEEC_SharedMemory *sharedMem )
+{
+	if(sharedMem->imp.flags == TEEC_SHMEM_IMP_ALLOCED)
+		free(sharedMem->buffer);
+
+	sharedMem->buffer = NULL;
+}
+
+TEEC_Result TEEC_OpenSession( TEEC_Context *context, TEEC_Session *session, const TEEC_UUID *destination, uint32_t connectionMethod, const void *connectionData, TEEC_Operation *operation, uint32_t *returnOrigin )
+{
+	session->imp = (void*)(intptr_t)++g_sessions;
+	g_message("%s: session=%d, ta=%08X-...", __func__, g_sessions, destination->timeLow);
+
+	if(returnOrigin)
+		*returnOrigin = TEEC_ORIGIN_API;
+	return TEEC_SUCCESS;
+}
+
+void TEEC_CloseSession( TEEC_Session *session )
+{
+	g_message("%s: session=%d", __func__, (int)(intptr_t)session->imp);
+}
+
+TEEC_Result TEEC_InvokeCommand( TEEC_Session *session, uint32_t commandID, TEEC_Operation *operation, uint32_t *returnOrigin )
+{
+	if(returnOrigin)
+		*returnOrigin = TEEC_ORIGIN_TRUSTED_APP;
+
+	if(!operation || operation->paramTypes != TEEC_PARAM_TYPES(TEEC_VALUE_INPUT, TEEC_MEMREF_PARTIAL_INPUT, TEEC_NONE, TEEC_NONE))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	TEEC_RegisteredMemoryReference* ref = &operation->params[1].memref;
+	if(!ref->parent || ref->offset + ref->size > ref->parent->size)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	uint8_t* cw = (uint8_t*)ref->parent->buffer + ref->offset;
+	g_message("%s: session=%d, cmd=0x%X, bank=%d, keyidx=%d, key[%d]=%02X %02X %02X %02X ...", __func__, (int)(intptr_t)session->imp, commandID,
+		operation->params[0].value.a, operation->params[0].value.b, ref->size, cw[0], cw[1], cw[2], cw[3]);
+
+	return TEEC_SUCCESS;
+}
+
+void TEEC_RequestCancellation( TEEC_Operation *operation )
+{
+}
@@ -0,0 +1,101 @@
+#ifdef DVBCAM_TRACE
+
+#include "trace.h"
+
+// how a method reports failure
+typedef enum trace_status {
+	TVS_STATUS,			// tvs-api: > 0 on success
+	ZERO_STATUS,		// pvr_drm_client: 0 on success
+	NEG_STATUS,			// svc_pvr: < 0 on error
+	PTR_STATUS,			// NULL on error
+	NO_STATUS,
+} trace_status_t;
+
+typedef struct trace_entry {
+	const char* name;
+	trace_status_t status;
+	volatile uint32_t calls;
+	volatile uint32_t failures;
+	volatile uint64_t total;			// us
+	volatile uint32_t max;				// us
+	volatile uint32_t hist[TRACE_BUCKETS];
+} trace_entry_t;
+
+static trace_entry_t g_trace[TRACE_METHODS] = {
+	{ "CreateServiceNavigation", TVS_STATUS },
+	{ "GetCurrentServiceInfo", TVS_STATUS },
+	{ "GetStartService", TVS_STATUS },
+	{ "CreateAVControl", TVS_STATUS },
+	{ "GetTVStreamProperty", TVS_STATUS },
+	{ "CreateSectionSubscriber", TVS_STATUS },
+	{ "Subscribe", TVS_STATUS },
+	{ "SubscribeByFilter", TVS_STATUS },
+	{ "Unsubscribe", TVS_STATUS },
+	{ "CreateSignalSubscriber", TVS_STATUS },
+	{ "SignalSubscribe", TVS_STATUS },
+	{ "SignalUnsubscribe", TVS_STATUS },
+	{ "svc_pvr_service_init", NEG_STATUS },
+	{ "svc_pvr_register_signal_cb", NEG_STATUS },
+	{ "svc_pvr_unregister_signal_cb", NEG_STATUS },
+	{ "pvr_drm_client_context_create", PTR_STATUS },
+	{ "pvr_drm_client_context_destroy", NO_STATUS },
+	{ "pvr_drm_client_jackpack_convert_key", ZERO_STATUS },
+	{ "pvr_drm_client_player_start_decrypt", ZERO_STATUS },
+	{ "pvr_drm_client_player_stop_decrypt", ZERO_STATUS },
+	{ "CA_SET_DESCR", NEG_STATUS },
+	{ "CA_SET_PID", NEG_STATUS },
+	{ "TEEC_InvokeCommand", ZERO_STATUS },
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void trace_record( trace_method_t method, uint64_t start, long result )
+{
+	uint32_t us = (uint32_t)(stats_now() - start);
+	trace_entry_t* e = &g_trace[method];
+
+	bool failed = (e->status == TVS_STATUS && result <= 0) ||
+				  (e->status == ZERO_STATUS && result != 0) ||
+				  (e->status == NEG_STATUS && result < 0) ||
+				  (e->status == PTR_STATUS && result == 0);
+
+	int bucket = 0;
+	while(bucket < TRACE_BUCKETS - 1 && us >= (1u << bucket))
+		bucket++;
+
+	__sync_add_and_fetch(&g_stats.ipc_calls, 1);
+	__sync_add_and_fetch(&e->calls, 1);
+	__sync_add_and_fetch(&e->failures, failed);
+	__sync_add_and_fetch(&e->total, us);
+	__sync_add_and_fetch(&e->hist[bucket], 1);
+
+	if(us > e->max)
+		e->max = us;
+}
+
+void trace_dump( FILE* f )
+{
+	for(int i = 0; i < TRACE_METHODS; i++)
+	{
+		trace_entry_t* e = &g_trace[i];
+		if(!e->calls)
+			continue;
+
+		fprintf(f, "ipc.%s.calls %u\n", e->name, e->calls);
+		fprintf(f, "ipc.%s.failures %u\n", e->name, e->failures);
+		fprintf(f, "ipc.%s.avg_us %llu\n", e->name, (unsigned long long)(e->total / e->calls));
+		fprintf(f, "ipc.%s.max_us %u\n", e->name, e->max);
+
+		// bucket b counts calls faster than 2^b us, the last one everything slower
+		for(int b = 0; b < TRACE_BUCKETS; b++)
+			if(e->hist[b])
+			{
+				if(b < TRACE_BUCKETS - 1)
+					fprintf(f, "ipc.%s.hist.lt_%u_us %u\n", e->name, 1u << b, e->hist[b]);
+				else
+					fprintf(f, "ipc.%s.hist.ge_%u_us %u\n", e->name, 1u << (b - 1), e->hist[b]);
+			}
+	}
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+// tvs-api and pvr-service calls worth tracing
+typedef enum trace_method {
+	TRACE_CREATE_SERVICE_NAVIGATION = 0,
+	TRACE_GET_CURRENT_SERVICE_INFO,
+	TRACE_GET_START_SERVICE,
+	TRACE_CREATE_AV_CONTROL,
+	TRACE_GET_TV_STREAM_PROPERTY,
+	TRACE_CREATE_SECTION_SUBSCRIBER,
+	TRACE_SECTION_SUBSCRIBE,
+	TRACE_SECTION_SUBSCRIBE_BY_FILTER,
+	TRACE_SECTION_UNSUBSCRIBE,
+	TRACE_CREATE_SIGNAL_SUBSCRIBER,
+	TRACE_SIGNAL_SUBSCRIBE,
+	TRACE_SIGNAL_UNSUBSCRIBE,
+	TRACE_PVR_SERVICE_INIT,
+	TRACE_PVR_REGISTER_SIGNAL_CB,
+	TRACE_PVR_UNREGISTER_SIGNAL_CB,
+	TRACE_DRM_CONTEXT_CREATE,
+	TRACE_DRM_CONTEXT_DESTROY,
+	TRACE_DRM_CONVERT_KEY,
+	TRACE_DRM_START_DECRYPT,
+	TRACE_DRM_STOP_DECRYPT,
+	TRACE_CA_SET_DESCR,
+	TRACE_CA_SET_PID,
+	TRACE_TEE_SET_CW,
+	TRACE_METHODS
+} trace_method_t;
+
+#define TRACE_BUCKETS	21				// log2 latency buckets: < 1us, < 2us, ... , >= 512ms
+
+#ifdef DVBCAM_TRACE
+
+void trace_record( trace_method_t method, uint64_t start, long result );
+void trace_dump( FILE* f );
+
+static inline long trace_result( int r ) { return r; }
+static inline long trace_result( void* r ) { return r != NULL; }
+
+// counts, times and checks the result of one ipc, evaluates to the call result
+#define IPC(method, call)	([&]() { uint64_t _start = stats_now(); auto _r = (call); trace_record(method, _start, trace_result(_r)); return _r; }())
+#define IPC_VOID(method, call)	([&]() { uint64_t _start = stats_now(); (call); trace_record(method, _start, 1); }())
+
+#else
+
+static inline void trace_dump( FILE* f ) {}
+
+#define IPC(method, call)	(__sync_add_and_fetch(&g_stats.ipc_calls, 1), (call))
+#define IPC_VOID(method, call)	IPC(method, call)
+
+#endif
+
+#endif
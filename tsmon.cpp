@@ -0,0 +1,201 @@
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/unistd.h>
+#include <sys/ioctl.h>
+#include <linux/dvb/dmx.h>
+
+#include "stats.h"
+#include "tsmon.h"
+
+#define TS_PACKET_SIZE		188
+#define TS_READ_PACKETS		64
+#define TS_BUFFER_SIZE		(TS_PACKET_SIZE * 1024)
+
+// one ts tap per descrambler bank
+typedef struct tsmon {
+	GThread* thread;
+	volatile bool running;
+	uint16_t pid;
+	volatile uint64_t cw_time;			// last cw programming, 0 once the stream was seen clear after it
+	volatile int parity;				// transport_scrambling_control of the last packet: 0 clear, 2 even, 3 odd
+	uint64_t scrambled_since;			// 0 while the stream is clear
+} tsmon_t;
+
+static tsmon_t g_tsmon[TSMON_MAX_BANKS];
+static tsmon_stall_cb g_stall_cb = NULL;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void check_packet( uint8_t bank, uint8_t* pkt, uint64_t now )
+{
+	tsmon_t* m = &g_tsmon[bank];
+
+	// sync byte, payload present
+	if(pkt[0] != 0x47 || !(pkt[3] & 0x10))
+		return;
+
+	m->parity = pkt[3] >> 6;
+
+	if(m->parity == 0)
+	{
+		if(m->cw_time && m->scrambled_since)
+		{
+			stats_latency_add(&g_stats.first_clear, (uint32_t)(now - m->cw_time));
+			g_message("%s: bank=%d clear %d ms after cw", __func__, bank, (int)((now - m->cw_time) / 1000));
+		}
+
+		m->cw_time = 0;
+		m->scrambled_since = 0;
+		return;
+	}
+
+	if(!m->scrambled_since)
+		m->scrambled_since = now;
+
+	// scrambled for too long, although a cw was programmed; no cw yet is for check_stalls to judge
+	if(m->cw_time && now - m->scrambled_since > TSMON_STALL_MS * 1000 && now - m->cw_time > TSMON_STALL_MS * 1000)
+	{
+		g_message("%s: bank=%d, pid=0x%04X still scrambled after %d ms", __func__, bank, m->pid, (int)((now - m->scrambled_since) / 1000));
+		__sync_add_and_fetch(&g_stats.ts_stalls, 1);
+
+		m->scrambled_since = now;
+		if(g_stall_cb)
+			g_stall_cb(bank);
+	}
+}
+
+static gpointer tsmon_thread( gpointer data )
+{
+	uint8_t bank = (uint8_t)(uintptr_t)data;
+	tsmon_t* m = &g_tsmon[bank];
+
+	char device_name[128];
+	sprintf(device_name, "/dev/dvb/adapter0/demux%d", bank);
+
+	int fd = open(device_name, O_RDONLY | O_NONBLOCK);
+	if(fd < 0)
+	{
+		g_message("%s: unable to open device %s (%d): %s", __func__, device_name, errno, strerror(errno));
+		return NULL;
+	}
+
+	ioctl(fd, DMX_SET_BUFFER_SIZE, TS_BUFFER_SIZE);
+
+	struct dmx_pes_filter_params params;
+	params.pid = m->pid;
+	params.input = DMX_IN_FRONTEND;
+	params.output = DMX_OUT_TSDEMUX_TAP;
+	params.pes_type = DMX_PES_OTHER;
+	params.flags = DMX_IMMEDIATE_START;
+
+	if(ioctl(fd, DMX_SET_PES_FILTER, &params) < 0)
+	{
+		g_message("%s: DMX_SET_PES_FILTER failed, bank=%d, pid=0x%04X: %s", __func__, bank, m->pid, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	g_message("%s: monitoring bank=%d, pid=0x%04X", __func__, bank, m->pid);
+
+	uint8_t buff[TS_PACKET_SIZE * TS_READ_PACKETS];
+	struct pollfd pfd = { fd, POLLIN, 0 };
+
+	while(m->running)
+	{
+		if(poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		int nread = read(fd, buff, sizeof(buff));
+		if(nread < 0)
+		{
+			// buffer overflows are expected when the thread gets delayed, just carry on
+			if(errno != EAGAIN && errno != EOVERFLOW)
+				g_message("%s: read failed, bank=%d: %s", __func__, bank, strerror(errno));
+			continue;
+		}
+
+		uint64_t now = stats_now();
+		for(int p = 0; p + TS_PACKET_SIZE <= nread; p += TS_PACKET_SIZE)
+			check_packet(bank, buff + p, now);
+	}
+
+	ioctl(fd, DMX_STOP);
+	close(fd);
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tsmon_init( tsmon_stall_cb cb )
+{
+	g_stall_cb = cb;
+}
+
+void tsmon_start( uint8_t bank, uint16_t pid )
+{
+	if(bank >= TSMON_MAX_BANKS)
+		return;
+
+	tsmon_t* m = &g_tsmon[bank];
+	if(m->thread && m->pid == pid)
+		return;
+
+	tsmon_stop(bank);
+
+	m->pid = pid;
+	m->parity = 0;
+	m->scrambled_since = 0;
+	m->running = true;
+	m->thread = g_thread_new("tsmon", tsmon_thread, (gpointer)(uintptr_t)bank);
+}
+
+void tsmon_stop( uint8_t bank )
+{
+	if(bank >= TSMON_MAX_BANKS || !g_tsmon[bank].thread)
+		return;
+
+	g_tsmon[bank].running = false;
+	g_thread_join(g_tsmon[bank].thread);
+	g_tsmon[bank].thread = NULL;
+}
+
+void tsmon_cw_set( uint8_t bank )
+{
+	if(bank < TSMON_MAX_BANKS && !g_tsmon[bank].cw_time)
+		g_tsmon[bank].cw_time = stats_now();
+}
+
+// scrambling control bits last seen on the bank (0 clear or unknown, 2 even, 3 odd)
+int tsmon_parity( uint8_t bank )
+{
+	return bank < TSMON_MAX_BANKS && g_tsmon[bank].thread ? g_tsmon[bank].parity : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// pid of the first video stream in a pmt section, the first elementary stream if there is no video
+uint16_t get_pmt_monitor_pid( uint8_t* pmt )
+{
+	int len = 3 + ((pmt[1] & 0x0F) << 8) + pmt[2] - 4;		// without crc
+	int p = 12 + ((pmt[10] & 0x0F) << 8) + pmt[11];
+	uint16_t pid = 0;
+
+	for( ; p + 5 <= len; p += 5 + ((pmt[p + 3] & 0x0F) << 8) + pmt[p + 4])
+	{
+		uint8_t stream_type = pmt[p];
+		uint16_t es_pid = ((pmt[p + 1] & 0x1F) << 8) + pmt[p + 2];
+
+		if(stream_type == 0x01 || stream_type == 0x02 || stream_type == 0x10 || stream_type == 0x1B || stream_type == 0x24)
+			return es_pid;
+
+		if(!pid)
+			pid = es_pid;
+	}
+
+	return pid;
+}
@@ -0,0 +1,20 @@
+#ifndef _TSMON_H_
+#define _TSMON_H_
+
+#include <stdint.h>
+
+#define TSMON_MAX_BANKS		8
+#define TSMON_STALL_MS		3000			// stream still scrambled this long after a cw is a stall
+
+// called from the monitor thread when the stream on bank stays scrambled
+typedef void (*tsmon_stall_cb)( uint8_t bank );
+
+void tsmon_init( tsmon_stall_cb cb );
+void tsmon_start( uint8_t bank, uint16_t pid );
+void tsmon_stop( uint8_t bank );
+void tsmon_cw_set( uint8_t bank );
+int tsmon_parity( uint8_t bank );
+
+uint16_t get_pmt_monitor_pid( uint8_t* pmt );
+
+#endif
@@ -0,0 +1,1413 @@
+/*
+	zap_bench - zap to first cw of the whole daemon against a simulated tvs-api and oscam on a virtual clock (make zap_bench)
+
+	usage: zap_bench [-n zaps] [-s seed] [scenario...]
+		-n	zaps per scenario, default 200
+		-s	seed of the simulated delays, default 1
+
+	scenarios (all by default):
+		rapid_zap		main zapping, every fourth zap moves on before its cw came
+		pip_zap			main and pip zapping in turns, pip sometimes to the service on main
+		record			recordings started and stopped while main zaps, some of the service watched
+		oscam_reconnect	main zapping, oscam goes away for up to 2 s after every fifth zap, sometimes before its cw
+		emm_flood		main zapping with an emm section every ms on the emm filter
+
+	dvbcam.cpp is linked in as it is, its main renamed, and runs with all its threads: the bench stands in for tvs-api, the
+	pvr service, the key programming backend (BACKEND=sim, so to speak) and the ts monitor, and plays oscam on the dvbapi
+	socket. sections, ecm answers and crypto periods follow the virtual clock, and so does everything the daemon times with
+	stats_now: the cw window, the stall checks, the filter grace.
+
+	per scenario, one "name value" line each:
+		<scenario>.zap.count					zaps that got their first cw
+		<scenario>.zap.aborted					zaps left (zapped away, stopped) before it
+		<scenario>.zap.first_cw_us.p50/p90/p99/max	tune signal to the first cw of the service on its bank, virtual time
+		<scenario>.zap.ipc_calls.avg			tvs-api calls per zap
+		<scenario>.zap.syscalls.avg				read/write family syscalls per zap (/proc/self/io, the bench's own taken out)
+		<scenario>.zap.allocs.avg				operator new calls per zap
+	the counts take in everything the daemon did meanwhile, e.g. the emm sections it forwarded
+
+	it takes the daemon's socket and state file: stop dvbcam first
+*/
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <new>
+#include <algorithm>
+
+#include <include/uapi/linux/dvb/ca.h>
+#include <linux/dvb/dmx.h>
+
+#include "tvs-api/TVServiceAPI.h"
+#include "capmt.h"
+#include "descrambler.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "tsmon.h"
+
+// dvbcam.cpp is built with -Dmain=dvbcam_main
+#undef main
+int dvbcam_main( int argc, char *argv[] );
+
+// the daemon's, from dvbcam.cpp
+extern pthread_mutex_t g_state_lock;
+extern int g_wake_fd;
+extern int g_filter_grace_ms;
+extern int g_cw_window_us;
+void wake_socket_thread();
+void wait_ipc();
+
+#define SIM_SOCKET			"/tmp/.listen.camd.socket"		// capmt_socket_name of dvbcam.cpp
+#define SIM_SERVICES		16
+#define SIM_PROFILES		3				// main, pip, record on screen 0
+#define SIM_BANKS			2				// record has a tuner of its own, pip shares it
+#define SIM_SUBSCRIPTIONS	64
+#define SIM_EVENTS			1024
+#define SIM_DEMUX			8
+#define SIM_SAMPLES			4096
+#define SIM_TICK_US			250000			// the socket thread gets a pass at least this often, for the stall checks and the filter grace
+
+#define PMT_DELAY_US		150000			// pmt repetition, the first one after a subscription comes within this
+#define ECM_REPEAT_US		100000
+#define EMM_REPEAT_US		500000			// per emm subscription, emm_flood sends one every EMM_FLOOD_US
+#define EMM_FLOOD_US		1000
+#define CRYPTO_PERIOD_US	10000000
+#define OSCAM_REPLY_US		2000			// CA PMT to its filters
+#define ECM_TIME_US			80000			// ecm answers take this plus up to ECM_SPREAD_US, one in 20 up to ECM_SLOW_US more
+#define ECM_SPREAD_US		220000
+#define ECM_SLOW_US			1500000
+
+#define SIM_CAID			0x0100
+#define SIM_EMM_PID			0x1FF0
+#define PROGRAM(s)			(0x1001 + (s))
+#define ECM_PID(s)			(0x1800 + (s))
+#define SERVICE_ID(s)		(0x2A000000ULL + PROGRAM(s))
+
+typedef struct sim_profile {
+	EProfile type;
+	int bank;
+	int service;					// tuned, -1 if stopped
+	int last;						// what tvs-api still reports after a stop, -1 if never tuned
+} sim_profile_t;
+
+typedef struct sim_subscription {
+	int handle;						// 0 if free
+	int user_param;
+	int profile;
+	bool pmt;
+	uint16_t program_number;		// pmt subscriptions
+	uint16_t pid;					// filter subscriptions
+} sim_subscription_t;
+
+typedef enum sim_event_type {
+	EV_SECTION,						// a: subscription, b: its handle
+	EV_FILTERS,						// oscam sets the filters of demux a, generation b
+	EV_CW,							// oscam answers the ecm of demux a, generation b, crypto period c
+	EV_NUDGE,						// a socket thread pass, e.g. for a held back cw
+} sim_event_type_t;
+
+typedef struct sim_event {
+	uint64_t time;
+	uint32_t seq;					// events of the same time run in order
+	sim_event_type_t type;
+	int a;
+	uint32_t b, c;
+} sim_event_t;
+
+// oscam's view of a demux
+typedef struct sim_demux {
+	int service;					// -1 if not descrambling
+	uint32_t generation;			// bumped on every change, events of an older one are dropped
+	uint32_t last_ecm;				// crypto period + 1 of the ecm answered last, 0 for none
+	bool filters;
+} sim_demux_t;
+
+typedef struct sim_oscam {
+	int fd;							// -1 if not connected
+	uint16_t protocol;				// 0 until SERVER_INFO was sent
+	uint32_t msgid;
+	uint8_t buf[16384];
+	int buffered;
+	sim_demux_t demux[SIM_DEMUX];
+} sim_oscam_t;
+
+typedef struct sim_zap {
+	uint64_t start;					// virtual us, 0 if no zap pending on the bank
+	int service;
+	uint32_t ipc_calls;
+	uint32_t syscalls;
+	uint32_t allocs;
+	uint32_t wakes;
+} sim_zap_t;
+
+typedef struct sim_sample {
+	uint32_t first_cw;
+	uint32_t ipc_calls;
+	uint32_t syscalls;
+	uint32_t allocs;
+} sim_sample_t;
+
+static const EProfile g_profile_types[SIM_PROFILES] = { PROFILE_TYPE_MAIN, PROFILE_TYPE_PIP, PROFILE_TYPE_RECORD };
+enum { MAIN, PIP, RECORD };
+
+static volatile uint64_t g_now = 1000000;
+static uint64_t g_last_pass = 0;
+static uint32_t g_seed = 1;
+static volatile uint32_t g_allocs = 0;
+static volatile uint32_t g_wakes = 0;
+static uint32_t g_syscall_overhead = 0;
+static uint64_t g_emm_repeat = EMM_REPEAT_US;
+
+static sim_profile_t g_profiles[SIM_PROFILES];
+static sim_subscription_t g_subscriptions[SIM_SUBSCRIPTIONS];
+static int g_handles = 0;
+static sim_event_t g_events[SIM_EVENTS];
+static int g_event_count = 0;
+static uint32_t g_event_seq = 0;
+static sim_oscam_t g_oscam;
+
+static pthread_mutex_t g_zap_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_zap_t g_zaps[SIM_BANKS];
+static sim_sample_t g_samples[SIM_SAMPLES];
+static uint32_t g_sample_count = 0, g_aborted = 0;
+
+static SectionCallback g_on_section = NULL;
+static TTSignalCallback g_on_signal = NULL;
+
+static void settle();
+static void oscam_receive();
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the daemon's allocations, tvs-api's included; the bench itself does not allocate once it runs
+void* operator new( size_t size )
+{
+	__sync_add_and_fetch(&g_allocs, 1);
+
+	void* p = malloc(size ? size : 1);
+	if(!p)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void operator delete( void* p ) noexcept
+{
+	free(p);
+}
+
+static uint64_t sim_clock()
+{
+	return __atomic_load_n(&g_now, __ATOMIC_ACQUIRE);
+}
+
+static void set_clock( uint64_t now )
+{
+	__atomic_store_n(&g_now, now, __ATOMIC_RELEASE);
+}
+
+static uint32_t sim_random( uint32_t n )
+{
+	g_seed = g_seed * 1103515245 + 12345;
+	return n ? (g_seed >> 8) % n : 0;
+}
+
+// read + write syscalls of the whole process so far (needs task io accounting, 0 otherwise)
+static uint32_t get_syscalls()
+{
+	FILE* f = fopen("/proc/self/io", "r");
+	if(!f)
+		return 0;
+
+	char line[64];
+	unsigned long long value, total = 0;
+
+	while( fgets(line, sizeof(line), f) )
+		if( sscanf(line, "syscr: %llu", &value) == 1 || sscanf(line, "syscw: %llu", &value) == 1 )
+			total += value;
+
+	fclose(f);
+
+	return (uint32_t)total;
+}
+
+static uint32_t mpeg_crc32( const uint8_t* p, int len )
+{
+	uint32_t crc = 0xFFFFFFFF;
+	for(int i = 0; i < len; i++)
+	{
+		crc ^= (uint32_t)p[i] << 24;
+		for(int b = 0; b < 8; b++)
+			crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+	}
+
+	return crc;
+}
+
+static int finish_section( uint8_t* buf, int len, bool crc )
+{
+	if(crc)
+		len += 4;
+
+	buf[1] = (buf[1] & 0xF0) | (((len - 3) >> 8) & 0x0F);
+	buf[2] = (len - 3) & 0xFF;
+
+	if(crc)
+	{
+		uint32_t c = htonl(mpeg_crc32(buf, len - 4));
+		memcpy(&buf[len - 4], &c, 4);
+	}
+
+	return len;
+}
+
+// a CA descriptor, a video and an audio stream
+static int make_pmt( uint8_t* buf, int s )
+{
+	uint8_t pmt[] = {
+		0x02, 0xB0, 0x00, (uint8_t)(PROGRAM(s) >> 8), (uint8_t)PROGRAM(s), 0xC1, 0x00, 0x00, 0xE1, 0x00, 0xF0, 0x06,
+		0x09, 0x04, SIM_CAID >> 8, SIM_CAID & 0xFF, (uint8_t)(0xE0 | ECM_PID(s) >> 8), (uint8_t)ECM_PID(s),
+		0x02, 0xE1, 0x00, 0xF0, 0x00,
+		0x04, 0xE1, 0x01, 0xF0, 0x00,
+	};
+
+	memcpy(buf, pmt, sizeof(pmt));
+	return finish_section(buf, sizeof(pmt), true);
+}
+
+// odd/even table id by crypto period, the service and the period in the body
+static int make_ecm( uint8_t* buf, int s, uint32_t period )
+{
+	memset(buf, 0, 64);
+	buf[0] = 0x80 | (period & 1);
+	buf[1] = 0x70;
+	buf[3] = PROGRAM(s) >> 8;
+	buf[4] = PROGRAM(s) & 0xFF;
+	uint32_t p = htonl(period);
+	memcpy(&buf[5], &p, 4);
+
+	return finish_section(buf, 64, false);
+}
+
+static int make_emm( uint8_t* buf )
+{
+	memset(buf, 0, 96);
+	buf[0] = 0x82;
+	buf[1] = 0x70;
+	for(int i = 3; i < 96; i++)
+		buf[i] = sim_random(256);
+
+	return finish_section(buf, 96, false);
+}
+
+// the cw of a service in a crypto period, with the service in its first two bytes
+static void make_cw( uint8_t* cw, int s, uint32_t period )
+{
+	cw[0] = PROGRAM(s) >> 8;
+	cw[1] = PROGRAM(s) & 0xFF;
+	cw[2] = period & 0xFF;
+	cw[3] = cw[0] + cw[1] + cw[2];
+	cw[4] = (period >> 8) & 0xFF;
+	cw[5] = 0x5A;
+	cw[6] = 0xA5;
+	cw[7] = cw[4] + cw[5] + cw[6];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool event_before( const sim_event_t& a, const sim_event_t& b )
+{
+	return a.time != b.time ? a.time < b.time : a.seq < b.seq;
+}
+
+static void schedule( uint64_t delay, sim_event_type_t type, int a, uint32_t b = 0, uint32_t c = 0 )
+{
+	if(g_event_count == SIM_EVENTS)
+	{
+		fprintf(stderr, "zap_bench: event queue full\n");
+		exit(1);
+	}
+
+	int i = g_event_count++;
+	sim_event_t ev = { sim_clock() + delay, g_event_seq++, type, a, b, c };
+
+	for(; i > 0 && event_before(ev, g_events[(i - 1) / 2]); i = (i - 1) / 2)
+		g_events[i] = g_events[(i - 1) / 2];
+	g_events[i] = ev;
+}
+
+static sim_event_t next_event()
+{
+	sim_event_t ev = g_events[0], last = g_events[--g_event_count];
+
+	int i = 0;
+	for(int child; (child = 2 * i + 1) < g_event_count; i = child)
+	{
+		if(child + 1 < g_event_count && event_before(g_events[child + 1], g_events[child]))
+			child++;
+		if(!event_before(g_events[child], last))
+			break;
+		g_events[i] = g_events[child];
+	}
+	g_events[i] = last;
+
+	return ev;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void zap_begin( int bank, int s )
+{
+	sim_zap_t z = { sim_clock(), s, g_stats.ipc_calls, get_syscalls(), g_allocs, g_wakes };
+
+	pthread_mutex_lock(&g_zap_lock);
+	g_aborted += g_zaps[bank].start != 0;
+	g_zaps[bank] = z;
+	pthread_mutex_unlock(&g_zap_lock);
+}
+
+static void zap_cancel( int bank )
+{
+	pthread_mutex_lock(&g_zap_lock);
+	g_aborted += g_zaps[bank].start != 0;
+	g_zaps[bank].start = 0;
+	pthread_mutex_unlock(&g_zap_lock);
+}
+
+// called with the first cw of the zapped service on the bank, from whichever thread programs it
+static void zap_end( sim_zap_t* z )
+{
+	// the tvs-api calls queued before the cw count whether or not the ipc thread got to them yet
+	wait_ipc();
+
+	sim_sample_t* s = &g_samples[g_sample_count++ % SIM_SAMPLES];
+	s->first_cw = (uint32_t)(sim_clock() - z->start);
+	s->ipc_calls = g_stats.ipc_calls - z->ipc_calls;
+	s->allocs = g_allocs - z->allocs;
+
+	// the bench's own: reading /proc/self/io, and a write to the wake eventfd plus the socket thread's read per settle
+	uint32_t own = g_syscall_overhead + 2 * (g_wakes - z->wakes);
+	uint32_t syscalls = get_syscalls() - z->syscalls;
+	s->syscalls = syscalls > own ? syscalls - own : 0;
+
+	z->start = 0;
+}
+
+static uint32_t percentile( uint32_t* sorted, uint32_t n, uint32_t p )
+{
+	return n ? sorted[(n - 1) * p / 100] : 0;
+}
+
+static void report( const char* name )
+{
+	uint32_t n = std::min(g_sample_count, (uint32_t)SIM_SAMPLES);
+	uint32_t first_cw[SIM_SAMPLES];
+	uint64_t ipc_calls = 0, syscalls = 0, allocs = 0;
+
+	for(uint32_t i = 0; i < n; i++)
+	{
+		first_cw[i] = g_samples[i].first_cw;
+		ipc_calls += g_samples[i].ipc_calls;
+		syscalls += g_samples[i].syscalls;
+		allocs += g_samples[i].allocs;
+	}
+	std::sort(first_cw, first_cw + n);
+
+	printf("%s.zap.count %u\n", name, g_sample_count);
+	printf("%s.zap.aborted %u\n", name, g_aborted);
+	printf("%s.zap.first_cw_us.p50 %u\n", name, percentile(first_cw, n, 50));
+	printf("%s.zap.first_cw_us.p90 %u\n", name, percentile(first_cw, n, 90));
+	printf("%s.zap.first_cw_us.p99 %u\n", name, percentile(first_cw, n, 99));
+	printf("%s.zap.first_cw_us.max %u\n", name, percentile(first_cw, n, 100));
+	printf("%s.zap.ipc_calls.avg %.1f\n", name, n ? (double)ipc_calls / n : 0.0);
+	printf("%s.zap.syscalls.avg %.1f\n", name, n ? (double)syscalls / n : 0.0);
+	printf("%s.zap.allocs.avg %.1f\n", name, n ? (double)allocs / n : 0.0);
+	fflush(stdout);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the simulated tvs-api: each profile is tuned to one of the services, the rest answers 0
+
+static int sim_profile( EProfile type )
+{
+	for(int p = 0; p < SIM_PROFILES; p++)
+		if(g_profile_types[p] == type)
+			return p;
+
+	return MAIN;
+}
+
+class SimServiceNavigation : public IServiceNavigation
+{
+public:
+	int profile;
+
+	int GetCurrentServiceInfo(const TCCriteriaHelper& fetchCriteria, TCServiceData& service)
+	{
+		int s = g_profiles[profile].last;
+		if(s < 0)
+			return 0;
+
+		service.Set<unsigned short>(PROGRAM_NUMBER, PROGRAM(s));
+		service.Set<bool>(SCRAMBLED_IN_PMT, true);
+		service.Set<bool>(SCRAMBLED, true);
+		service.Set<TCServiceId>(SERVICE_ID, SERVICE_ID(s));
+		return 1;
+	}
+
+	int SetService(TCServiceId& serviceId, EServiceChangeDirection changeDirection, bool cacheOnly, const std::string& appID) { return 0; }
+	int GetQuietServiceInfo(const TCCriteriaHelper& fetchCriteria, TCServiceData& service) { return 0; }
+	int SetQuietService(const TCServiceId& serviceId) { return 0; }
+	int SetQuietServiceNonDestructive(const TCServiceId& serviceId) { return 0; }
+	int TuneAlone(const TSScanChannel& tuneParams, const std::string& appID) { return 0; }
+	int TuneForFeedingSI(const TSScanChannel& tuneParams, const std::string& appID) { return 0; }
+	int GetTvMode(TSTvMode& tvMode) { return 0; }
+	int GetAvailableTvModes(std::vector<TSTvMode>& tvModes) { return 0; }
+	int SetTvMode(TSTvMode tvMode, const std::string& appID) { return 0; }
+	int SetTvModeInfo(TSTvMode tvMode, bool cacheOnly) { return 0; }
+	int ResetCurrentTvModeInfo(void) { return 0; }
+	int ResetCurrentServiceInfo(void) { return 0; }
+	int ResetPreviousServiceInfo(void) { return 0; }
+	int ResetServiceInfo(TSTvMode tvMode) { return 0; }
+	int SetCurrentServiceInfo(TSTvMode tvMode, const TCServiceId& service) { return 0; }
+	int SetPreviousServiceInfo(TSTvMode tvMode, const TCServiceId& service) { return 0; }
+	int GetPreviousServiceInfo(TSTvMode tvMode, TCServiceId& service) { return 0; }
+	int CheckService(const TCServiceId& service) { return 0; }
+	int SetServiceWithoutChangingServiceInfo(const TCServiceId& service) { return 0; }
+	int SetServiceWithoutChangingPreviousServiceInfo(const TCServiceId& service) { return 0; }
+	int GetNextService(const TCCriteriaHelper& criteria, const TCServiceId& referenceServiceId, TCServiceData& service, TSTvMode tvMode) { return 0; }
+	int GetPreviousService(const TCCriteriaHelper& criteria, const TCServiceId& referenceServiceId, TCServiceData& service, TSTvMode tvMode) { return 0; }
+	int GetOptimumService(const TCCriteriaHelper& criteria, TCServiceData& service, TSTvMode tvMode) { return 0; }
+	int SetNextService(const TCCriteriaHelper& criteria) { return 0; }
+	int SetNextService(const TCCriteriaHelper& criteria, TCServiceData& outService) { return 0; }
+	int SetPreviousService(const TCCriteriaHelper& criteria) { return 0; }
+	int SetPreviousService(const TCCriteriaHelper& criteria, TCServiceData& outService) { return 0; }
+	int SetOptimumService(const TCCriteriaHelper& criteria) { return 0; }
+	int SetOptimumService(const TCCriteriaHelper& criteria, TCServiceData& outService) { return 0; }
+	int GetServiceList(const TCCriteriaHelper& criteria, std::list<TCServiceData*>& services, TSTvMode tvMode, EServiceListType serviceListType, bool includeDefaultCurrent) { return 0; }
+	int GetServiceCount(const TCCriteriaHelper& criteria, int& count, TSTvMode tvMode, EServiceListType serviceListType) { return 0; }
+	int GetStartService(TCServiceId& serviceId, ESource& source) { return 0; }
+	int GetDefaultServiceInfo(TSTvMode tvMode, TCServiceId& service) { return 0; }
+	int SetDTVMode(EDTVModeType mode, bool enable) { return 0; }
+	int SetVideoPID(unsigned short video_pid, EVideoEncodeType vEncType, unsigned short pcr_pid) { return 0; }
+	int SetAudioPID(unsigned short audio_pid, EAudioEncodeType aEncType) { return 0; }
+	int SetServiceNonDestructive(const TCServiceId& serviceId) { return 0; }
+	int NonDestructiveTuneAllowed(const TCServiceId& serviceId1, const TCServiceId& serviceId2, bool& result) { return 0; }
+	int StartSatelliteSetting(void) { return 0; }
+	int StopSatelliteSetting(void) { return 0; }
+	int GetDynamicSIState(bool& active) { return 0; }
+	int SetDynamicSIState(bool active) { return 0; }
+	int TuneBarkerChannel(const TCServiceId& serviceId) { return 0; }
+	int GetLatestTvPlusService(const TCCriteriaHelper& fetchCriteria, TCServiceData& service) { return 0; }
+	int GetCurrentServiceInfo(TSTvMode tvMode, const TCCriteriaHelper& fetchCriteria, TCServiceData& service) { return 0; }
+};
+
+class SimAVControl : public IAVControl
+{
+public:
+	int profile;
+
+	int GetTVStreamProperty(ETVStreamProperty tvstreamProperty, unsigned int& propertyValue)
+	{
+		if(tvstreamProperty != TVSTREAM_PROPERTY_DEMUX_ID || g_profiles[profile].service < 0)
+			return 0;
+
+		propertyValue = g_profiles[profile].bank;
+		return 1;
+	}
+
+	int GetCurrentAudioInfo(ELanguageCode& langCode, int& index) { return 0; }
+	int SetCurrentAudioByIndex(int index) { return 0; }
+	int SetAudioFormat(EAudioEncodeType encodeType, bool isPreferred) { return 0; }
+	int GetAudioFormat(EAudioEncodeType& encodeType) { return 0; }
+	int GetPreferredAudio(unsigned int& index, TSAudio& audio) { return 0; }
+	int GetAVStatus(EAVStatus& avStatus) { return 0; }
+	int FlagAudioLock(bool& flag) { return 0; }
+	int GetResolution(EResolution& resolution, TSResolution& resolutionInfo) { return 0; }
+	int SetResolution(EResolution resolution, const TSResolution& resolutionInfo) { return 0; }
+	int SetServiceLock(ELockedMode mode, unsigned short startTime, unsigned short endTime) { return 0; }
+	int GetColorSystem(EChannelColorSystem& Mode , EChannelColor& Val) { return 0; }
+	int SetColorSystem(EChannelColorSystem Mode , EChannelColor Val) { return 0; }
+	int GetSoundSystem(EChannelSoundSystem& Mode , EChannelSound& Val) { return 0; }
+	int SetSoundSystem(EChannelSoundSystem Mode , EChannelSound Val) { return 0; }
+	int MuteVideo(int onoff) { return 0; }
+	int MuteAudio(int onoff) { return 0; }
+	int MuteVideo(int onoff, EMuteMode muteMode) { return 0; }
+	int MuteAudio(int onoff, EMuteMode muteMode) { return 0; }
+	int CheckAnalogMTS(EMultiSoundMode mode , bool& bCheck) { return 0; }
+	int SetAnalogMTS(EMultiSoundMode userSetMod, bool isPreview) { return 0; }
+	int GetAnalogMTS(EMultiSoundMode& userSetMod) { return 0; }
+	int GetAnalogMTSBySignal(EMultiSoundMode& mode) { return 0; }
+	int ChangeAudio(const TSAudio& audio, const TCServiceId& serviceId) { return 0; }
+	int ChangeVideo(const TSVideo& video) { return 0; }
+	int ReleaseComponent(EComponentType compType) { return 0; }
+	int ReserveComponent(EComponentType compType) { return 0; }
+	int SetAudioDescriptionOnOff(bool onoff) { return 0; }
+	int SetAudioDescriptionVolume(int volume) { return 0; }
+	int UnMuteByRatingPin(void) { return 0; }
+	int GetRatingLockState(bool& lock) { return 0; }
+	int GetDigitalDualSound(long& currentMode, long& nextMode) { return 0; }
+	int GetDigitalDualSound(ELanguageCode& currLanguage, ELanguageCode & nextLanguage) { return 0; }
+	int GetDigitalDualSound(EMultiSoundMode & currMode, EMultiSoundMode & nextMode) { return 0; }
+	int SetDigitalDualSound(ELanguageCode language) { return 0; }
+	int SetDigitalDualSound(EMultiSoundMode mode) { return 0; }
+	int GetAnalogDualSound(EMultiSoundMode& mode) { return 0; }
+	int SetAnalogDualSound(EMultiSoundMode mode) { return 0; }
+	int ControlDualView(const std::vector<unsigned char>& inData, std::vector<unsigned char>& outData) { return 0; }
+	int GetDualTvProperty(const std::vector<unsigned char>& pluginName, const std::vector<unsigned char>& propertyName, std::vector<unsigned char>& value) { return 0; }
+	int SetDualTvProperty(const std::vector<unsigned char>& pluginName, const std::vector<unsigned char>& propertyName, const std::vector<unsigned char>& value) { return 0; }
+	int SetDualViewType(EDualViewType type) { return 0; }
+	int ReapplyResolution(void) { return 0; }
+	int SetAnalogCleanView(bool on) { return 0; }
+	int GetDirect2TvProperty(const std::vector<unsigned char>& pluginName, const std::vector<unsigned char>& propertyName, std::vector<unsigned char>& value) { return 0; }
+	int SetStandbyVideoMute(bool onoff) { return 0; }
+	int IsPipelineTypeDtv(bool& isPipelineDtv) { return 0; }
+	int IsPipelineInPlayingState(bool& isPipelinePlaying) { return 0; }
+	int GetRecommendedResolution(EResolution& resolution) { return 0; }
+	int MuteVideoForCI(int onoff) { return 0; }
+	int MuteAudioForCI(int onoff) { return 0; }
+	int CheckAudioLanguageChangeAvailable(bool& bCheck) { return 0; }
+};
+
+// sections of a subscription come from the service tuned on its profile, the first one after up to a repetition interval
+class SimSectionSubscriber : public ISectionSubscriber
+{
+public:
+	int profile;
+
+	int Subscribe(int userParam, const TCSectionCriteriaHelper& criteria, int& handle)
+	{
+		sim_subscription_t* sub = add(userParam, &handle);
+		if(!sub)
+			return 0;
+
+		sub->pmt = true;
+		sub->program_number = criteria.programNumber;
+		schedule(sim_random(PMT_DELAY_US), EV_SECTION, sub - g_subscriptions, sub->handle);
+		return 1;
+	}
+
+	int SubscribeByFilter(int userParam, const TCSectionFilterCriteriaHelper& filterCriteria, int& handle)
+	{
+		sim_subscription_t* sub = add(userParam, &handle);
+		if(!sub)
+			return 0;
+
+		sub->pmt = false;
+		sub->pid = filterCriteria.pid;
+		schedule(sim_random(sub->pid == SIM_EMM_PID ? g_emm_repeat : ECM_REPEAT_US), EV_SECTION, sub - g_subscriptions, sub->handle);
+		return 1;
+	}
+
+	int Unsubscribe(int handle)
+	{
+		for(int i = 0; i < SIM_SUBSCRIPTIONS; i++)
+			if(g_subscriptions[i].handle == handle)
+			{
+				g_subscriptions[i].handle = 0;
+				return 1;
+			}
+
+		return 0;
+	}
+
+private:
+	sim_subscription_t* add(int userParam, int* handle)
+	{
+		for(int i = 0; i < SIM_SUBSCRIPTIONS; i++)
+			if(!g_subscriptions[i].handle)
+			{
+				sim_subscription_t* sub = &g_subscriptions[i];
+				sub->handle = *handle = ++g_handles;
+				sub->user_param = userParam;
+				sub->profile = profile;
+				return sub;
+			}
+
+		fprintf(stderr, "zap_bench: out of section subscriptions\n");
+		return NULL;
+	}
+};
+
+class SimSignalSubscriber : public ISignalSubscriber
+{
+public:
+	int Subscribe(ESignalType type, void* pUserData, EProfile profileId, unsigned short screenId) { return 1; }
+	int Unsubscribe(ESignalType type, EProfile profileId, unsigned short screenId) { return 1; }
+};
+
+static SimServiceNavigation g_navigation[SIM_PROFILES];
+static SimAVControl g_av_control[SIM_PROFILES];
+static SimSectionSubscriber g_section_subscriber[SIM_PROFILES];
+static SimSignalSubscriber g_signal_subscriber;
+
+// these take the place of libtvs-api's, which only still provides the data classes
+int TVServiceAPI::CreateServiceNavigation(EProfile profileId, int screenId, IServiceNavigation** pSrvNavi)
+{
+	*pSrvNavi = &g_navigation[sim_profile(profileId)];
+	return 1;
+}
+
+int TVServiceAPI::CreateAVControl(EProfile profileId, int screenId, IAVControl** pAVControl)
+{
+	*pAVControl = &g_av_control[sim_profile(profileId)];
+	return 1;
+}
+
+int TVServiceAPI::CreateSectionSubscriber(SectionCallback callback, EProfile profileId, int screenId, ISectionSubscriber** pProgramSubscriber)
+{
+	g_on_section = callback;
+	*pProgramSubscriber = &g_section_subscriber[sim_profile(profileId)];
+	return 1;
+}
+
+int TVServiceAPI::CreateSignalSubscriber(TTSignalCallback callback, ISignalSubscriber** pSignalSubscriber)
+{
+	g_on_signal = callback;
+	*pSignalSubscriber = &g_signal_subscriber;
+	return 1;
+}
+
+void TVServiceAPI::Destroy()
+{
+}
+
+// the pvr signals are not simulated, recordings end with SIGNAL_TUNE_STOP
+extern "C"
+{
+int svc_pvr_service_init() { return 0; }
+int svc_pvr_register_signal_cb( void* cb, void* userparam ) { return 0; }
+int svc_pvr_unregister_signal_cb( void* cb ) { return 0; }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the key programming backend: a zap ends with the first cw of its service on the bank
+
+const char* descrambler_name()
+{
+	return "sim";
+}
+
+void descrambler_enable( uint8_t bank, bool enabled )
+{
+}
+
+bool descrambler_set_mode( uint8_t bank, int index, dmx_ca_type_t ca_type )
+{
+	return true;
+}
+
+bool descrambler_set_cw( uint8_t bank, int index, int parity, uint8_t* cw, int key_len )
+{
+	if(bank >= SIM_BANKS)
+		return false;
+
+	pthread_mutex_lock(&g_zap_lock);
+
+	sim_zap_t* z = &g_zaps[bank];
+	for(int p = parity < 0 ? 0 : parity; z->start && p <= (parity < 0 ? 1 : parity); p++)
+		if(cw[key_len * p] == PROGRAM(z->service) >> 8 && cw[key_len * p + 1] == (PROGRAM(z->service) & 0xFF))
+			zap_end(z);
+
+	pthread_mutex_unlock(&g_zap_lock);
+	return true;
+}
+
+int descrambler_key_slots( uint8_t bank )
+{
+	return 0;
+}
+
+void descrambler_set_pid( uint8_t bank, uint16_t pid, int index )
+{
+}
+
+void descrambler_stop( uint8_t bank )
+{
+}
+
+// no ts to watch
+
+void tsmon_init( tsmon_stall_cb cb )
+{
+}
+
+void tsmon_start( uint8_t bank, uint16_t pid )
+{
+}
+
+void tsmon_stop( uint8_t bank )
+{
+}
+
+void tsmon_cw_set( uint8_t bank )
+{
+}
+
+int tsmon_parity( uint8_t bank )
+{
+	return -1;
+}
+
+uint16_t get_pmt_monitor_pid( uint8_t* pmt )
+{
+	return 0x1FFF;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the simulated oscam: one ecm filter and one emm filter per demux, both parities for every new ecm
+
+static void oscam_send( const uint8_t* msg, int len )
+{
+	if(g_oscam.fd < 0)
+		return;
+
+	uint8_t buf[128];
+	int n = 0;
+
+	if(g_oscam.protocol >= 3)
+	{
+		uint32_t msgid = htonl(++g_oscam.msgid);
+		buf[0] = DVBAPI_FRAME_START;
+		memcpy(&buf[1], &msgid, 4);
+		n = 5;
+	}
+
+	memcpy(buf + n, msg, len);
+	send(g_oscam.fd, buf, n + len, MSG_NOSIGNAL);
+}
+
+static int put_u32( uint8_t* p, uint32_t v )
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+	return 4;
+}
+
+static void oscam_set_filter( int d, int flt, uint16_t pid, uint8_t table, uint8_t mask )
+{
+	uint8_t msg[5 + sizeof(dmx_sct_filter_params)];
+	memset(msg, 0, sizeof(msg));
+	put_u32(msg, DMX_SET_FILTER);
+	msg[4] = d;
+	msg[5] = d;
+	msg[6] = flt;
+	msg[7] = pid >> 8;
+	msg[8] = pid & 0xFF;
+	msg[9] = table;
+	msg[9 + 16] = mask;
+	oscam_send(msg, sizeof(msg));
+}
+
+static void oscam_stop_filters( int d )
+{
+	sim_demux_t* dm = &g_oscam.demux[d];
+	if(!dm->filters)
+		return;
+
+	uint16_t pids[] = { (uint16_t)ECM_PID(dm->service), SIM_EMM_PID };
+	for(int flt = 0; flt < 2; flt++)
+	{
+		uint8_t msg[9];
+		put_u32(msg, DMX_STOP);
+		msg[4] = d;
+		msg[5] = d;
+		msg[6] = flt;
+		msg[7] = pids[flt] >> 8;
+		msg[8] = pids[flt] & 0xFF;
+		oscam_send(msg, sizeof(msg));
+	}
+
+	dm->filters = false;
+}
+
+static void oscam_set_descr( int d, int parity, uint8_t* cw )
+{
+	uint8_t msg[5 + sizeof(ca_descr_t)];
+	put_u32(msg, CA_SET_DESCR);
+	msg[4] = d;
+	put_u32(&msg[5], 0);
+	put_u32(&msg[9], parity);
+	memcpy(&msg[13], cw, 8);
+	oscam_send(msg, sizeof(msg));
+}
+
+static void oscam_ecm_info( int d, int s, uint32_t ms )
+{
+	static const char* strings[] = { "seca", "sim", "local", "internal" };
+
+	uint8_t msg[128];
+	int n = put_u32(msg, DVBAPI_ECM_INFO);
+	msg[n++] = d;
+	msg[n++] = PROGRAM(s) >> 8;
+	msg[n++] = PROGRAM(s) & 0xFF;
+	msg[n++] = SIM_CAID >> 8;
+	msg[n++] = SIM_CAID & 0xFF;
+	msg[n++] = ECM_PID(s) >> 8;
+	msg[n++] = ECM_PID(s) & 0xFF;
+	n += put_u32(&msg[n], 0);
+	n += put_u32(&msg[n], ms);
+	for(int i = 0; i < 4; i++)
+	{
+		msg[n] = strlen(strings[i]);
+		memcpy(&msg[n + 1], strings[i], msg[n]);
+		n += 1 + msg[n];
+	}
+	msg[n++] = 0;
+	oscam_send(msg, n);
+}
+
+static void oscam_capmt( uint8_t* m )
+{
+	int s = ((m[7] << 8) | m[8]) - PROGRAM(0);
+	int d = m[15];
+	if(d >= SIM_DEMUX || s < 0 || s >= SIM_SERVICES)
+	{
+		fprintf(stderr, "zap_bench: CA PMT for demux %d, service %d\n", d, s);
+		return;
+	}
+
+	sim_demux_t* dm = &g_oscam.demux[d];
+
+	// an update or a repeat: the next ecm is answered again
+	dm->last_ecm = 0;
+	if(dm->service == s)
+		return;
+
+	oscam_stop_filters(d);
+	dm->service = s;
+	dm->generation++;
+	schedule(OSCAM_REPLY_US, EV_FILTERS, d, dm->generation);
+}
+
+static void oscam_stop( int d )
+{
+	if(d >= SIM_DEMUX)
+		return;
+
+	oscam_stop_filters(d);
+	g_oscam.demux[d].service = -1;
+	g_oscam.demux[d].generation++;
+}
+
+static void oscam_filter_data( int d, int flt, uint8_t* section )
+{
+	sim_demux_t* dm = &g_oscam.demux[d];
+	if(d >= SIM_DEMUX || flt != 0 || dm->service < 0)
+		return;
+
+	int s = ((section[3] << 8) | section[4]) - PROGRAM(0);
+	uint32_t period = ntohl(*(uint32_t*)&section[5]);
+	if(s != dm->service || dm->last_ecm == period + 1)
+		return;
+
+	dm->last_ecm = period + 1;
+	uint64_t ecm_time = ECM_TIME_US + sim_random(ECM_SPREAD_US) + (sim_random(20) ? 0 : sim_random(ECM_SLOW_US));
+	schedule(ecm_time, EV_CW, d, dm->generation, period);
+}
+
+// size of the message at m, 0 if it is not complete, -1 if it is unknown
+static int message_length( uint8_t* m, int len )
+{
+	int frame = len > 0 && m[0] == DVBAPI_FRAME_START ? 5 : 0;
+	if(len < frame + 4)
+		return 0;
+
+	uint8_t* p = m + frame;
+	uint32_t opcode = ntohl(*(uint32_t*)p);
+
+	// the fixed part, then the length it gives
+	int n;
+	if(opcode == DVBAPI_CLIENT_INFO)
+		n = len < frame + 7 ? -1 : 7 + p[6];
+	else if(opcode == DVBAPI_FILTER_DATA)
+		n = len < frame + 9 ? -1 : 6 + 3 + (((p[7] & 0x0F) << 8) | p[8]);
+	else if(opcode == 0x9F803282)
+		n = len < frame + 6 ? -1 : 6 + ((p[4] << 8) | p[5]);
+	else if(opcode == 0x9F803F04)
+		n = 8;
+	else
+		return -1;
+
+	if(n < 0)
+		return 0;
+
+	return len < frame + n ? 0 : frame + n;
+}
+
+static void oscam_handle( uint8_t* m )
+{
+	if(m[0] == DVBAPI_FRAME_START)
+		m += 5;
+
+	uint32_t opcode = ntohl(*(uint32_t*)m);
+
+	if(opcode == DVBAPI_CLIENT_INFO)
+	{
+		uint8_t msg[] = { 0xFF, 0xFF, 0x00, 0x02, 0x00, DVBAPI_PROTOCOL_VERSION, 9, 'O', 'S', 'C', 'a', 'm', ' ', 's', 'i', 'm' };
+		oscam_send(msg, sizeof(msg));
+		g_oscam.protocol = std::min((m[4] << 8) | m[5], DVBAPI_PROTOCOL_VERSION);
+	}
+	else if(opcode == DVBAPI_FILTER_DATA)
+		oscam_filter_data(m[4], m[5], &m[6]);
+	else if(opcode == 0x9F803282)
+		oscam_capmt(m);
+	else if(opcode == 0x9F803F04)
+		oscam_stop(m[7]);
+}
+
+static void oscam_receive()
+{
+	int nread;
+	while(g_oscam.fd > -1 && (nread = recv(g_oscam.fd, g_oscam.buf + g_oscam.buffered, sizeof(g_oscam.buf) - g_oscam.buffered, MSG_DONTWAIT)) > 0)
+	{
+		g_oscam.buffered += nread;
+
+		int p = 0, n;
+		while((n = message_length(g_oscam.buf + p, g_oscam.buffered - p)) > 0)
+		{
+			oscam_handle(g_oscam.buf + p);
+			p += n;
+		}
+
+		if(n < 0)
+		{
+			fprintf(stderr, "zap_bench: unknown message from dvbcam\n");
+			exit(1);
+		}
+
+		g_oscam.buffered -= p;
+		memmove(g_oscam.buf, g_oscam.buf + p, g_oscam.buffered);
+	}
+
+	if(g_oscam.fd > -1 && nread == 0)
+	{
+		fprintf(stderr, "zap_bench: dvbcam dropped the oscam connection\n");
+		close(g_oscam.fd);
+		g_oscam.fd = -1;
+	}
+}
+
+static void oscam_reset()
+{
+	g_oscam.protocol = 0;
+	g_oscam.msgid = 0;
+	g_oscam.buffered = 0;
+
+	for(int d = 0; d < SIM_DEMUX; d++)
+	{
+		g_oscam.demux[d].service = -1;
+		g_oscam.demux[d].generation++;
+		g_oscam.demux[d].filters = false;
+	}
+}
+
+static bool oscam_connect()
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, SIM_SOCKET);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	oscam_reset();
+	g_oscam.fd = fd;
+
+	// dvbcam opens with CLIENT_INFO, the SERVER_INFO answering it makes it replay the CA PMTs
+	struct pollfd p = { fd, POLLIN, 0 };
+	while(g_oscam.fd > -1 && !g_oscam.protocol && poll(&p, 1, 2000) > 0)
+		oscam_receive();
+
+	settle();
+	return g_oscam.protocol != 0;
+}
+
+static void oscam_disconnect()
+{
+	close(g_oscam.fd);
+	g_oscam.fd = -1;
+	oscam_reset();
+	settle();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// waits for the daemon to take in what the bench did: everything sent to it read (the socket thread only reads under
+// g_state_lock), a socket thread pass at the current virtual time and the tvs-api calls it queued, then its answers
+static void settle()
+{
+	int queued;
+	while(g_oscam.fd > -1 && ioctl(g_oscam.fd, SIOCOUTQ, &queued) == 0 && queued > 0)
+		usleep(20);
+
+	__sync_add_and_fetch(&g_wakes, 1);
+	wake_socket_thread();
+
+	struct pollfd p = { g_wake_fd, POLLIN, 0 };
+	while(poll(&p, 1, 0) > 0)
+		usleep(20);
+
+	pthread_mutex_lock(&g_state_lock);
+	pthread_mutex_unlock(&g_state_lock);
+	wait_ipc();
+
+	g_last_pass = sim_clock();
+	oscam_receive();
+}
+
+static void deliver( sim_subscription_t* sub )
+{
+	int s = g_profiles[sub->profile].service;
+	uint8_t section[256];
+	int len = 0;
+
+	// the pmt comes once, ecms and emms are repeated for as long as the subscription lasts
+	if(sub->pmt)
+	{
+		if(s > -1 && PROGRAM(s) == sub->program_number)
+			len = make_pmt(section, s);
+	}
+	else
+	{
+		if(s > -1 && sub->pid == ECM_PID(s))
+			len = make_ecm(section, s, (uint32_t)(sim_clock() / CRYPTO_PERIOD_US));
+		else if(s > -1 && sub->pid == SIM_EMM_PID)
+			len = make_emm(section);
+
+		schedule(sub->pid == SIM_EMM_PID ? g_emm_repeat : ECM_REPEAT_US, EV_SECTION, sub - g_subscriptions, sub->handle);
+	}
+
+	if(len)
+	{
+		g_on_section(true, len, section, sub->user_param);
+		wait_ipc();
+		oscam_receive();
+	}
+}
+
+static void run_event( sim_event_t* ev )
+{
+	if(ev->type == EV_SECTION)
+	{
+		sim_subscription_t* sub = &g_subscriptions[ev->a];
+		if(sub->handle == (int)ev->b)
+			deliver(sub);
+		return;
+	}
+
+	if(ev->type == EV_NUDGE)
+	{
+		settle();
+		return;
+	}
+
+	sim_demux_t* dm = &g_oscam.demux[ev->a];
+	if(g_oscam.fd < 0 || dm->generation != ev->b || dm->service < 0)
+		return;
+
+	if(ev->type == EV_FILTERS)
+	{
+		oscam_set_filter(ev->a, 0, ECM_PID(dm->service), 0x80, 0xFE);
+		oscam_set_filter(ev->a, 1, SIM_EMM_PID, 0x82, 0xFF);
+		dm->filters = true;
+		settle();
+	}
+	else if(ev->type == EV_CW)
+	{
+		// the cw of the period and the next one, each with its parity
+		uint8_t cw[8];
+		for(uint32_t period = ev->c; period <= ev->c + 1; period++)
+		{
+			make_cw(cw, dm->service, period);
+			oscam_set_descr(ev->a, period & 1, cw);
+		}
+		oscam_ecm_info(ev->a, dm->service, ECM_TIME_US / 1000);
+		settle();
+
+		// in case one parity is still held back for the other
+		schedule(g_cw_window_us + 1, EV_NUDGE, 0);
+	}
+}
+
+static void run_until( uint64_t until )
+{
+	while(g_event_count && g_events[0].time <= until)
+	{
+		sim_event_t ev = next_event();
+
+		// the stall checks and the filter grace see the time go by even without events
+		for(uint64_t t = g_last_pass + SIM_TICK_US; t < ev.time; t = g_last_pass + SIM_TICK_US)
+		{
+			set_clock(t);
+			settle();
+		}
+
+		set_clock(std::max(ev.time, sim_clock()));
+		run_event(&ev);
+	}
+
+	for(uint64_t t = g_last_pass + SIM_TICK_US; t < until; t = g_last_pass + SIM_TICK_US)
+	{
+		set_clock(t);
+		settle();
+	}
+
+	set_clock(until);
+	settle();
+}
+
+static void run_for( uint64_t us )
+{
+	run_until(sim_clock() + us);
+}
+
+static uint64_t dwell( uint64_t min, uint64_t max )
+{
+	return min + sim_random(max - min);
+}
+
+static int other_service( int s )
+{
+	int n = sim_random(SIM_SERVICES - (s > -1));
+	return s > -1 && n >= s ? n + 1 : n;
+}
+
+static void tune( int p, int s )
+{
+	sim_profile_t* pr = &g_profiles[p];
+	pr->service = pr->last = s;
+
+	zap_begin(pr->bank, s);
+
+	TSSignalData data;
+	data.data.ll = SERVICE_ID(s);
+	g_on_signal(SIGNAL_TUNE_SUCCESS, pr->type, DEFAULT_SCREEN_ID, data, NULL);
+	wait_ipc();
+
+	oscam_receive();
+	settle();
+}
+
+static void stop( int p )
+{
+	sim_profile_t* pr = &g_profiles[p];
+	if(pr->service < 0)
+		return;
+
+	zap_cancel(pr->bank);
+
+	TSSignalData data;
+	data.data.ll = SERVICE_ID(pr->service);
+	g_on_signal(SIGNAL_TUNE_STOP, pr->type, DEFAULT_SCREEN_ID, data, NULL);
+	pr->service = -1;
+	wait_ipc();
+
+	oscam_receive();
+	settle();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void rapid_zap( int zaps )
+{
+	for(int i = 0; i < zaps; i++)
+	{
+		tune(MAIN, other_service(g_profiles[MAIN].service));
+		run_for(i % 4 == 3 ? dwell(50000, 300000) : dwell(1000000, 4000000));
+	}
+}
+
+static void pip_zap( int zaps )
+{
+	for(int i = 0; i < zaps; i++)
+	{
+		int p = i & 1 ? PIP : MAIN;
+		int other = g_profiles[p ^ PIP].service;
+
+		tune(p, other > -1 && !sim_random(4) ? other : other_service(g_profiles[p].service));
+		run_for(dwell(500000, 3000000));
+	}
+
+	stop(PIP);
+}
+
+static void record( int zaps )
+{
+	tune(MAIN, other_service(-1));
+	run_for(2000000);
+
+	for(int i = 0; i < zaps; i++)
+	{
+		int r = sim_random(10);
+		if(r < 3 && g_profiles[RECORD].service < 0)
+			tune(RECORD, r ? other_service(g_profiles[MAIN].service) : g_profiles[MAIN].service);
+		else if(r < 3)
+			stop(RECORD);
+		else
+			tune(MAIN, other_service(g_profiles[MAIN].service));
+
+		run_for(dwell(1000000, 5000000));
+	}
+
+	stop(RECORD);
+}
+
+static void oscam_reconnect( int zaps )
+{
+	for(int i = 0; i < zaps; i++)
+	{
+		tune(MAIN, other_service(g_profiles[MAIN].service));
+
+		if(i % 5 == 4)
+		{
+			run_for(dwell(0, 400000));
+			oscam_disconnect();
+			run_for(dwell(200000, 2000000));
+			if(!oscam_connect())
+				fprintf(stderr, "zap_bench: oscam could not connect again\n");
+		}
+
+		run_for(dwell(1000000, 4000000));
+	}
+}
+
+static void emm_flood( int zaps )
+{
+	g_emm_repeat = EMM_FLOOD_US;
+
+	for(int i = 0; i < zaps; i++)
+	{
+		tune(MAIN, other_service(g_profiles[MAIN].service));
+		run_for(dwell(1000000, 3000000));
+	}
+
+	g_emm_repeat = EMM_REPEAT_US;
+}
+
+typedef struct scenario {
+	const char* name;
+	void (*run)( int zaps );
+} scenario_t;
+
+static const scenario_t g_scenarios[] = {
+	{ "rapid_zap", rapid_zap },
+	{ "pip_zap", pip_zap },
+	{ "record", record },
+	{ "oscam_reconnect", oscam_reconnect },
+	{ "emm_flood", emm_flood },
+};
+
+// nothing tuned, the parked filters gone, oscam connected and the counts cleared
+static void reset()
+{
+	for(int p = 0; p < SIM_PROFILES; p++)
+		stop(p);
+
+	if(g_oscam.fd < 0 && !oscam_connect())
+		fprintf(stderr, "zap_bench: oscam could not connect\n");
+
+	run_for(g_filter_grace_ms * 1000ULL + 1000000);
+
+	memset(g_zaps, 0, sizeof(g_zaps));
+	g_sample_count = 0;
+	g_aborted = 0;
+}
+
+static gpointer run_daemon( gpointer data )
+{
+	static char name[] = "dvbcam";
+	char* argv[] = { name, NULL };
+
+	dvbcam_main(1, argv);
+	return NULL;
+}
+
+int main( int argc, char *argv[] )
+{
+	int zaps = 200, opt;
+
+	while((opt = getopt(argc, argv, "n:s:")) != -1)
+	{
+		if(opt == 'n')
+			zaps = atoi(optarg);
+		else if(opt == 's')
+			g_seed = atoi(optarg);
+		else
+		{
+			printf("usage: %s [-n zaps] [-s seed] [scenario...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	int first = optind;
+	optind = 1;
+
+	for(int p = 0; p < SIM_PROFILES; p++)
+	{
+		g_profiles[p].type = g_profile_types[p];
+		g_profiles[p].bank = p == RECORD ? 1 : 0;
+		g_profiles[p].service = g_profiles[p].last = -1;
+		g_navigation[p].profile = g_av_control[p].profile = g_section_subscriber[p].profile = p;
+	}
+	g_profiles[PIP].bank = 1;
+	g_oscam.fd = -1;
+
+	// what reading /proc/self/io costs itself
+	uint32_t before = get_syscalls();
+	g_syscall_overhead = get_syscalls() - before;
+
+	stats_clock = sim_clock;
+	unlink(SNAPSHOT_FILE);
+	g_thread_new("dvbcam", run_daemon, NULL);
+
+	// the daemon is up once it listens, the signals are subscribed and the current services looked up
+	for(int i = 0; i < 500 && !(g_stats.startup.listening && g_stats.startup.signals && g_stats.startup.lookup); i++)
+		usleep(10000);
+
+	if(!g_on_signal || !oscam_connect())
+	{
+		fprintf(stderr, "zap_bench: dvbcam did not come up\n");
+		return 1;
+	}
+
+	int failures = 0;
+	for(auto && sc : g_scenarios)
+	{
+		bool selected = first == argc;
+		for(int i = first; i < argc; i++)
+			selected |= !strcmp(argv[i], sc.name);
+		if(!selected)
+			continue;
+
+		reset();
+		sc.run(zaps);
+		report(sc.name);
+
+		// a scenario without a single cw is broken, not slow
+		failures += !g_sample_count;
+	}
+
+	unlink(SIM_SOCKET);
+	unlink(SNAPSHOT_FILE);
+
+	return failures ? 1 : 0;
+}